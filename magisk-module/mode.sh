@@ -2,4 +2,48 @@
 # 1 - read-write default
 # 2 - read-only locked (cannot remount as read-write)
 
-export OVERLAY_MODE=0
\ No newline at end of file
+export OVERLAY_MODE=0
+# number of threads used to prepare overlay mounts, 1 to prepare them one by one
+export OVERLAY_JOBS=1
+
+# overlayfs options on top of lowerdir, upperdir and workdir, features the kernel
+# does not know are left out and a mount which refuses them falls back to none
+# 0 - none
+# 1 - metacopy: chmod and chown only copy up metadata, not the whole file
+#     (metacopy=on,redirect_dir=on,xino=auto), keep it once files were copied up
+# 2 - 1 and index=on, hardlinks stay hardlinks after copy-up
+# 3 - 1 and volatile, upper is never synced, only used when the writable dir is a tmpfs
+export OVERLAY_PROFILE=0
+
+# 0 - legacy: stage overlays in a tmpfs and bind mount them
+# 1 - use new mount API (fsopen/fsmount/move_mount) when kernel supports it
+export OVERLAY_MOUNT_API=1
+
+# 1 - write log in binary format to /cache/overlayfs.log.bin (faster)
+#     read it with: overlayfs_system --decode-log /cache/overlayfs.log.bin
+export OVERLAY_LOG_BINARY=0
+
+# 1 - each overlayfs only stacks module layers which have files under it
+# 0 - stack every module under every overlayfs
+export OVERLAY_PRUNE_LAYERS=1
+
+# 1 - in read-only modes, directories without files in the upper layer or in any
+#     module keep their stock mounts, mount them later with --mount-dir
+export OVERLAY_SELECTIVE=0
+
+# 1 - before mounting, remove copy-ups identical to lower, orphan whiteouts
+#     and empty directories from the upper layer
+export OVERLAY_COMPACT=0
+
+# 1 - files shipped by more than one module are stacked from one shared copy
+#     in the writable image, so they are only cached once
+export OVERLAY_DEDUP=0
+
+# 1 - after mounting, read ahead the files listed in /data/adb/overlay.hot
+#     in background at idle I/O priority
+# 2 - also save the files cached at boot completed as the list for next boot
+export OVERLAY_PREFETCH=0
+
+# record mountinfo, environment and every mount, stat and label call of the next boot
+# with its latency to this file, replay it with: overlayfs_system --replay <file>
+export OVERLAY_TRACE=
@@ -30,56 +30,49 @@ mkdir -p "$MODULEMNT"
 
 mount -t tmpfs tmpfs "$MODULEMNT"
 
-loop_setup() {
-  unset LOOPDEV
-  local LOOP
-  local MINORX=1
-  [ -e /dev/block/loop1 ] && MINORX=$(stat -Lc '%T' /dev/block/loop1)
-  local NUM=0
-  while [ $NUM -lt 2048 ]; do
-    LOOP=/dev/block/loop$NUM
-    [ -e $LOOP ] || mknod $LOOP b 7 $((NUM * MINORX))
-    if losetup $LOOP "$1" 2>/dev/null; then
-      LOOPDEV=$LOOP
-      break
-    fi
-    NUM=$((NUM + 1))
-  done
-}
-
-if [ -f "$OVERLAYDIR" ]; then
-    loop_setup /data/adb/overlay
-    if [ ! -z "$LOOPDEV" ]; then
-        mount -o rw -t ext4 "$LOOPDEV" "$OVERLAYMNT"
-        ln "$LOOPDEV" /dev/block/overlayfs_loop
-    fi
-fi
-
-if ! "$MODDIR/overlayfs_system" --test --check-ext4 "$OVERLAYMNT"; then
-    echo "unable to mount writeable dir" >>/cache/overlayfs.log
-    exit
-fi
+# attach and mount writeable image and module images in one go
+# overlayfs_system prints "<mountpoint> <loop device>" for each mounted ext4 image
+set --
+[ -f "$OVERLAYDIR" ] && set -- rw "$OVERLAYDIR" "$OVERLAYMNT"
 
 for i in /data/adb/modules/*; do
     [ ! -e "$i" ] && break;
     module_name="$(basename "$i")"
     if [ ! -e "$i/disable" ] && [ ! -e "$i/remove" ] && [ -f "$i/overlay.img" ]; then
-        loop_setup "$i/overlay.img"
-        if [ ! -z "$LOOPDEV" ]; then
-            echo "mount overlayfs for module: $module_name" >>/cache/overlayfs.log
-            mkdir -p "$MODULEMNT/$module_name"
-            mount -o rw -t ext4 "$LOOPDEV" "$MODULEMNT/$module_name"
-        fi
+        echo "mount overlayfs for module: $module_name" >>/cache/overlayfs.log
+        mkdir -p "$MODULEMNT/$module_name"
+        set -- "$@" ro "$i/overlay.img" "$MODULEMNT/$module_name"
     fi
 done
 
+MOUNTED=""
+if [ "$#" -gt 0 ]; then
+    MOUNTED="$("$MODDIR/overlayfs_system" --mount-images "$@")"
+fi
+
+OVERLAYMNT_OK=false
+while read -r MNT LOOPDEV; do
+    [ -z "$MNT" ] && continue
+    if [ "$MNT" == "$OVERLAYMNT" ]; then
+        ln "$LOOPDEV" /dev/block/overlayfs_loop
+        OVERLAYMNT_OK=true
+    fi
+done <<EOF
+$MOUNTED
+EOF
+
+if ! $OVERLAYMNT_OK && ! "$MODDIR/overlayfs_system" --test --check-ext4 "$OVERLAYMNT"; then
+    echo "unable to mount writeable dir" >>/cache/overlayfs.log
+    exit
+fi
+
 OVERLAYLIST=""
 
 for i in "$MODULEMNT"/*; do
     [ ! -e "$i" ] && break;
-    if "$MODDIR/overlayfs_system" --test --check-ext4 "$i"; then
-        OVERLAYLIST="$i:$OVERLAYLIST"
-    fi
+    case "$MOUNTED" in
+        *"$i "*) OVERLAYLIST="$i:$OVERLAYLIST" ;;
+    esac
 done
 
 mkdir -p "$OVERLAYMNT/upper"
@@ -95,6 +88,15 @@ fi
 
 # overlay_system <writeable-dir>
 . "$MODDIR/mode.sh"
+if [ "$OVERLAY_COMPACT" == 1 ]; then
+    "$MODDIR/overlayfs_system" --compact "$OVERLAYMNT"
+fi
+if [ "$OVERLAY_DEDUP" == 1 ] && [ ! -z "$OVERLAYLIST" ]; then
+    # shared copies go on top of the module layers
+    if "$MODDIR/overlayfs_system" --dedup "$OVERLAYMNT" && [ -d "$OVERLAYMNT/dedup" ]; then
+        export OVERLAYLIST="$OVERLAYMNT/dedup:$OVERLAYLIST"
+    fi
+fi
 "$MODDIR/overlayfs_system" "$OVERLAYMNT" | tee -a /cache/overlayfs.log
 
 if [ ! -z "$MAGISKTMP" ]; then
@@ -103,21 +105,11 @@ if [ ! -z "$MAGISKTMP" ]; then
 fi
 
 rm -rf /dev/.overlayfs_service_unblock
-(
-    # block until /dev/.overlayfs_service_unblock
-    while [ ! -e "/dev/.overlayfs_service_unblock" ]; do
-        sleep 1
-    done
-    rm -rf /dev/.overlayfs_service_unblock
-    if [ -z "$MAGISKTMP" ]; then
-        # KernelSU
-        umount -l "$MODULEMNT"
-        rmdir "$MODULEMNT"
-    fi
-    umount -l "$OVERLAYMNT"
-    rmdir "$OVERLAYMNT"
-
-    echo "--- Mountinfo ---" >>/cache/overlayfs.log
-    cat /proc/mounts >>/cache/overlayfs.log
-) &
+# wait for /dev/.overlayfs_service_unblock, then detach the staging mounts
+if [ -z "$MAGISKTMP" ]; then
+    # KernelSU
+    "$MODDIR/overlayfs_system" --supervise "$OVERLAYMNT" "$MODULEMNT" &
+else
+    "$MODDIR/overlayfs_system" --supervise "$OVERLAYMNT" &
+fi
 
@@ -2,4 +2,8 @@ touch "${0%/*}/disable"
 touch /dev/.overlayfs_service_unblock
 
 while [ "$(getprop sys.boot_completed)" != 1 ]; do sleep 1; done
-rm -rf "${0%/*}/disable"
\ No newline at end of file
+rm -rf "${0%/*}/disable"
+. "${0%/*}/mode.sh"
+if [ "$OVERLAY_PREFETCH" = 2 ]; then
+    nsenter --mount=/proc/1/ns/mnt "${0%/*}/overlayfs_system" --record-hot
+fi
@@ -35,39 +35,54 @@ handle() {
   fi
 }
 
-support_overlayfs() {
-
-#OVERLAY_IMAGE_EXTRA - number of kb need to be added to overlay.img
-#OVERLAY_IMAGE_SHRINK - shrink overlay.img or not?
+# native image builder of magisk_overlayfs, used by support_overlayfs() when present
+OVERLAYFS_BIN="/data/adb/modules/magisk_overlayfs/overlayfs_system"
 
-if [ -d "$MODPATH/system" ]; then
+# dd/mkfs/cp/chcon pipeline, used when overlayfs_system is missing or fails
+build_image_shell() {
   OVERLAY_IMAGE_SIZE="$(sizeof "$MODPATH/system" "$OVERLAY_IMAGE_EXTRA")"
   dd if=/dev/zero of="$MODPATH/overlay.img" bs=1024 count="$OVERLAY_IMAGE_SIZE"
   ui_print "- Created overlay image with size: $(du -shH "$MODPATH/overlay.img" | awk '{ print $1 }')"
   /system/bin/mkfs.ext4 "$MODPATH/overlay.img"
   loop_setup "$MODPATH/overlay.img"
-  if [ ! -z "$LOOPDEV" ]; then
-    rm -rf "$MODPATH/overlay"
-    mkdir "$MODPATH/overlay"
-    mount -t ext4 -o rw "$LOOPDEV" "$MODPATH/overlay"
-    chcon u:object_r:system_file:s0 "$MODPATH/overlay"
-    cp -afT "$MODPATH/system" "$MODPATH/overlay/system"
-    # fix context
-    ( cd "$MODPATH" || exit 
-      find "system" | while read line; do
-        chcon "$(ls -Zd "$line" | awk '{ print $1 }')" "$MODPATH/overlay/$line"
-        if [ -e "$line/.replace" ]; then
-          setfattr -n trusted.overlay.opaque -v y "$MODPATH/overlay/$line"
-        fi
-      done
-    )
-    
-    # handle partition
-    handle vendor
-    handle product
-    handle system_ext
-    umount -l "$MODPATH/overlay"
+  [ -z "$LOOPDEV" ] && return 1
+  rm -rf "$MODPATH/overlay"
+  mkdir "$MODPATH/overlay"
+  mount -t ext4 -o rw "$LOOPDEV" "$MODPATH/overlay"
+  chcon u:object_r:system_file:s0 "$MODPATH/overlay"
+  cp -afT "$MODPATH/system" "$MODPATH/overlay/system"
+  # fix context
+  ( cd "$MODPATH" || exit 
+    find "system" | while read line; do
+      chcon "$(ls -Zd "$line" | awk '{ print $1 }')" "$MODPATH/overlay/$line"
+      if [ -e "$line/.replace" ]; then
+        setfattr -n trusted.overlay.opaque -v y "$MODPATH/overlay/$line"
+      fi
+    done
+  )
+  
+  # handle partition
+  handle vendor
+  handle product
+  handle system_ext
+  umount -l "$MODPATH/overlay"
+}
 
+support_overlayfs() {
+
+#OVERLAY_IMAGE_EXTRA - number of kb need to be added to overlay.img
+#OVERLAY_IMAGE_SHRINK - shrink overlay.img or not?
+
+if [ -d "$MODPATH/system" ]; then
+  BUILT=false
+  if [ -x "$OVERLAYFS_BIN" ]; then
+    # one pass over system/, sparse image, parallel copy, prints size and timing
+    OUTPUT="$("$OVERLAYFS_BIN" --build-image "$MODPATH/system" "$MODPATH/overlay.img" "$OVERLAY_IMAGE_EXTRA")" && BUILT=true
+    echo "$OUTPUT" | while read -r line; do
+      [ ! -z "$line" ] && ui_print "- $line"
+    done
+  fi
+  if $BUILT || build_image_shell; then
     if [ "$OVERLAY_IMAGE_SHRINK" == "true" ] || [ -z "$OVERLAY_IMAGE_SHRINK" ]; then
       ui_print "- Shrink overlay image"
       e2fsck -pf "$MODPATH/overlay.img"
@@ -0,0 +1,82 @@
+#!/bin/sh
+# Install time of overlay.img - overlayfs_system --build-image against the
+# dd/mkfs/cp/chcon pipeline of util_functions.sh, on the same synthetic module tree
+# Both run in a private mount namespace. On a Linux host /system/bin/mkfs.ext4 and
+# /dev/block, which the shell pipeline expects, are provided there. Needs root:
+#   sh bench_build_image.sh ./overlayfs_system
+# BENCH_DIRS     directories in system/ (40)
+# BENCH_FILES    small files per directory (50)
+# BENCH_KB       KiB per small file (16)
+# BENCH_LARGE    8 MiB files, like apks and big libraries (8)
+# BENCH_RUNS     builds of each (3)
+# BENCH_DIR      where the module is made (a new dir in /data/local/tmp or /tmp)
+
+BIN=$(readlink -f "${1:-./overlayfs_system}")
+[ -x "$BIN" ] || { echo "usage: $0 <overlayfs_system>" >&2; exit 1; }
+UTILS=$(readlink -f "$(dirname "$0")/../magisk-module/util_functions.sh")
+TMP=/tmp
+[ -d /data/local/tmp ] && TMP=/data/local/tmp
+BENCH_DIR=${BENCH_DIR:-$TMP/overlayfs_bench_image.$$}
+export BIN UTILS MODPATH="$BENCH_DIR/module"
+
+mkdir -p "$MODPATH/system"
+i=0
+while [ $i -lt ${BENCH_DIRS:-40} ]; do
+    mkdir -p "$MODPATH/system/d$i"
+    j=0
+    while [ $j -lt ${BENCH_FILES:-50} ]; do
+        head -c $((${BENCH_KB:-16} * 1024)) /dev/urandom > "$MODPATH/system/d$i/f$j"
+        j=$((j + 1))
+    done
+    i=$((i + 1))
+done
+mkdir -p "$MODPATH/system/app"
+i=0
+while [ $i -lt ${BENCH_LARGE:-8} ]; do
+    head -c 8388608 /dev/urandom > "$MODPATH/system/app/large$i.apk"
+    i=$((i + 1))
+done
+
+# mount points the host lacks, only made for the run
+CREATED=
+for dir in /system /dev/block; do
+    [ -d $dir ] || { mkdir $dir && CREATED="$CREATED $dir"; }
+done
+
+run() {
+    unshare -m --propagation private sh -c '
+    if [ ! -x /system/bin/mkfs.ext4 ]; then
+        mount -t tmpfs tmpfs /system
+        mkdir /system/bin
+        ln -s "$(command -v mkfs.ext4)" /system/bin/mkfs.ext4
+        mount -t tmpfs tmpfs /dev/block
+    fi
+    ui_print() { :; }
+    . "$UTILS"
+    rm -rf "$MODPATH/overlay.img" "$MODPATH/overlay"
+    sync
+    start=$(date +%s%N)
+    if [ $1 = native ]; then
+        "$BIN" --build-image "$MODPATH/system" "$MODPATH/overlay.img" >/dev/null 2>&1
+    else
+        build_image_shell >/dev/null 2>&1
+    fi
+    ret=$?
+    end=$(date +%s%N)
+    # losetup of the pipeline is not autoclear
+    [ -n "$LOOPDEV" ] && losetup -d "$LOOPDEV"
+    echo "$1 $(((end - start) / 1000000)) $(du -k "$MODPATH/overlay.img" | cut -f1) $ret"
+    ' sh "$@"
+}
+
+echo "builder ms image_kb exit"
+n=0
+while [ $n -lt ${BENCH_RUNS:-3} ]; do
+    run shell
+    run native
+    n=$((n + 1))
+done
+rm -rf "$BENCH_DIR"
+for dir in $CREATED; do
+    rmdir $dir
+done
@@ -0,0 +1,71 @@
+#!/bin/sh
+# OVERLAY_JOBS sweep - wall time of overlayfs_system for every OVERLAY_JOBS value
+# Every boot runs in a private mount namespace on a synthetic /system whose
+# directories are mount points of their own, so each one gets an overlay, with one
+# module shipping a file in each of them, and starts from an empty writable dir.
+# Prints the prepare_mounts phase of the profiler report and the wall time of the
+# whole run. Needs root, on a Linux host or in a device shell:
+#   sh bench_jobs.sh ./overlayfs_system
+# BENCH_DIRS      overlaid directories in /system (64)
+# BENCH_FILES     files per directory (64)
+# BENCH_JOBS      OVERLAY_JOBS values ("1 2 4 8")
+# BENCH_RUNS      boots per value (3)
+# BENCH_WRITABLE  parent of the writable dir, tmpfs if empty, a dir on the data
+#                 partition includes its latency
+
+BIN=$(readlink -f "${1:-./overlayfs_system}")
+[ -x "$BIN" ] || { echo "usage: $0 <overlayfs_system>" >&2; exit 1; }
+export BIN BENCH_DIRS=${BENCH_DIRS:-64} BENCH_FILES=${BENCH_FILES:-64} BENCH_WRITABLE
+
+# mount points for the synthetic partitions, left alone where they exist
+CREATED=
+for dir in /system /vendor /cache; do
+    [ -d $dir ] || { mkdir $dir && CREATED="$CREATED $dir"; }
+done
+
+run() {
+    unshare -m --propagation private sh -c '
+    set -e
+    mount -t tmpfs tmpfs /system
+    mount -t tmpfs tmpfs /vendor
+    mount -t tmpfs tmpfs /cache
+    mount -t tmpfs tmpfs /mnt
+    mod=/mnt/mod
+    i=0
+    while [ $i -lt $BENCH_DIRS ]; do
+        mkdir -p /system/d$i $mod/system/d$i
+        mount -t tmpfs tmpfs /system/d$i
+        j=0
+        while [ $j -lt $BENCH_FILES ]; do
+            echo stock > /system/d$i/f$j
+            j=$((j + 1))
+        done
+        echo module > $mod/system/d$i/m
+        i=$((i + 1))
+    done
+    writable=${BENCH_WRITABLE:-/mnt}/overlayfs_bench_jobs.$2
+    mkdir -p $writable
+    start=$(date +%s%N)
+    OVERLAYLIST=$mod OVERLAY_MODE=1 OVERLAY_JOBS=$1 "$BIN" $writable >/dev/null 2>&1 || true
+    end=$(date +%s%N)
+    prepare=$(grep "\"prepare_mounts\"" /cache/overlayfs.prof.json | sed "s/.*\"duration_ns\": \([0-9]*\).*/\1/")
+    overlays=$(grep -c " /system.* - overlay " /proc/self/mountinfo || true)
+    echo "$1 $((${prepare:-0} / 1000)) $(((end - start) / 1000)) $overlays"
+    ' sh "$@"
+}
+
+echo "jobs prepare_us wall_us overlays"
+for jobs in ${BENCH_JOBS:-1 2 4 8}; do
+    n=0
+    while [ $n -lt ${BENCH_RUNS:-3} ]; do
+        run $jobs $$
+        # overlays are gone with the namespace, the upper on disk is not
+        if [ -n "$BENCH_WRITABLE" ]; then
+            rm -rf "$BENCH_WRITABLE/overlayfs_bench_jobs.$$"
+        fi
+        n=$((n + 1))
+    done
+done
+for dir in $CREATED; do
+    rmdir $dir
+done
@@ -2,10 +2,16 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := overlayfs_system
-LOCAL_SRC_FILES := main.cpp logging.cpp utils.cpp mountinfo.cpp
+LOCAL_SRC_FILES := main.cpp logging.cpp utils.cpp mountinfo.cpp profiler.cpp mounttable.cpp threadpool.cpp attrs.cpp skeleton.cpp dirbuilder.cpp stage.cpp plan.cpp dirscan.cpp layers.cpp loopdev.cpp imagebuild.cpp compact.cpp dedup.cpp prefetch.cpp overlayopts.cpp sysops.cpp generations.cpp supervise.cpp
 LOCAL_STATIC_LIBRARIES := libcxx libselinux
 LOCAL_LDLIBS := -llog
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_MODULE := overlayfs_bench
+LOCAL_SRC_FILES := bench.cpp overlayopts.cpp
+LOCAL_STATIC_LIBRARIES := libcxx
+include $(BUILD_EXECUTABLE)
+
 include jni/external/Android.mk
 include jni/libcxx/Android.mk
@@ -0,0 +1,62 @@
+#include "attrs.hpp"
+#include "profiler.hpp"
+#include "sysops.hpp"
+#include <unordered_map>
+#include <pthread.h>
+
+using namespace std;
+
+static unordered_map<string, file_attr> attr_cache;
+static pthread_mutex_t attr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const file_attr *get_attr(const char *path) {
+    pthread_mutex_lock(&attr_lock);
+    auto it = attr_cache.find(path);
+    if (it != attr_cache.end()) {
+        pthread_mutex_unlock(&attr_lock);
+        return &it->second;
+    }
+    pthread_mutex_unlock(&attr_lock);
+
+    struct stat st;
+    prof_syscall();
+    if (sys().stat(path, &st) != 0)
+        return nullptr;
+    file_attr attr;
+    attr.uid = st.st_uid;
+    attr.gid = st.st_gid;
+    attr.mode = st.st_mode & 07777;
+    prof_syscall();
+    sys().getfilecon(path, attr.con);
+
+    pthread_mutex_lock(&attr_lock);
+    // another thread may have inserted it meanwhile, emplace keeps the old one
+    auto res = attr_cache.emplace(path, std::move(attr));
+    const file_attr *ret = &res.first->second;
+    pthread_mutex_unlock(&attr_lock);
+    return ret;
+}
+
+int clone_attrs(int dirfd, const char *name, const file_attr *attr) {
+    int ret = 0;
+    prof_syscall(2);
+    if (fchownat(dirfd, name, attr->uid, attr->gid, AT_SYMLINK_NOFOLLOW) != 0)
+        ret = -1;
+    if (fchmodat(dirfd, name, attr->mode, 0) != 0)
+        ret = -1;
+    if (!attr->con.empty()) {
+        prof_syscall();
+        int r;
+        if (dirfd == AT_FDCWD) {
+            r = sys().lsetfilecon(name, attr->con.data());
+        } else {
+            // label relative to dirfd without opening the target
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", dirfd, name);
+            r = sys().lsetfilecon(path, attr->con.data());
+        }
+        if (r != 0)
+            ret = -1;
+    }
+    return ret;
+}
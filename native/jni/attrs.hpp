@@ -0,0 +1,17 @@
+#pragma once
+#include "base.hpp"
+
+struct file_attr {
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;
+    // empty if path has no SELinux context
+    std::string con;
+};
+
+// metadata of path, cached so every path is stat'ed and labeled only once
+// returns nullptr if path does not exist, safe to call from multiple threads
+const file_attr *get_attr(const char *path);
+
+// apply owner, permission and SELinux context of attr to dirfd/name
+int clone_attrs(int dirfd, const char *name, const file_attr *attr);
@@ -0,0 +1,515 @@
+// overlayfs_bench - runtime cost of the overlay configurations of overlayfs_system
+// Builds a synthetic partition, module layers and an upper layer, mounts them the way
+// overlayfs_system does for every OVERLAY_MODE and measures stat, open, readdir and
+// copy-up latency on the result. Then it compares copy-up time and upper layer growth
+// of chmod, chown and small writes on large files under every OVERLAY_PROFILE.
+// The pruned configs stack only the module layers with files in the partition, like
+// OVERLAY_PRUNE_LAYERS=1, the merged ones the master of every module.
+// Runs in private user and mount namespaces, so it needs no root on a Linux host:
+//   g++ -std=c++17 -O2 -o overlayfs_bench bench.cpp overlayopts.cpp
+#include "overlayopts.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/utsname.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// directories per level of the synthetic tree
+#define BENCH_FANOUT 4
+// every UPPER_EVERY-th file was copied up by a previous boot
+#define BENCH_UPPER_EVERY 16
+
+struct bench_opts {
+    int files = 2000;
+    int depth = 3;
+    int layers = 4;
+    int idle_layers = 4;
+    int iterations = 5;
+    int copyups = 200;
+    int size = 4096;
+    int large_files = 8;
+    int large_kb = 8192;
+    const char *dir = nullptr;
+    bool userns = false;
+};
+
+struct bench_config {
+    const char *name;
+    // 0 - bind mount fallback, 1 - read-write, 2 - read-only
+    int mode;
+    // lower is the merged masterdir instead of the module layers
+    bool merged;
+    // only the module layers with files in the partition
+    bool pruned;
+};
+
+static const bench_config configs[] = {
+    { "bind", 0, false, false },
+    { "rw", 1, false, false },
+    { "rw_merged", 1, true, false },
+    { "rw_pruned", 1, false, true },
+    { "ro", 2, false, false },
+    { "ro_merged", 2, true, false },
+    { "ro_pruned", 2, false, true },
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool write_file(const char *path, const char *data) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, data, strlen(data)) == (ssize_t) strlen(data);
+    close(fd);
+    return ok;
+}
+
+// private mount namespace, inside a user namespace unless already root
+static int enter_namespace(bench_opts &o) {
+    if (geteuid() != 0) {
+        uid_t uid = getuid();
+        gid_t gid = getgid();
+        if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) {
+            fprintf(stderr, "unshare user and mount namespace: %s\n", strerror(errno));
+            return 1;
+        }
+        char map[64];
+        write_file("/proc/self/setgroups", "deny");
+        snprintf(map, sizeof(map), "0 %d 1", uid);
+        if (!write_file("/proc/self/uid_map", map))
+            return 1;
+        snprintf(map, sizeof(map), "0 %d 1", gid);
+        if (!write_file("/proc/self/gid_map", map))
+            return 1;
+        o.userns = true;
+    } else if (unshare(CLONE_NEWNS) != 0) {
+        fprintf(stderr, "unshare mount namespace: %s\n", strerror(errno));
+        return 1;
+    }
+    return mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr);
+}
+
+static int mkdirs(const string &path) {
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/') {
+            if (mkdir(path.substr(0, i).data(), 0755) != 0 && errno != EEXIST)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// relative directory of file idx, "/d1/d3/d0"
+static string dir_of(const bench_opts &o, int idx) {
+    int leaves = 1;
+    for (int i = 0; i < o.depth; i++)
+        leaves *= BENCH_FANOUT;
+    int leaf = idx % leaves;
+    string dir;
+    for (int i = 0; i < o.depth; i++) {
+        dir += "/d" + to_string(leaf % BENCH_FANOUT);
+        leaf /= BENCH_FANOUT;
+    }
+    return dir;
+}
+
+static string file_of(const bench_opts &o, int idx) {
+    return dir_of(o, idx) + "/f" + to_string(idx);
+}
+
+// every directory of the tree, root first
+static vector<string> all_dirs(const bench_opts &o) {
+    vector<string> dirs(1);
+    size_t begin = 0;
+    for (int i = 0; i < o.depth; i++) {
+        size_t end = dirs.size();
+        for (size_t j = begin; j < end; j++)
+            for (int k = 0; k < BENCH_FANOUT; k++)
+                dirs.push_back(dirs[j] + "/d" + to_string(k));
+        begin = end;
+    }
+    return dirs;
+}
+
+static int make_file(const string &path, int size, char fill) {
+    if (mkdirs(path.substr(0, path.rfind('/'))) != 0)
+        return -1;
+    int fd = open(path.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    string data(size, fill);
+    bool ok = write(fd, data.data(), size) == size;
+    close(fd);
+    return ok? 0 : -1;
+}
+
+// partition and module layers, module k ships every file idx % (2 * layers) == k,
+// idle module k only files of another partition
+static int make_lowers(const bench_opts &o, const string &base) {
+    for (int k = 0; k < o.idle_layers; k++)
+        if (make_file(base + "/idle" + to_string(k) + "/vendor/f" + to_string(k), o.size, 'i') != 0)
+            return -1;
+    for (auto &dir : all_dirs(o))
+        if (mkdirs(base + "/real" + dir) != 0)
+            return -1;
+    for (int i = 0; i < o.files; i++) {
+        if (make_file(base + "/real" + file_of(o, i), o.size, 'r') != 0)
+            return -1;
+        int k = i % (2 * o.layers);
+        if (k < o.layers && make_file(base + "/mod" + to_string(k) + file_of(o, i), o.size, 'm') != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// module layers, top layer first, the idle ones below unless pruned
+static vector<string> module_layers(const bench_opts &o, const string &base, bool pruned) {
+    vector<string> layers;
+    for (int k = o.layers - 1; k >= 0; k--)
+        layers.push_back(base + "/mod" + to_string(k));
+    for (int k = o.idle_layers - 1; k >= 0 && !pruned; k--)
+        layers.push_back(base + "/idle" + to_string(k));
+    return layers;
+}
+
+static int rm_tree(const char *path) {
+    return nftw(path, [](const char *p, const struct stat *, int, struct FTW *) { return remove(p); },
+                64, FTW_DEPTH | FTW_PHYS);
+}
+
+// fresh upper and worker, with the copy-ups of a previous boot
+static int make_upper(const bench_opts &o, const string &base) {
+    string w = base + "/w";
+    rm_tree(w.data());
+    if (mkdirs(w + "/upper") != 0 || mkdirs(w + "/worker") != 0 || mkdirs(w + "/master") != 0)
+        return -1;
+    for (int i = BENCH_UPPER_EVERY - 1; i < o.files; i += BENCH_UPPER_EVERY)
+        if (make_file(w + "/upper" + file_of(o, i), o.size, 'u') != 0)
+            return -1;
+    return 0;
+}
+
+struct latency {
+    vector<uint64_t> ns;
+    void add(uint64_t start) { ns.push_back(now_ns() - start); }
+    string json() {
+        if (ns.empty())
+            return "null";
+        sort(ns.begin(), ns.end());
+        uint64_t total = 0;
+        for (auto v : ns)
+            total += v;
+        auto pct = [&](size_t p) { return (unsigned long long) ns[(ns.size() - 1) * p / 100]; };
+        char buf[192];
+        snprintf(buf, sizeof(buf), "{\"count\": %zu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+                 "\"max_ns\": %llu, \"mean_ns\": %llu}", ns.size(), pct(50), pct(90), pct(99),
+                 (unsigned long long) ns.back(), (unsigned long long) (total / ns.size()));
+        return buf;
+    }
+};
+
+// mount config at target the way overlayfs_system does, returns 0 on success
+static int mount_config(const bench_opts &o, const bench_config &c, const string &base, const string &target) {
+    string real = base + "/real";
+    string upperdir = base + "/w/upper";
+    // without trusted.* xattrs in a user namespace, overlayfs stores its own in user.*
+    string extra = o.userns? ",userxattr" : "";
+    if (c.mode == 0)
+        return mount(real.data(), target.data(), nullptr, MS_BIND, nullptr);
+    vector<string> lowers = module_layers(o, base, c.pruned);
+    if (c.merged) {
+        string overlaylist;
+        for (auto &l : lowers)
+            overlaylist += (overlaylist.empty()? "" : ":") + l;
+        lowers.clear();
+        string opts = overlay_master_opts(upperdir, overlaylist) + extra;
+        if (mount("overlay", (base + "/w/master").data(), "overlay", 0, opts.data()) != 0)
+            return -1;
+        lowers.push_back(base + "/w/master");
+    }
+    string lowerdir = overlay_lowerdir(lowers, real);
+    string opts;
+    unsigned long flags = 0;
+    if (c.mode == 1) {
+        opts = overlay_rw_opts(lowerdir, upperdir, base + "/w/worker");
+    } else {
+        opts = overlay_ro_opts(lowerdir, upperdir, !c.merged);
+        flags = MS_RDONLY;
+    }
+    opts += extra;
+    return mount("overlay", target.data(), "overlay", flags, opts.data());
+}
+
+static int run_config(const bench_opts &o, const bench_config &c, const string &base, string &json) {
+    string target = base + "/mnt";
+    if (make_upper(o, base) != 0) {
+        fprintf(stderr, "%s: create upper layer: %s\n", c.name, strerror(errno));
+        return 1;
+    }
+    uint64_t start = now_ns();
+    if (mount_config(o, c, base, target) != 0) {
+        fprintf(stderr, "%s: mount: %s\n", c.name, strerror(errno));
+        umount2((base + "/w/master").data(), MNT_DETACH);
+        return 1;
+    }
+    uint64_t mount_us = (now_ns() - start) / 1000;
+
+    vector<string> files, dirs;
+    for (int i = 0; i < o.files; i++)
+        files.push_back(target + file_of(o, i));
+    for (auto &dir : all_dirs(o))
+        dirs.push_back(target + dir);
+    latency cold, st, op, rd, cu;
+    struct stat buf;
+    // first lookup after mount goes through every layer
+    for (auto &f : files) {
+        start = now_ns();
+        stat(f.data(), &buf);
+        cold.add(start);
+    }
+    for (int it = 0; it < o.iterations; it++) {
+        for (auto &f : files) {
+            start = now_ns();
+            stat(f.data(), &buf);
+            st.add(start);
+        }
+        for (auto &f : files) {
+            start = now_ns();
+            int fd = open(f.data(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0)
+                close(fd);
+            op.add(start);
+        }
+        for (auto &d : dirs) {
+            start = now_ns();
+            if (DIR *dp = opendir(d.data())) {
+                while (readdir(dp));
+                closedir(dp);
+            }
+            rd.add(start);
+        }
+    }
+    if (c.mode == 1) {
+        int n = 0;
+        for (int i = 0; i < o.files && n < o.copyups; i++) {
+            if (i % BENCH_UPPER_EVERY == BENCH_UPPER_EVERY - 1)
+                continue;
+            start = now_ns();
+            int fd = open(files[i].data(), O_WRONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+            close(fd);
+            cu.add(start);
+            n++;
+        }
+    }
+    umount2(target.data(), MNT_DETACH);
+    if (c.merged)
+        umount2((base + "/w/master").data(), MNT_DETACH);
+
+    char head[128];
+    snprintf(head, sizeof(head), "    {\"name\": \"%s\", \"mount_us\": %llu,\n", c.name, (unsigned long long) mount_us);
+    json += head;
+    json += "     \"lookup_cold\": " + cold.json() + ",\n";
+    json += "     \"stat\": " + st.json() + ",\n";
+    json += "     \"open\": " + op.json() + ",\n";
+    json += "     \"readdir\": " + rd.json() + ",\n";
+    json += "     \"copyup\": " + cu.json() + "}";
+    return 0;
+}
+
+static const char *workloads[] = { "chmod", "chown", "write" };
+
+static uint64_t tree_bytes;
+
+// bytes allocated under path
+static uint64_t allocated(const char *path) {
+    tree_bytes = 0;
+    nftw(path, [](const char *, const struct stat *st, int, struct FTW *) {
+        tree_bytes += (uint64_t) st->st_blocks * 512;
+        return 0;
+    }, 64, FTW_PHYS);
+    return tree_bytes;
+}
+
+static int run_workload(const string &file, int workload) {
+    switch (workload) {
+        case 0: return chmod(file.data(), 0600);
+        case 1: return chown(file.data(), getuid(), getgid());
+    }
+    int fd = open(file.data(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    char buf[4096] = {};
+    struct stat st;
+    int ret = (fstat(fd, &st) == 0 && pwrite(fd, buf, sizeof(buf), st.st_size / 2) == sizeof(buf))? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+// copy-up of large files by chmod, chown and a small write, for every option profile
+static void run_profiles(const bench_opts &o, const string &base, string &json) {
+    string large = base + "/large";
+    string target = base + "/mnt";
+    string data(1 << 20, 'l');
+    if (mkdirs(large) != 0)
+        return;
+    for (int i = 0; i < o.large_files; i++) {
+        string path = large + "/f" + to_string(i);
+        int fd = open(path.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return;
+        for (int kb = 0; kb < o.large_kb; kb += 1024)
+            write(fd, data.data(), min<size_t>(data.size(), (size_t) (o.large_kb - kb) * 1024));
+        close(fd);
+    }
+    unsigned supported = overlay_probe_features();
+    for (int profile = 0; profile <= 2; profile++) {
+        unsigned features = overlay_profile(profile) & supported;
+        for (int w = 0; w < 3; w++) {
+            char head[160];
+            snprintf(head, sizeof(head), "    {\"profile\": %d, \"features\": \"%s\", \"workload\": \"%s\"",
+                     profile, overlay_feature_names(features).data(), workloads[w]);
+            json += (json.empty()? "" : ",\n") + string(head);
+            // empty upper, nothing of the lookup configs
+            rm_tree((base + "/w").data());
+            if (mkdirs(base + "/w/upper") != 0 || mkdirs(base + "/w/worker") != 0)
+                return;
+            string opts = overlay_rw_opts(large, base + "/w/upper", base + "/w/worker", features);
+            if (o.userns)
+                opts += ",userxattr";
+            if (mount("overlay", target.data(), "overlay", 0, opts.data()) != 0) {
+                json += ", \"refused\": true}";
+                continue;
+            }
+            latency lat;
+            for (int i = 0; i < o.large_files; i++) {
+                uint64_t start = now_ns();
+                if (run_workload(target + "/f" + to_string(i), w) == 0)
+                    lat.add(start);
+            }
+            umount2(target.data(), MNT_DETACH);
+            char tail[64];
+            snprintf(tail, sizeof(tail), ", \"upper_bytes\": %llu", (unsigned long long) allocated((base + "/w/upper").data()));
+            json += ", \"copyup\": " + lat.json() + tail + "}";
+        }
+    }
+}
+
+static void usage(const char *arg0) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --files N       files in the partition (2000)\n"
+            "  --depth N       directory levels, %d directories each (3)\n"
+            "  --layers N      module layers (4)\n"
+            "  --idle-layers N module layers without files in the partition, left out when pruned (4)\n"
+            "  --iterations N  passes of stat, open and readdir (5)\n"
+            "  --copyups N     files copied up in read-write configs (200)\n"
+            "  --size N        bytes per file (4096)\n"
+            "  --large-files N large files copied up by chmod, chown and write per profile (8)\n"
+            "  --large-kb N    KiB per large file (8192)\n"
+            "  --dir DIR       build the trees on the filesystem of DIR instead of tmpfs\n"
+            "  --config NAME   only run NAME, bind rw rw_merged rw_pruned ro ro_merged ro_pruned\n",
+            arg0, BENCH_FANOUT);
+}
+
+int main(int argc, const char **argv) {
+    bench_opts o;
+    vector<const char *> only;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc)? argv[i + 1] : nullptr;
+        if (val == nullptr) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(arg, "--files") == 0) o.files = atoi(val);
+        else if (strcmp(arg, "--depth") == 0) o.depth = atoi(val);
+        else if (strcmp(arg, "--layers") == 0) o.layers = atoi(val);
+        else if (strcmp(arg, "--idle-layers") == 0) o.idle_layers = atoi(val);
+        else if (strcmp(arg, "--iterations") == 0) o.iterations = atoi(val);
+        else if (strcmp(arg, "--copyups") == 0) o.copyups = atoi(val);
+        else if (strcmp(arg, "--size") == 0) o.size = atoi(val);
+        else if (strcmp(arg, "--large-files") == 0) o.large_files = atoi(val);
+        else if (strcmp(arg, "--large-kb") == 0) o.large_kb = atoi(val);
+        else if (strcmp(arg, "--dir") == 0) o.dir = val;
+        else if (strcmp(arg, "--config") == 0) only.push_back(val);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (o.files <= 0 || o.depth < 0 || o.layers <= 0 || o.idle_layers < 0 || o.iterations <= 0 || o.size < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    // a user namespace cannot be entered by a multithreaded process, nothing runs yet
+    if (enter_namespace(o) != 0) {
+        fprintf(stderr, "enter private namespace: %s\n", strerror(errno));
+        return 1;
+    }
+    string base;
+    if (o.dir) {
+        base = string(o.dir) + "/overlayfs_bench." + to_string(getpid());
+        if (mkdirs(base) != 0) {
+            fprintf(stderr, "create %s: %s\n", base.data(), strerror(errno));
+            return 1;
+        }
+    } else {
+        // /tmp is missing on Android, any directory works as mount point
+        base = (access("/data/local/tmp", W_OK) == 0)? "/data/local/tmp" : "/tmp";
+        if (mount("tmpfs", base.data(), "tmpfs", 0, "mode=0755") != 0) {
+            fprintf(stderr, "mount tmpfs at %s: %s\n", base.data(), strerror(errno));
+            return 1;
+        }
+    }
+    if (make_lowers(o, base) != 0 || mkdirs(base + "/mnt") != 0) {
+        fprintf(stderr, "create lower layers: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int ret = 0;
+    string json;
+    for (auto &c : configs) {
+        if (!only.empty() && none_of(only.begin(), only.end(), [&](auto n) { return strcmp(n, c.name) == 0; }))
+            continue;
+        string one;
+        if (run_config(o, c, base, one) != 0) {
+            ret = 1;
+            continue;
+        }
+        json += (json.empty()? "" : ",\n") + one;
+    }
+    string profiles;
+    if (o.large_files > 0)
+        run_profiles(o, base, profiles);
+    if (o.dir)
+        rm_tree(base.data());
+
+    struct utsname un;
+    uname(&un);
+    printf("{\n  \"kernel\": \"%s\",\n  \"userns\": %s,\n  \"fs\": \"%s\",\n  \"files\": %d,\n  \"depth\": %d,\n"
+           "  \"layers\": %d,\n  \"idle_layers\": %d,\n  \"iterations\": %d,\n  \"file_size\": %d,\n  \"configs\": [\n%s\n  ],\n"
+           "  \"large_file_kb\": %d,\n  \"profiles\": [\n%s\n  ]\n}\n",
+           un.release, o.userns? "true" : "false", o.dir? o.dir : "tmpfs", o.files, o.depth, o.layers, o.idle_layers,
+           o.iterations, o.size, json.data(), o.large_kb, profiles.data());
+    return ret;
+}
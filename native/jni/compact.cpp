@@ -0,0 +1,211 @@
+#include "compact.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+#include "threadpool.hpp"
+#include "dirscan.hpp"
+#include <sys/xattr.h>
+
+using namespace std;
+
+#define OVL_XATTR_OPAQUE   "trusted.overlay.opaque"
+#define OVL_XATTR_REDIRECT "trusted.overlay.redirect"
+#define OVL_XATTR_METACOPY "trusted.overlay.metacopy"
+
+struct upper_entry {
+    // relative to upper, "/system/bin/sh"
+    string path;
+    struct stat st;
+    long parent;
+    // entries left in a directory
+    size_t children = 0;
+};
+
+static void walk(const string &upper, vector<upper_entry> &entries, size_t idx) {
+    string dir = upper + entries[idx].path;
+    dir_list list;
+    int fd = scan_dir(AT_FDCWD, dir.data(), list);
+    if (fd < 0)
+        return;
+    vector<size_t> subdirs;
+    for (size_t i = 0; i < list.size(); i++) {
+        upper_entry e;
+        e.path = entries[idx].path + "/" + list.name(i);
+        e.parent = idx;
+        prof_syscall();
+        if (fstatat(fd, list.name(i), &e.st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        if (S_ISDIR(e.st.st_mode))
+            subdirs.push_back(entries.size());
+        entries[idx].children++;
+        entries.emplace_back(std::move(e));
+    }
+    close(fd);
+    for (size_t i : subdirs)
+        walk(upper, entries, i);
+}
+
+static bool has_xattr(const char *path, const char *name) {
+    prof_syscall();
+    return lgetxattr(path, name, nullptr, 0) >= 0;
+}
+
+static bool same_label(const char *a, const char *b) {
+    char *ca = nullptr, *cb = nullptr;
+    prof_syscall(2);
+    int ra = lgetfilecon(a, &ca);
+    int rb = lgetfilecon(b, &cb);
+    bool same = (ra < 0 && rb < 0) || (ra >= 0 && rb >= 0 && strcmp(ca, cb) == 0);
+    if (ra >= 0) freecon(ca);
+    if (rb >= 0) freecon(cb);
+    return same;
+}
+
+static bool same_attrs(const struct stat &a, const struct stat &b) {
+    return a.st_mode == b.st_mode && a.st_uid == b.st_uid && a.st_gid == b.st_gid;
+}
+
+static bool is_whiteout(const struct stat &st) {
+    return S_ISCHR(st.st_mode) && st.st_rdev == 0;
+}
+
+// a copy-up which lower would show the same way
+static bool redundant_copyup(const string &upper, const upper_entry &e, const string &lower) {
+    struct stat st;
+    prof_syscall();
+    if (lstat(lower.data(), &st) != 0 || !same_attrs(e.st, st))
+        return false;
+    if (S_ISREG(st.st_mode)) {
+        // cheap checks first, hashing reads both files
+        if (st.st_size != e.st.st_size || st.st_mtim.tv_sec != e.st.st_mtim.tv_sec ||
+            st.st_mtim.tv_nsec != e.st.st_mtim.tv_nsec || e.st.st_nlink != 1)
+            return false;
+        // data of a metacopy is still in lower, keep it with the rest of the metadata
+        if (has_xattr(upper.data(), OVL_XATTR_METACOPY) || has_xattr(upper.data(), OVL_XATTR_REDIRECT))
+            return false;
+        if (!same_label(upper.data(), lower.data()))
+            return false;
+        uint64_t hu, hl;
+        return hash_file(upper.data(), hu) && hash_file(lower.data(), hl) && hu == hl;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        char a[PATH_MAX], b[PATH_MAX];
+        ssize_t na = readlink(upper.data(), a, sizeof(a));
+        ssize_t nb = readlink(lower.data(), b, sizeof(b));
+        return na >= 0 && na == nb && memcmp(a, b, na) == 0 && same_label(upper.data(), lower.data());
+    }
+    return false;
+}
+
+// a whiteout of a path which is gone from every lower layer
+static bool orphan_whiteout(const string &lower) {
+    struct stat st;
+    prof_syscall();
+    return lstat(lower.data(), &st) != 0 && (errno == ENOENT || errno == ENOTDIR);
+}
+
+// overlay targets, main.cpp would create them again at every boot
+static bool is_target(const string &path) {
+    // partitions and their children, which are not mount points until the overlays are
+    if (count(path.begin(), path.end(), '/') <= 2)
+        return true;
+    // nested stock mounts are targets of their own
+    struct stat st, parent;
+    prof_syscall(2);
+    if (stat(path.data(), &st) != 0 || stat((path + "/..").data(), &parent) != 0)
+        return false;
+    return st.st_dev != parent.st_dev;
+}
+
+// an empty upper directory which only repeats the attributes of lower
+static bool redundant_dir(const string &upper, const upper_entry &e, const string &lower,
+                          const layer_index &layers) {
+    struct stat st;
+    prof_syscall();
+    if (lstat(lower.data(), &st) != 0 || !same_attrs(e.st, st))
+        return false;
+    if (has_xattr(upper.data(), OVL_XATTR_REDIRECT) || is_target(e.path))
+        return false;
+    // an empty opaque directory hides every layer below, fine if none of them has anything
+    if (has_xattr(upper.data(), OVL_XATTR_OPAQUE) && !layers.empty_below(e.path))
+        return false;
+    return same_label(upper.data(), lower.data());
+}
+
+int compact_upper(const char *writable, const layer_index &layers, int jobs, compact_stats &stats) {
+    string upper = string(writable) + "/upper";
+    vector<upper_entry> entries(1);
+    entries[0].parent = -1;
+    if (lstat(upper.data(), &entries[0].st) != 0 || !S_ISDIR(entries[0].st.st_mode)) {
+        LOGE("%s is not a directory\n", upper.data());
+        return 1;
+    }
+    {
+        PROF_PHASE("compact_scan");
+        walk(upper, entries, 0);
+    }
+    LOGI("compact: %zu entries in %s\n", entries.size() - 1, upper.data());
+
+    vector<size_t> files;
+    for (size_t i = 1; i < entries.size(); i++)
+        if (!S_ISDIR(entries[i].st.st_mode))
+            files.push_back(i);
+    // 1 - redundant copy-up, 2 - orphan whiteout
+    vector<char> verdict(files.size(), 0);
+    {
+        PROF_PHASE("compact_compare");
+        int base = prof_current();
+        parallel_for(files.size(), jobs, [&](size_t i) {
+            prof_set_current(base);
+            auto &e = entries[files[i]];
+            string lower;
+            if (!layers.lower_of(e.path, lower))
+                return;
+            string path = upper + e.path;
+            if (is_whiteout(e.st))
+                verdict[i] = orphan_whiteout(lower)? 2 : 0;
+            else
+                verdict[i] = redundant_copyup(path, e, lower)? 1 : 0;
+        });
+    }
+
+    PROF_PHASE("compact_remove");
+    for (size_t i = 0; i < files.size(); i++) {
+        if (verdict[i] == 0)
+            continue;
+        auto &e = entries[files[i]];
+        prof_syscall();
+        if (unlink((upper + e.path).data()) != 0) {
+            PLOGE("unlink %s", e.path.data());
+            continue;
+        }
+        LOGD("compact: removed %s %s\n", (verdict[i] == 1)? "copy-up" : "whiteout", e.path.data());
+        entries[e.parent].children--;
+        if (verdict[i] == 1) {
+            stats.copyups++;
+            stats.bytes += (uint64_t) e.st.st_blocks * 512;
+        } else {
+            stats.whiteouts++;
+        }
+    }
+    // children come after their parent, so a reverse pass sees them first
+    for (size_t i = entries.size() - 1; i > 0; i--) {
+        auto &e = entries[i];
+        if (!S_ISDIR(e.st.st_mode) || e.children != 0)
+            continue;
+        string lower;
+        string path = upper + e.path;
+        if (!layers.lower_of(e.path, lower) || !redundant_dir(path, e, lower, layers))
+            continue;
+        prof_syscall();
+        if (rmdir(path.data()) != 0)
+            continue;
+        LOGD("compact: removed dir %s\n", e.path.data());
+        entries[e.parent].children--;
+        stats.dirs++;
+        stats.bytes += (uint64_t) e.st.st_blocks * 512;
+    }
+    LOGI("compact: removed %zu copy-ups, %zu whiteouts, %zu dirs, %llu KiB reclaimed\n",
+         stats.copyups, stats.whiteouts, stats.dirs, (unsigned long long) (stats.bytes / 1024));
+    return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "base.hpp"
+#include "layers.hpp"
+
+// Offline garbage collection of <writable>/upper
+// Copy-ups which are identical to what is below them again (size, mtime, owner,
+// mode and label, then a content hash), whiteouts of paths which no lower layer
+// has anymore and directories left empty by both are removed. Must run while no
+// overlayfs uses the upperdir
+
+struct compact_stats {
+    size_t copyups = 0;
+    size_t whiteouts = 0;
+    size_t dirs = 0;
+    // bytes allocated by the removed copy-ups
+    uint64_t bytes = 0;
+};
+
+// layers are the module layers below upper, the real filesystem is below them
+int compact_upper(const char *writable, const layer_index &layers, int jobs, compact_stats &stats);
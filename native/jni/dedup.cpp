@@ -0,0 +1,488 @@
+#include "dedup.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+#include "threadpool.hpp"
+#include "attrs.hpp"
+#include "dirscan.hpp"
+#include "prefetch.hpp"
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <inttypes.h>
+#include <sys/xattr.h>
+
+using namespace std;
+
+#define DEDUP_MAGIC "OVLDEDUP"
+#define DEDUP_VERSION 1
+// smaller files cost about as much in inodes and dirents as they would save
+#define DEDUP_MIN_SIZE 4096
+#define OVL_XATTR_OPAQUE "trusted.overlay.opaque"
+
+struct module_file {
+    // relative to the layer root, "/system/lib64/libc++.so"
+    string path;
+    // layer root + path
+    string file;
+    struct stat st;
+    string con;
+    uint64_t hash = 0;
+};
+
+struct dedup_manifest {
+    uint64_t key = 0;
+    dedup_stats stats;
+};
+
+static void list_files(const string &root, string &path, vector<module_file> &out) {
+    string dir = root + path;
+    dir_list list;
+    int fd = scan_dir(AT_FDCWD, dir.data(), list);
+    if (fd < 0)
+        return;
+    size_t len = path.size();
+    for (size_t i = 0; i < list.size(); i++) {
+        const char *name = list.name(i);
+        if (path.empty() && strcmp(name, "lost+found") == 0)
+            continue;
+        // only regular files are shared
+        unsigned char type = list.type(i);
+        if (type != DT_DIR && type != DT_REG)
+            continue;
+        path += '/';
+        path += name;
+        if (type == DT_DIR) {
+            list_files(root, path, out);
+        } else {
+            module_file f;
+            f.path = path;
+            f.file = root + path;
+            prof_syscall();
+            if (fstatat(fd, name, &f.st, AT_SYMLINK_NOFOLLOW) == 0)
+                out.emplace_back(std::move(f));
+        }
+        path.resize(len);
+    }
+    close(fd);
+}
+
+static void split_list(const char *overlaylist, vector<string> &roots) {
+    string_view list = overlaylist? overlaylist : "";
+    while (!list.empty()) {
+        size_t end = list.find(':');
+        if (end == string_view::npos)
+            end = list.size();
+        if (end > 0)
+            roots.emplace_back(list.substr(0, end));
+        list.remove_prefix(min(end + 1, list.size()));
+    }
+}
+
+// module images are rebuilt on install, so the root of each of them changes with it
+static uint64_t dedup_key(const vector<string> &roots) {
+    char buf[64];
+    uint64_t h = hash_str(0, DEDUP_MAGIC);
+    for (auto &root : roots) {
+        struct stat st;
+        h = hash_str(h, root);
+        if (stat(root.data(), &st) != 0)
+            continue;
+        snprintf(buf, sizeof(buf), "%llu %lld.%ld", (unsigned long long) st.st_ino,
+                 (long long) st.st_ctim.tv_sec, (long) st.st_ctim.tv_nsec);
+        h = hash_str(h, buf);
+    }
+    return h;
+}
+
+static bool load_manifest(const string &path, dedup_manifest &m) {
+    FILE *fp = fopen(path.data(), "re");
+    if (fp == nullptr)
+        return false;
+    char magic[16];
+    unsigned version;
+    unsigned long long objects, links, before, after;
+    bool ok = fscanf(fp, "%15s %u %" SCNx64 " %llu %llu %llu %llu", magic, &version, &m.key,
+                     &objects, &links, &before, &after) == 7 &&
+              strcmp(magic, DEDUP_MAGIC) == 0 && version == DEDUP_VERSION;
+    fclose(fp);
+    m.stats.objects = objects;
+    m.stats.links = links;
+    m.stats.footprint_before = before;
+    m.stats.footprint_after = after;
+    return ok;
+}
+
+// header, then "<object> <path>" for every link
+static bool save_manifest(const string &path, const dedup_manifest &m, const string &links) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s %u %" PRIx64 " %zu %zu %llu %llu\n", DEDUP_MAGIC, DEDUP_VERSION,
+             m.key, m.stats.objects, m.stats.links, (unsigned long long) m.stats.footprint_before,
+             (unsigned long long) m.stats.footprint_after);
+    string data = buf + links;
+    string tmp = path + ".tmp";
+    int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t) data.size() && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.data(), path.data()) != 0) {
+        unlink(tmp.data());
+        return false;
+    }
+    return true;
+}
+
+// upper is above every module layer, what it has or hides is never read from them
+static bool hidden_by_upper(const string &upper, const string &path) {
+    size_t pos = 0;
+    while (pos != string::npos) {
+        pos = path.find('/', pos + 1);
+        string p = upper + path.substr(0, pos);
+        struct stat st;
+        char value[2];
+        prof_syscall();
+        if (lstat(p.data(), &st) != 0)
+            return false;
+        if (!S_ISDIR(st.st_mode) || pos == string::npos)
+            return true;
+        prof_syscall();
+        if (lgetxattr(p.data(), OVL_XATTR_OPAQUE, value, sizeof(value)) > 0 && value[0] == 'y')
+            return true;
+    }
+    return false;
+}
+
+static bool same_content(const char *a, const char *b) {
+    int fa = open(a, O_RDONLY | O_CLOEXEC);
+    int fb = open(b, O_RDONLY | O_CLOEXEC);
+    bool same = fa >= 0 && fb >= 0;
+    char ba[65536], bb[65536];
+    while (same) {
+        prof_syscall(2);
+        ssize_t na = read(fa, ba, sizeof(ba));
+        ssize_t nb = read(fb, bb, sizeof(bb));
+        same = na >= 0 && na == nb && memcmp(ba, bb, na) == 0;
+        if (na <= 0)
+            break;
+    }
+    if (fa >= 0) close(fa);
+    if (fb >= 0) close(fb);
+    return same;
+}
+
+// copy of f with its attributes, written under a temporary name first
+static int make_object(const string &object, const module_file &f) {
+    struct stat st;
+    if (lstat(object.data(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size == f.st.st_size)
+        return 0;
+    string tmp = object + ".tmp";
+    int in = open(f.file.data(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return -1;
+    int out = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    struct timespec ts[2] = { f.st.st_atim, f.st.st_mtim };
+    int ret = copy_fd(in, out, f.st.st_size);
+    prof_syscall(4);
+    if (ret == 0 && (fchown(out, f.st.st_uid, f.st.st_gid) != 0 || fchmod(out, f.st.st_mode & 07777) != 0))
+        ret = -1;
+    if (ret == 0 && !f.con.empty() && fsetfilecon(out, f.con.data()) != 0)
+        ret = -1;
+    if (ret == 0)
+        futimens(out, ts);
+    close(in);
+    close(out);
+    if (ret == 0 && rename(tmp.data(), object.data()) != 0)
+        ret = -1;
+    if (ret)
+        unlink(tmp.data());
+    return ret;
+}
+
+// parents of path in the dedup layer, with the attributes the merged view shows
+static int make_parents(const string &layer, const string &path, const layer_index &layers,
+                        vector<string> &created) {
+    size_t pos = 0;
+    while ((pos = path.find('/', pos + 1)) != string::npos) {
+        string dir = path.substr(0, pos);
+        string target = layer + dir;
+        prof_syscall();
+        if (mkdir(target.data(), 0755) != 0) {
+            if (errno == EEXIST)
+                continue;
+            return -1;
+        }
+        string lower;
+        if (!layers.lower_of(dir, lower))
+            lower = dir;
+        if (const file_attr *attr = get_attr(lower.data()))
+            clone_attrs(AT_FDCWD, target.data(), attr);
+        created.emplace_back(std::move(dir));
+    }
+    return 0;
+}
+
+int dedup_layers(const char *writable, const char *overlaylist, const layer_index &layers,
+                 int jobs, dedup_stats &stats) {
+    string layer = string(writable) + "/dedup";
+    string store = string(writable) + "/store";
+    string upper = string(writable) + "/upper";
+    string manifest_path = string(writable) + "/.dedup";
+    vector<string> roots;
+    split_list(overlaylist, roots);
+
+    dedup_manifest m;
+    uint64_t key = dedup_key(roots);
+    if (load_manifest(manifest_path, m) && m.key == key && (m.stats.links == 0 || is_dir(layer.data()))) {
+        LOGI("dedup: modules unchanged, keep %s\n", layer.data());
+        stats = m.stats;
+        return 0;
+    }
+    m = dedup_manifest();
+    m.key = key;
+
+    rm_rf(AT_FDCWD, layer.data());
+    mkdir(store.data(), 0700);
+    mkdir(layer.data(), 0755);
+
+    // every module file which is what the merged view shows at its path
+    vector<module_file> files;
+    {
+        PROF_PHASE("dedup_scan");
+        for (auto &root : roots) {
+            vector<module_file> all;
+            string path;
+            list_files(root, path, all);
+            for (auto &f : all) {
+                string lower;
+                if (!layers.lower_of(f.path, lower) || lower != f.file || hidden_by_upper(upper, f.path))
+                    continue;
+                files.emplace_back(std::move(f));
+            }
+        }
+    }
+    set<pair<dev_t, ino_t>> inodes;
+    for (auto &f : files)
+        if (inodes.emplace(f.st.st_dev, f.st.st_ino).second)
+            stats.footprint_before += f.st.st_size;
+
+    // only files which share their size with another one are read
+    unordered_map<off_t, vector<size_t>> by_size;
+    for (size_t i = 0; i < files.size(); i++)
+        if (files[i].st.st_size >= DEDUP_MIN_SIZE)
+            by_size[files[i].st.st_size].push_back(i);
+    vector<size_t> candidates;
+    for (auto &it : by_size)
+        if (it.second.size() > 1)
+            candidates.insert(candidates.end(), it.second.begin(), it.second.end());
+    {
+        PROF_PHASE("dedup_hash");
+        int base = prof_current();
+        parallel_for(candidates.size(), jobs, [&](size_t i) {
+            prof_set_current(base);
+            auto &f = files[candidates[i]];
+            char *con;
+            prof_syscall();
+            if (lgetfilecon(f.file.data(), &con) >= 0) {
+                f.con = con;
+                freecon(con);
+            }
+            hash_file(f.file.data(), f.hash);
+        });
+    }
+
+    // a link shares the inode, so attributes have to match as well as content
+    map<string, vector<size_t>> groups;
+    char buf[128];
+    for (size_t i : candidates) {
+        auto &f = files[i];
+        snprintf(buf, sizeof(buf), "%016" PRIx64 " %lld %o %u %u ", f.hash, (long long) f.st.st_size,
+                 f.st.st_mode, f.st.st_uid, f.st.st_gid);
+        groups[buf + f.con].push_back(i);
+    }
+
+    PROF_PHASE("dedup_link");
+    string manifest;
+    vector<string> created;
+    uint64_t linked = 0;
+    for (auto &g : groups) {
+        if (g.second.size() < 2)
+            continue;
+        auto &first = files[g.second[0]];
+        snprintf(buf, sizeof(buf), "%016" PRIx64, hash_str(0, g.first));
+        string object = store + "/" + buf;
+        vector<size_t> members;
+        set<pair<dev_t, ino_t>> member_inodes;
+        for (size_t i : g.second) {
+            // a hash collision must not turn into a wrong file
+            if (i == g.second[0] || same_content(first.file.data(), files[i].file.data())) {
+                members.push_back(i);
+                member_inodes.emplace(files[i].st.st_dev, files[i].st.st_ino);
+            }
+        }
+        if (member_inodes.size() < 2)
+            continue;
+        if (make_object(object, first) != 0) {
+            PLOGE("dedup: store %s", first.file.data());
+            continue;
+        }
+        set<pair<dev_t, ino_t>> replaced;
+        for (size_t i : members) {
+            string target = layer + files[i].path;
+            prof_syscall();
+            if (make_parents(layer, files[i].path, layers, created) != 0 || link(object.data(), target.data()) != 0) {
+                PLOGE("dedup: link %s", target.data());
+                continue;
+            }
+            replaced.emplace(files[i].st.st_dev, files[i].st.st_ino);
+            stats.links++;
+            manifest += buf;
+            manifest += ' ';
+            manifest += files[i].path;
+            manifest += '\n';
+        }
+        if (replaced.empty())
+            continue;
+        // the linked inodes are read from a single object instead
+        stats.objects++;
+        linked += replaced.size() * (uint64_t) first.st.st_size;
+        stats.footprint_after += first.st.st_size;
+        LOGD("dedup: %s, %zu copies of %lld bytes\n", buf, members.size(), (long long) first.st.st_size);
+    }
+    stats.footprint_after += stats.footprint_before - linked;
+
+    // directory times last, the links changed them
+    for (auto &dir : created) {
+        string lower;
+        struct stat st;
+        if (!layers.lower_of(dir, lower))
+            lower = dir;
+        if (stat(lower.data(), &st) == 0) {
+            struct timespec ts[2] = { st.st_atim, st.st_mtim };
+            utimensat(AT_FDCWD, (layer + dir).data(), ts, 0);
+        }
+    }
+    // objects no module file links to anymore
+    dir_list objects;
+    int store_fd = scan_dir(AT_FDCWD, store.data(), objects);
+    if (store_fd >= 0) {
+        for (size_t i = 0; i < objects.size(); i++) {
+            struct stat st;
+            if (fstatat(store_fd, objects.name(i), &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                S_ISREG(st.st_mode) && st.st_nlink == 1)
+                unlinkat(store_fd, objects.name(i), 0);
+        }
+        close(store_fd);
+    }
+    m.stats = stats;
+    if (!save_manifest(manifest_path, m, manifest))
+        PLOGE("dedup: save %s", manifest_path.data());
+    if (stats.links == 0)
+        rm_rf(AT_FDCWD, layer.data());
+    return 0;
+}
+
+struct view_cost {
+    size_t inodes = 0;
+    uint64_t bytes = 0;
+    uint64_t cached = 0;
+    // inodes with pages left in cache after eviction, mapped by a running process
+    size_t pinned = 0;
+    uint64_t read_us = 0;
+};
+
+// read every file once from cold cache, then count what is cached on the inodes behind them
+static view_cost measure_view(const vector<string> &files) {
+    view_cost cost;
+    // one path per inode, overlayfs reads through to the same page cache
+    map<pair<dev_t, ino_t>, string> inodes;
+    for (auto &file : files) {
+        struct stat st;
+        if (stat(file.data(), &st) == 0 && inodes.emplace(make_pair(st.st_dev, st.st_ino), file).second)
+            cost.bytes += st.st_size;
+    }
+    cost.inodes = inodes.size();
+    uint64_t resident, extent;
+    for (auto &it : inodes) {
+        int fd = open(it.second.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        // dirty pages of a store object just written cannot be dropped
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        if (cached_range(fd, resident, extent))
+            cost.pinned++;
+        close(fd);
+    }
+    char buf[65536];
+    uint64_t start = prof_now();
+    for (auto &file : files) {
+        int fd = open(file.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        while (read(fd, buf, sizeof(buf)) > 0);
+        close(fd);
+    }
+    cost.read_us = (prof_now() - start) / 1000;
+    for (auto &it : inodes) {
+        int fd = open(it.second.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (cached_range(fd, resident, extent))
+            cost.cached += resident;
+        close(fd);
+    }
+    return cost;
+}
+
+static string cost_json(const view_cost &c) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"inodes\": %zu, \"bytes\": %llu, \"cached_bytes\": %llu, "
+             "\"pinned_inodes\": %zu, \"read_us\": %llu}", c.inodes, (unsigned long long) c.bytes,
+             (unsigned long long) c.cached, c.pinned, (unsigned long long) c.read_us);
+    return buf;
+}
+
+int dedup_bench(const char *writable, const char *overlaylist) {
+    string layer = string(writable) + "/dedup";
+    string upper = string(writable) + "/upper";
+    // mount.sh puts the dedup layer in front of OVERLAYLIST
+    string_view list = overlaylist? overlaylist : "";
+    if (list.substr(0, layer.size() + 1) == layer + ":")
+        list.remove_prefix(layer.size() + 1);
+    string modules(list);
+    vector<string> roots;
+    split_list(modules.data(), roots);
+    layer_index without, with;
+    without.load(modules.data());
+    with.load(is_dir(layer.data())? (layer + ":" + modules).data() : modules.data());
+
+    // the file each visible path reads from, without and with the dedup layer
+    vector<string> before, after;
+    for (auto &root : roots) {
+        vector<module_file> all;
+        string path;
+        list_files(root, path, all);
+        for (auto &f : all) {
+            string lower, linked;
+            if (!without.lower_of(f.path, lower) || lower != f.file || hidden_by_upper(upper, f.path))
+                continue;
+            before.emplace_back(std::move(lower));
+            after.emplace_back(with.lower_of(f.path, linked)? std::move(linked) : f.file);
+        }
+    }
+    if (before.empty()) {
+        LOGE("dedup: no module files in %s\n", modules.data());
+        return 1;
+    }
+    view_cost a = measure_view(before);
+    view_cost b = measure_view(after);
+    printf("{\n  \"files\": %zu,\n  \"without_dedup\": %s,\n  \"with_dedup\": %s,\n"
+           "  \"cached_saved_bytes\": %lld\n}\n", before.size(), cost_json(a).data(), cost_json(b).data(),
+           (long long) a.cached - (long long) b.cached);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "base.hpp"
+#include "layers.hpp"
+
+// Content store for files shipped by more than one module
+// Module images are separate filesystems, so the same library in two modules is
+// two inodes and is cached twice. Visible module files with the same content and
+// attributes are copied once into <writable>/store and hardlinked into the
+// <writable>/dedup layer at every path, which is stacked on top of the modules.
+// The view does not change, but each content is backed by a single inode.
+// <writable>/.dedup records the module set it was built for, so later boots
+// only rebuild when a module changes
+
+struct dedup_stats {
+    // contents stored once and paths linked to them
+    size_t objects = 0;
+    size_t links = 0;
+    // page cache needed to read every visible module file once, before and after,
+    // estimated from file sizes. dedup_bench() measures it
+    uint64_t footprint_before = 0;
+    uint64_t footprint_after = 0;
+};
+
+// returns 0 if <writable>/dedup is ready to be used as the top module layer
+int dedup_layers(const char *writable, const char *overlaylist, const layer_index &layers,
+                 int jobs, dedup_stats &stats);
+// read every visible module file cold without and with <writable>/dedup on top of
+// overlaylist, and print the page cache it took according to mincore as JSON
+int dedup_bench(const char *writable, const char *overlaylist);
@@ -0,0 +1,181 @@
+#include "dirbuilder.hpp"
+#include "logging.hpp"
+#include "profiler.hpp"
+#include "utils.hpp"
+#include <sys/resource.h>
+
+using namespace std;
+
+dir_builder::dir_builder() : root_fd(-1) {
+    pthread_mutex_init(&lock, nullptr);
+}
+
+dir_builder::~dir_builder() {
+    close_all();
+    pthread_mutex_destroy(&lock);
+}
+
+bool dir_builder::open_root(const char *path) {
+    close_all();
+    prof_syscall();
+    root_fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    return root_fd >= 0;
+}
+
+void dir_builder::close_all() {
+    for (auto &it : cache)
+        close(it.second);
+    cache.clear();
+    if (root_fd >= 0)
+        close(root_fd);
+    root_fd = -1;
+}
+
+int dir_builder::lookup(const string &path) {
+    pthread_mutex_lock(&lock);
+    auto it = cache.find(path);
+    int fd = (it == cache.end())? -1 : it->second;
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+// keep the first fd if another thread opened the same directory meanwhile
+int dir_builder::insert(const string &path, int fd) {
+    pthread_mutex_lock(&lock);
+    auto res = cache.emplace(path, fd);
+    int ret = res.first->second;
+    pthread_mutex_unlock(&lock);
+    if (ret != fd)
+        close(fd);
+    return ret;
+}
+
+int dir_builder::mkdirs(string_view path, mode_t mode, const create_cb &on_create) {
+    if (root_fd < 0)
+        return -1;
+    // normalize to "a/b/c"
+    string rel;
+    rel.reserve(path.size());
+    for (size_t i = 0; i < path.size(); i++) {
+        if (path[i] == '/' && (rel.empty() || rel.back() == '/'))
+            continue;
+        rel += path[i];
+    }
+    if (!rel.empty() && rel.back() == '/')
+        rel.pop_back();
+    if (rel.empty())
+        return 0;
+
+    // find the deepest directory which is already opened
+    int fd = lookup(rel);
+    if (fd >= 0)
+        return 0;
+    size_t done = rel.size();
+    int parent = root_fd;
+    while ((done = rel.rfind('/', done - 1)) != string::npos && done > 0) {
+        if ((fd = lookup(rel.substr(0, done))) >= 0) {
+            parent = fd;
+            done++;
+            break;
+        }
+    }
+    if (fd < 0)
+        done = 0;
+
+    // create and open the rest, one component at a time
+    // rel[0, base) is the path of parent, name is relative to it
+    size_t base = done;
+    bool opening = true;
+    while (done < rel.size()) {
+        size_t end = rel.find('/', done);
+        if (end == string::npos)
+            end = rel.size();
+        string name = rel.substr(base, end - base);
+        prof_syscall();
+        if (mkdirat(parent, name.data(), mode) == 0) {
+            if (on_create)
+                on_create(parent, name.data(), string_view(rel.data(), end));
+        } else if (errno != EEXIST) {
+            return -1;
+        }
+        done = end + 1;
+        if (!opening) {
+            struct stat st;
+            prof_syscall();
+            if (fstatat(parent, name.data(), &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode))
+                return -1;
+            continue;
+        }
+        prof_syscall();
+        int child = openat(parent, name.data(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child < 0) {
+            if (errno != EMFILE && errno != ENFILE)
+                return -1;
+            // out of fds, go on with paths relative to parent
+            opening = false;
+            done = base;
+            continue;
+        }
+        parent = insert(rel.substr(0, end), child);
+        base = done;
+    }
+    return 0;
+}
+
+// leaves of a tree with fanout directories per level, "d0/d2/d1"
+static void tree_leaves(int depth, int fanout, const string &prefix, vector<string> &out) {
+    if (depth == 0) {
+        out.push_back(prefix);
+        return;
+    }
+    for (int i = 0; i < fanout; i++)
+        tree_leaves(depth - 1, fanout, prefix + (prefix.empty()? "d" : "/d") + to_string(i), out);
+}
+
+int dirbuilder_bench(const char *dir, int depth, int fanout) {
+    if (depth <= 0 || fanout <= 0) {
+        LOGE("dirbuilder: depth and fanout must be positive\n");
+        return 1;
+    }
+    vector<string> leaves;
+    tree_leaves(depth, fanout, "", leaves);
+    size_t dirs = 0;
+    for (size_t n = 1, i = 0; i < (size_t) depth; i++)
+        dirs += (n *= fanout);
+    // the builder keeps an fd of every directory it made
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    string base = string(dir) + "/dirbuilder_bench." + to_string(getpid());
+    if (mkdir(base.data(), 0755) != 0) {
+        PLOGE("mkdir %s", base.data());
+        return 1;
+    }
+    // every leaf with its full path, each ancestor walked again, as before dir_builder
+    string paths = base + "/paths";
+    mkdir(paths.data(), 0755);
+    uint64_t start = prof_now();
+    for (auto &leaf : leaves)
+        ::mkdirs((paths + "/" + leaf).data(), 0755);
+    uint64_t paths_us = (prof_now() - start) / 1000;
+
+    string built = base + "/builder";
+    mkdir(built.data(), 0755);
+    dir_builder builder;
+    bool ok = builder.open_root(built.data());
+    start = prof_now();
+    for (auto &leaf : leaves)
+        ok = ok && builder.mkdirs(leaf, 0755) >= 0;
+    builder.close_all();
+    uint64_t builder_us = (prof_now() - start) / 1000;
+    rm_rf(AT_FDCWD, base.data());
+    if (!ok) {
+        PLOGE("dirbuilder: %s", built.data());
+        return 1;
+    }
+    printf("{\"depth\": %d, \"fanout\": %d, \"dirs\": %zu, \"path_mkdirs_us\": %llu, \"dir_builder_us\": %llu}\n",
+           depth, fanout, dirs, (unsigned long long) paths_us, (unsigned long long) builder_us);
+    return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "base.hpp"
+#include <functional>
+#include <unordered_map>
+#include <pthread.h>
+
+// Build directory trees relative to a held root dirfd with mkdirat/openat,
+// directories opened once are kept as O_PATH fds so the kernel never has to
+// walk the full path again. Safe to use from multiple threads
+struct dir_builder {
+    // called for every directory created by mkdirs, path is relative to root
+    using create_cb = std::function<void(int dirfd, const char *name, std::string_view path)>;
+
+    dir_builder();
+    ~dir_builder();
+    bool open_root(const char *path);
+    // make sure root/path exists, returns 0 on success and -1 on failure
+    // once the process is out of fds, the rest of path is created relative to the deepest
+    // directory already opened and not cached, so large trees work too
+    int mkdirs(std::string_view path, mode_t mode, const create_cb &on_create = nullptr);
+    void close_all();
+
+private:
+    int root_fd;
+    std::unordered_map<std::string, int> cache;
+    pthread_mutex_t lock;
+    int lookup(const std::string &path);
+    int insert(const std::string &path, int fd);
+};
+
+// create a tree of depth levels with fanout directories each under dir, once with
+// mkdirs() of full paths and once with a dir_builder, and print both times as JSON
+int dirbuilder_bench(const char *dir, int depth, int fanout);
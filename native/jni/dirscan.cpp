@@ -0,0 +1,50 @@
+#include "dirscan.hpp"
+#include "profiler.hpp"
+#include <sys/syscall.h>
+
+struct ovl_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+int scan_dir(int dirfd, const char *path, dir_list &out) {
+    // a whole /system/lib64 fits in a few calls, one buffer per thread
+    static __thread char buf[32768];
+    out.clear();
+    prof_syscall();
+    int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    long n;
+    for (;;) {
+        prof_syscall();
+        n = syscall(__NR_getdents64, fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        for (long off = 0; off < n; ) {
+            auto d = reinterpret_cast<ovl_dirent64 *>(buf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                prof_syscall();
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                    type = (st.st_mode & S_IFMT) >> 12;  // same as IFTODT
+            }
+            size_t len = strlen(name) + 1;
+            out.entries.push_back({ (uint32_t) out.names.size(), type });
+            out.names.insert(out.names.end(), name, name + len);
+        }
+    }
+    if (n < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
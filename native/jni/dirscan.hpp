@@ -0,0 +1,26 @@
+#pragma once
+#include "base.hpp"
+
+// Directory listing with getdents64
+// All entries of a directory are read in a few large getdents64 calls into one
+// name buffer. d_type is taken as is, only DT_UNKNOWN (filesystems without
+// d_type) costs an fstatat, so callers can skip non-directories without lstat
+struct dir_list {
+    struct entry {
+        // offset of the NUL terminated name in names
+        uint32_t name;
+        // DT_*
+        unsigned char type;
+    };
+    std::vector<char> names;
+    std::vector<entry> entries;
+
+    size_t size() const { return entries.size(); }
+    const char *name(size_t i) const { return names.data() + entries[i].name; }
+    unsigned char type(size_t i) const { return entries[i].type; }
+    void clear() { names.clear(); entries.clear(); }
+};
+
+// list path relative to dirfd without "." and "..", out is replaced
+// returns the directory fd (caller closes it) for *at() calls on the entries, -1 on failure
+int scan_dir(int dirfd, const char *path, dir_list &out);
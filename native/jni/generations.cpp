@@ -0,0 +1,198 @@
+#include "generations.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+#include "dirscan.hpp"
+
+using namespace std;
+
+static string gen_dir(const char *writable) {
+    return string(writable) + "/generations";
+}
+
+// ids of frozen generations, ascending
+static vector<long> gen_ids(const string &dir) {
+    vector<long> ids;
+    dir_list list;
+    int fd = scan_dir(AT_FDCWD, dir.data(), list);
+    if (fd < 0)
+        return ids;
+    close(fd);
+    for (size_t i = 0; i < list.size(); i++) {
+        const char *name = list.name(i);
+        char *end;
+        long id = strtol(name, &end, 10);
+        if (list.type(i) == DT_DIR && isdigit(name[0]) && *end == '\0' && id > 0)
+            ids.push_back(id);
+    }
+    sort(ids.begin(), ids.end());
+    return ids;
+}
+
+// id dir/name points at, -1 if there is none
+static long read_pointer(const string &dir, const char *name) {
+    char buf[32];
+    ssize_t len = readlink((dir + "/" + name).data(), buf, sizeof(buf) - 1);
+    if (len <= 0)
+        return -1;
+    buf[len] = '\0';
+    char *end;
+    long id = strtol(buf, &end, 10);
+    return (*end == '\0' && id >= 0)? id : -1;
+}
+
+// replace dir/name with a symlink to id in one rename
+static bool write_pointer(const string &dir, const char *name, long id) {
+    string tmp = dir + "/." + name + ".tmp";
+    string path = dir + "/" + name;
+    unlink(tmp.data());
+    if (symlink(to_string(id).data(), tmp.data()) != 0 || rename(tmp.data(), path.data()) != 0) {
+        PLOGE("set %s", path.data());
+        unlink(tmp.data());
+        return false;
+    }
+    return true;
+}
+
+static bool move_to_trash(const string &dir, const string &path) {
+    string trash = dir + "/trash";
+    mkdir(trash.data(), 0700);
+    string dest = trash + "/" + random_strc(12);
+    if (rename(path.data(), dest.data()) == 0 || errno == ENOENT)
+        return true;
+    PLOGE("trash %s", path.data());
+    return false;
+}
+
+static int request(const char *writable, long id) {
+    string dir = gen_dir(writable);
+    mkdir(dir.data(), 0700);
+    return write_pointer(dir, "next", id)? 0 : 1;
+}
+
+int gen_snapshot(const char *writable) {
+    auto ids = gen_ids(gen_dir(writable));
+    long id = ids.empty()? 1 : ids.back() + 1;
+    if (request(writable, id) != 0)
+        return 1;
+    printf("generation %ld is taken at next boot\n", id);
+    return 0;
+}
+
+int gen_rollback(const char *writable, long id) {
+    auto ids = gen_ids(gen_dir(writable));
+    if (id < 0 || (id > 0 && !binary_search(ids.begin(), ids.end(), id))) {
+        printf("there is no generation %ld\n", id);
+        return 1;
+    }
+    if (request(writable, id) != 0)
+        return 1;
+    printf("rollback to generation %ld at next boot\n", id);
+    return 0;
+}
+
+int gen_list(const char *writable) {
+    string dir = gen_dir(writable);
+    auto ids = gen_ids(dir);
+    dir_list trash;
+    int fd = scan_dir(AT_FDCWD, (dir + "/trash").data(), trash);
+    if (fd >= 0)
+        close(fd);
+    string list;
+    for (long id : ids) {
+        if (!list.empty())
+            list += ", ";
+        list += to_string(id);
+    }
+    long current = read_pointer(dir, "current");
+    long next = read_pointer(dir, "next");
+    printf("{\n  \"current\": %ld,\n  \"next\": %ld,\n  \"generations\": [%s],\n  \"trash\": %zu\n}\n",
+           max(current, 0L), next, list.data(), trash.size());
+    return 0;
+}
+
+int gen_apply(const char *writable) {
+    string dir = gen_dir(writable);
+    long next = read_pointer(dir, "next");
+    if (next < 0)
+        return 0;
+    auto ids = gen_ids(dir);
+    string upper = string(writable) + "/upper";
+    string worker = string(writable) + "/worker";
+    bool ok = true;
+    if (next > (ids.empty()? 0 : ids.back())) {
+        string frozen = dir + "/" + to_string(next);
+        if (rename(upper.data(), frozen.data()) != 0) {
+            if (errno == ENOENT) {
+                mkdir(frozen.data(), 0750);
+            } else {
+                PLOGE("freeze %s", upper.data());
+                ok = false;
+            }
+        }
+        if (ok)
+            LOGI("generations: upper frozen as %ld\n", next);
+    } else {
+        // a crash right after freezing ends up here too, with nothing to drop but an empty upper
+        ok = move_to_trash(dir, upper);
+        for (long id : ids) {
+            if (id > next)
+                ok = move_to_trash(dir, dir + "/" + to_string(id)) && ok;
+        }
+        if (ok)
+            LOGI("generations: rolled back to %ld\n", next);
+    }
+    // workdir belongs to the old upper, index=on records which one it was
+    ok = ok && move_to_trash(dir, worker);
+    // next is kept, so the next boot tries again
+    if (!ok)
+        return 1;
+    mkdir(upper.data(), 0750);
+    mkdir(worker.data(), 0750);
+    // the renames are on disk before the request is dropped
+    int fd = open(writable, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        syncfs(fd);
+        close(fd);
+    }
+    write_pointer(dir, "current", next);
+    unlink((dir + "/next").data());
+    return 0;
+}
+
+vector<string> gen_layers(const char *writable) {
+    string dir = gen_dir(writable);
+    vector<string> layers;
+    auto ids = gen_ids(dir);
+    for (auto it = ids.rbegin(); it != ids.rend(); ++it)
+        layers.emplace_back(dir + "/" + to_string(*it));
+    return layers;
+}
+
+void gen_gc_background(const char *writable) {
+    string trash = gen_dir(writable) + "/trash";
+    dir_list list;
+    int fd = scan_dir(AT_FDCWD, trash.data(), list);
+    if (fd < 0)
+        return;
+    if (list.size() == 0) {
+        close(fd);
+        return;
+    }
+    pid_t pid = fork_background();
+    if (pid < 0)
+        PLOGE("fork");
+    if (pid != 0) {
+        if (pid > 0)
+            LOGI("generations: deleting %zu old trees in background, pid %d\n", list.size(), pid);
+        close(fd);
+        return;
+    }
+    uint64_t start = prof_now();
+    for (size_t i = 0; i < list.size(); i++)
+        rm_rf(fd, list.name(i));
+    LOGI("generations: %zu old trees deleted in %llu ms\n", list.size(),
+         (unsigned long long) ((prof_now() - start) / 1000000));
+    log_flush();
+    _exit(0);
+}
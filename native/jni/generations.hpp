@@ -0,0 +1,25 @@
+#pragma once
+#include "base.hpp"
+
+// Generations of the upper layer
+// A snapshot freezes <writable>/upper as <writable>/generations/<id> and starts an
+// empty upper, frozen generations are stacked read-only above the module layers,
+// newest first. Rollback to <id> moves upper and every newer generation to
+// generations/trash, which is deleted in background once the overlays are mounted,
+// id 0 drops every change. Both are renames, so they take the same time for any tree.
+// Hardlinked copies would share inodes with the live upper, which overlayfs writes
+// in place, so an old generation has to stay a layer of its own.
+// --snapshot and --rollback only point generations/next at the wanted id, the next
+// boot applies it before anything is mounted and points generations/current at it
+
+// request a new generation / rollback for the next boot, returns 0 on success
+int gen_snapshot(const char *writable);
+int gen_rollback(const char *writable, long id);
+// print generations and the pending request as JSON
+int gen_list(const char *writable);
+// apply the pending request, only while no overlayfs uses upper
+int gen_apply(const char *writable);
+// frozen generations, newest first
+std::vector<std::string> gen_layers(const char *writable);
+// delete generations/trash in a background child, the caller does not wait for it
+void gen_gc_background(const char *writable);
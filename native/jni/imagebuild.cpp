@@ -0,0 +1,353 @@
+#include "imagebuild.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+#include "threadpool.hpp"
+#include "loopdev.hpp"
+#include "dirscan.hpp"
+#include <map>
+#include <atomic>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+
+using namespace std;
+
+#define OVL_OPAQUE_XATTR "trusted.overlay.opaque"
+#define SYSTEM_FILE_CON "u:object_r:system_file:s0"
+#define IMG_BLOCK 4096ULL
+#define IMG_INODE 256ULL
+
+struct image_entry {
+    // relative to src, "" for src itself
+    string path;
+    struct stat st;
+    string con;
+    // target of symlinks
+    string link;
+    // index of the first entry with the same inode, -1 if none
+    long hardlink = -1;
+    // directory contains .replace
+    bool opaque = false;
+};
+
+struct image_walk {
+    vector<image_entry> entries;
+    map<pair<dev_t, ino_t>, size_t> inodes;
+    uint64_t data_blocks = 0;
+    uint64_t dirent_bytes = 0;
+};
+
+static void walk(const string &root, image_walk &w, size_t idx) {
+    string dir = root + w.entries[idx].path;
+    dir_list list;
+    int fd = scan_dir(AT_FDCWD, dir.data(), list);
+    if (fd < 0) {
+        PLOGE("open %s", dir.data());
+        return;
+    }
+    vector<size_t> subdirs;
+    for (size_t i = 0; i < list.size(); i++) {
+        const char *name = list.name(i);
+        if (strcmp(name, ".replace") == 0)
+            w.entries[idx].opaque = true;
+        // ext4 dirent: 8 byte header, name padded to 4
+        w.dirent_bytes += 8 + ((strlen(name) + 3) & ~3);
+        image_entry e;
+        e.path = w.entries[idx].path + "/" + name;
+        prof_syscall();
+        if (fstatat(fd, name, &e.st, AT_SYMLINK_NOFOLLOW) != 0) {
+            PLOGE("lstat %s%s", root.data(), e.path.data());
+            continue;
+        }
+        string full = root + e.path;
+        char *con;
+        prof_syscall();
+        if (lgetfilecon(full.data(), &con) >= 0) {
+            e.con = con;
+            freecon(con);
+        }
+        if (S_ISLNK(e.st.st_mode)) {
+            char buf[PATH_MAX];
+            ssize_t n = readlinkat(fd, name, buf, sizeof(buf) - 1);
+            if (n < 0)
+                continue;
+            e.link.assign(buf, n);
+            // short targets are stored in the inode
+            if (n >= 60)
+                w.data_blocks++;
+        } else if (S_ISREG(e.st.st_mode)) {
+            auto res = w.inodes.emplace(make_pair(e.st.st_dev, e.st.st_ino), w.entries.size());
+            if (!res.second)
+                e.hardlink = res.first->second;
+            else
+                w.data_blocks += (e.st.st_size + IMG_BLOCK - 1) / IMG_BLOCK;
+        } else if (S_ISDIR(e.st.st_mode)) {
+            subdirs.push_back(w.entries.size());
+        }
+        w.entries.emplace_back(std::move(e));
+    }
+    close(fd);
+    for (size_t i : subdirs)
+        walk(root, w, i);
+}
+
+// same steps as ext2fs_default_journal_size() of e2fsprogs
+static uint64_t journal_blocks(uint64_t blocks) {
+    if (blocks < 2048) return 0;
+    if (blocks < 32768) return 1024;
+    if (blocks < 256 * 1024) return 4096;
+    if (blocks < 512 * 1024) return 8192;
+    if (blocks < 4096 * 1024) return 16384;
+    if (blocks < 8192 * 1024) return 32768;
+    if (blocks < 16384 * 1024) return 65536;
+    if (blocks < 32768 * 1024) return 131072;
+    return 262144;
+}
+
+// size of the filesystem in 4K blocks, from what mkfs.ext4 puts around the files
+static uint64_t estimate_blocks(const image_walk &w, uint64_t inodes) {
+    uint64_t dirs = 0;
+    for (auto &e : w.entries)
+        if (S_ISDIR(e.st.st_mode))
+            dirs++;
+    // lost+found is created with 4 blocks
+    uint64_t blocks = w.data_blocks + dirs + w.dirent_bytes / IMG_BLOCK + 4;
+    blocks += (inodes * IMG_INODE + IMG_BLOCK - 1) / IMG_BLOCK;
+    // extent tree blocks of fragmented files
+    blocks += blocks / 64;
+    uint64_t groups = blocks / 32768 + 1;
+    // bitmaps, superblock and descriptor backups, reserved descriptors for resize
+    blocks += groups * 4 + 256;
+    return blocks + journal_blocks(blocks);
+}
+
+static int run(const char *const argv[]) {
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        // keep stdout for the caller
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        execvp(argv[0], (char *const *) argv);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return -1;
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0)? 0 : -1;
+}
+
+// owner, mode, label and opaque flag, times are set by the caller
+static int apply_attrs(const char *path, const image_entry &e) {
+    int ret = 0;
+    prof_syscall(2);
+    if (lchown(path, e.st.st_uid, e.st.st_gid) != 0)
+        ret = -1;
+    if (!S_ISLNK(e.st.st_mode) && chmod(path, e.st.st_mode & 07777) != 0)
+        ret = -1;
+    if (!e.con.empty()) {
+        prof_syscall();
+        if (lsetfilecon(path, e.con.data()) != 0)
+            ret = -1;
+    }
+    if (e.opaque) {
+        prof_syscall();
+        if (lsetxattr(path, OVL_OPAQUE_XATTR, "y", 1, 0) != 0)
+            ret = -1;
+    }
+    if (ret)
+        PLOGE("set attributes of %s", path);
+    return ret;
+}
+
+static void apply_times(const char *path, const image_entry &e) {
+    struct timespec ts[2] = { e.st.st_atim, e.st.st_mtim };
+    prof_syscall();
+    utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW);
+}
+
+static int copy_entry(const string &src, const string &dst, const image_entry &e) {
+    mode_t type = e.st.st_mode & S_IFMT;
+    prof_syscall();
+    if (type == S_IFLNK) {
+        if (symlink(e.link.data(), dst.data()) != 0) {
+            PLOGE("symlink %s", dst.data());
+            return -1;
+        }
+    } else if (type == S_IFREG) {
+        int in = open(src.data(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+            PLOGE("open %s", src.data());
+            return -1;
+        }
+        int out = open(dst.data(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (out < 0) {
+            PLOGE("create %s", dst.data());
+            close(in);
+            return -1;
+        }
+        int ret = copy_fd(in, out, e.st.st_size);
+        if (ret)
+            PLOGE("copy %s", src.data());
+        close(in);
+        close(out);
+        if (ret)
+            return -1;
+    } else if (mknod(dst.data(), e.st.st_mode, e.st.st_rdev) != 0) {
+        PLOGE("mknod %s", dst.data());
+        return -1;
+    }
+    int ret = apply_attrs(dst.data(), e);
+    apply_times(dst.data(), e);
+    return ret;
+}
+
+// same as handle() of util_functions.sh, partitions which are real directories
+// on the device are moved out of /system of the image
+static void move_partitions(const string &mnt, const string &src) {
+    for (const char *part : { "vendor", "product", "system_ext" }) {
+        string root = string("/") + part;
+        string from = mnt + "/system/" + part;
+        string to = mnt + "/" + part;
+        struct stat st;
+        if (lstat(root.data(), &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+        if (stat((src + "/" + part).data(), &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+        if (rename(from.data(), to.data()) != 0 || symlink((string("../") + part).data(), from.data()) != 0) {
+            PLOGE("move %s", from.data());
+            continue;
+        }
+        LOGD("image: moved %s to /%s\n", from.data(), part);
+    }
+}
+
+static uint64_t ms_since(uint64_t start) {
+    return (prof_now() - start) / 1000000;
+}
+
+int build_image(const char *src, const char *image, long extra_kb) {
+    uint64_t t0 = prof_now();
+    string root = src;
+    while (root.size() > 1 && root.back() == '/')
+        root.pop_back();
+
+    image_walk w;
+    w.entries.emplace_back();
+    if (lstat(root.data(), &w.entries[0].st) != 0 || !S_ISDIR(w.entries[0].st.st_mode)) {
+        LOGE("%s is not a directory\n", root.data());
+        return 1;
+    }
+    char *con;
+    if (lgetfilecon(root.data(), &con) >= 0) {
+        w.entries[0].con = con;
+        freecon(con);
+    }
+    walk(root, w, 0);
+    uint64_t inodes = w.entries.size() + 64;
+    uint64_t blocks = estimate_blocks(w, inodes);
+    if (extra_kb > 0)
+        blocks += (extra_kb * 1024 + IMG_BLOCK - 1) / IMG_BLOCK;
+    uint64_t t_walk = ms_since(t0);
+
+    // sparse, blocks are only allocated for what mkfs and the copy write
+    t0 = prof_now();
+    int fd = open(image, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        PLOGE("create %s", image);
+        return 1;
+    }
+    if (ftruncate(fd, blocks * IMG_BLOCK) != 0) {
+        PLOGE("resize %s", image);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    string inode_count = to_string(inodes);
+    const char *mkfs = (access("/system/bin/mkfs.ext4", X_OK) == 0)? "/system/bin/mkfs.ext4" : "mkfs.ext4";
+    // no blocks reserved for root, nobody writes to the image after this
+    const char *mkfs_argv[] = { mkfs, "-q", "-F", "-b", "4096", "-I", "256", "-m", "0",
+                                "-N", inode_count.data(), image, nullptr };
+    if (run(mkfs_argv) != 0) {
+        LOGE("mkfs.ext4 %s failed\n", image);
+        return 1;
+    }
+    uint64_t t_mkfs = ms_since(t0);
+
+    // mount in a namespace of our own, nothing can see the half built image
+    // and it goes away with this process if anything fails
+    t0 = prof_now();
+    if (unshare(CLONE_NEWNS) == 0)
+        mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr);
+    string mnt = string(image) + ".mnt";
+    mkdir(mnt.data(), 0700);
+    string dev;
+    if (mount_image(image, mnt.data(), false, dev) != 0) {
+        rmdir(mnt.data());
+        return 1;
+    }
+
+    // directories first in walk order, parents come before children
+    atomic<int> errors{0};
+    for (auto &e : w.entries) {
+        if (!S_ISDIR(e.st.st_mode))
+            continue;
+        string dst = mnt + "/system" + e.path;
+        prof_syscall();
+        if (mkdir(dst.data(), 0700) != 0 && errno != EEXIST) {
+            PLOGE("mkdir %s", dst.data());
+            errors++;
+        }
+    }
+    vector<size_t> files;
+    for (size_t i = 0; i < w.entries.size(); i++)
+        if (!S_ISDIR(w.entries[i].st.st_mode) && w.entries[i].hardlink < 0)
+            files.push_back(i);
+    int jobs = max(1L, min(8L, sysconf(_SC_NPROCESSORS_ONLN)));
+    parallel_for(files.size(), jobs, [&](size_t i) {
+        auto &e = w.entries[files[i]];
+        if (copy_entry(root + e.path, mnt + "/system" + e.path, e) != 0)
+            errors++;
+    });
+    for (auto &e : w.entries) {
+        if (e.hardlink < 0)
+            continue;
+        string to = mnt + "/system" + e.path;
+        prof_syscall();
+        if (link((mnt + "/system" + w.entries[e.hardlink].path).data(), to.data()) != 0) {
+            PLOGE("link %s", to.data());
+            errors++;
+        }
+    }
+    // directory times last, every entry created above changes them
+    for (auto it = w.entries.rbegin(); it != w.entries.rend(); ++it) {
+        if (!S_ISDIR(it->st.st_mode))
+            continue;
+        string dst = mnt + "/system" + it->path;
+        if (apply_attrs(dst.data(), *it) != 0)
+            errors++;
+        apply_times(dst.data(), *it);
+    }
+    move_partitions(mnt, root);
+    setfilecon(mnt.data(), SYSTEM_FILE_CON);
+    uint64_t t_copy = ms_since(t0);
+
+    if (umount2(mnt.data(), 0) != 0) {
+        PLOGE("umount %s", mnt.data());
+        umount2(mnt.data(), MNT_DETACH);
+    }
+    rmdir(mnt.data());
+    if (errors) {
+        LOGE("image: %d entries failed to copy\n", errors.load());
+        return 1;
+    }
+
+    struct stat st;
+    uint64_t used = (stat(image, &st) == 0)? st.st_blocks * 512 : 0;
+    printf("Built overlay image: %zu entries, %llu KiB (%llu KiB allocated)\n", w.entries.size(),
+           (unsigned long long) (blocks * IMG_BLOCK / 1024), (unsigned long long) (used / 1024));
+    printf("Build time: scan %llu ms, mkfs %llu ms, copy %llu ms with %d threads\n",
+           (unsigned long long) t_walk, (unsigned long long) t_mkfs, (unsigned long long) t_copy, jobs);
+    return 0;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "base.hpp"
+
+// Native builder of the overlay.img of a module
+// Replaces the du/dd/mkfs/cp/chcon pipeline of support_overlayfs(): src is walked
+// once for size, labels and .replace markers, the image is allocated sparse,
+// formatted with mkfs.ext4 and filled with a parallel copy. Layout is the same as
+// the shell version, src ends up in /system of the image and vendor, product and
+// system_ext are moved to the top with a symlink left in /system
+
+// build image from src (the system directory of a module), extra_kb is added on top
+// of the estimated size, returns 0 on success
+int build_image(const char *src, const char *image, long extra_kb);
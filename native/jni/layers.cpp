@@ -0,0 +1,153 @@
+#include "layers.hpp"
+#include "logging.hpp"
+#include "profiler.hpp"
+#include "dirscan.hpp"
+#include "sysops.hpp"
+#include <sys/xattr.h>
+
+using namespace std;
+
+#define OVL_OPAQUE_XATTR "trusted.overlay.opaque"
+
+void layer_index::load(const char *overlaylist) {
+    layers.clear();
+    string_view list = overlaylist? overlaylist : "";
+    while (!list.empty()) {
+        size_t end = list.find(':');
+        if (end == string_view::npos)
+            end = list.size();
+        if (end > 0) {
+            layers.emplace_back();
+            layers.back().root = string(list.substr(0, end));
+        }
+        list.remove_prefix(min(end + 1, list.size()));
+    }
+    for (auto &l : layers) {
+        string path;
+        scan(l, path);
+        LOGD("layer: %s, %zu whiteouts or opaque dirs\n", l.root.data(), l.special.size());
+    }
+}
+
+// path is relative to layer root, "" or "/a/b"
+void layer_index::scan(layer &l, string &path) {
+    string full = l.root + path;
+    char value[2];
+    prof_syscall();
+    if (!path.empty() && lgetxattr(full.data(), OVL_OPAQUE_XATTR, value, sizeof(value)) > 0 && value[0] == 'y')
+        l.special.insert(path);
+    dir_list list;
+    int fd = scan_dir(AT_FDCWD, full.data(), list);
+    if (fd < 0)
+        return;
+    size_t len = path.size();
+    for (size_t i = 0; i < list.size(); i++) {
+        const char *name = list.name(i);
+        // lost+found of the module image is not part of the layer
+        if (path.empty() && strcmp(name, "lost+found") == 0)
+            continue;
+        unsigned char type = list.type(i);
+        if (type != DT_CHR && type != DT_DIR)
+            continue;
+        path += '/';
+        path += name;
+        if (type == DT_DIR) {
+            scan(l, path);
+        } else {
+            // whiteouts are 0/0 character devices
+            struct stat st;
+            prof_syscall();
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && st.st_rdev == 0)
+                l.special.insert(path);
+        }
+        path.resize(len);
+    }
+    close(fd);
+}
+
+bool layer_index::lowers(const string &target, vector<string> &out) const {
+    out.clear();
+    for (auto &l : layers) {
+        if (l.special.overlaps(target))
+            return false;
+        string dir = l.root + target;
+        struct stat st;
+        prof_syscall();
+        if (sys().lstat(dir.data(), &st) != 0) {
+            // some parent is a file
+            if (errno == ENOTDIR)
+                return false;
+            continue;
+        }
+        // a file hides the directory in the master too
+        if (!S_ISDIR(st.st_mode))
+            return false;
+        out.emplace_back(std::move(dir));
+    }
+    return true;
+}
+
+bool layer_index::lower_of(const string &path, string &out) const {
+    for (auto &l : layers) {
+        if (l.special.overlaps(path))
+            return false;
+        string file = l.root + path;
+        struct stat st;
+        prof_syscall();
+        if (sys().lstat(file.data(), &st) == 0) {
+            out = std::move(file);
+            return true;
+        }
+        // a file of this layer hides everything below it
+        if (errno == ENOTDIR)
+            return false;
+    }
+    out = path;
+    return true;
+}
+
+// missing, or a directory without entries
+static bool missing_or_empty(const string &path) {
+    struct stat st;
+    prof_syscall();
+    if (sys().lstat(path.data(), &st) != 0)
+        return errno == ENOENT;
+    if (!S_ISDIR(st.st_mode))
+        return false;
+    dir_list list;
+    return sys().list_dir(path.data(), list) == 0 && list.size() == 0;
+}
+
+bool layer_index::empty_below(const string &path) const {
+    for (auto &l : layers) {
+        // whiteouts and opaque dirs below would need the whole merge to be redone
+        if (l.special.overlaps(path) || !missing_or_empty(l.root + path))
+            return false;
+    }
+    return missing_or_empty(path);
+}
+
+bool overlay_lowers(const string &writable, const string &target, const vector<string> &generations,
+                    const layer_index *layers, bool master, vector<string> &out) {
+    // frozen generations right below upper, whiteouts in the master would not hide stock files
+    bool frozen = false;
+    for (auto &gen : generations) {
+        string dir = gen + target;
+        struct stat st;
+        prof_syscall();
+        if (sys().stat(dir.data(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            out.emplace_back(std::move(dir));
+            frozen = true;
+        }
+    }
+    vector<string> modules;
+    if (layers && layers->lowers(target, modules)) {
+        out.insert(out.end(), modules.begin(), modules.end());
+        return true;
+    }
+    if (!master)
+        return true;
+    out.emplace_back(writable + "/master" + target);
+    // upper in the master would be below the generations
+    return frozen;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "base.hpp"
+#include "mounttable.hpp"
+
+// Module layer index
+// Every module of OVERLAYLIST is scanned once so that each overlayfs only gets
+// the module layers which actually have files under its directory, instead of
+// the merged master with every module in front of every directory.
+// Directories touched by a whiteout or an opaque directory of any layer keep
+// using the master, pruning them would change what is visible
+struct layer_index {
+    void load(const char *overlaylist);
+    bool empty() const { return layers.empty(); }
+    // lowerdirs of module layers for target, top layer first
+    // returns false if target has to use the master
+    bool lowers(const std::string &target, std::vector<std::string> &out) const;
+    // what path resolves to below the upper layer: the top module layer which has it,
+    // else the real path. returns false if a whiteout or opaque directory is involved
+    bool lower_of(const std::string &path, std::string &out) const;
+    // true if path is missing or an empty directory in every module layer and in the
+    // real filesystem, so an opaque directory at path hides nothing
+    bool empty_below(const std::string &path) const;
+
+private:
+    struct layer {
+        std::string root;
+        // whiteouts and opaque directories, relative to root
+        mount_table special;
+    };
+    std::vector<layer> layers;
+    void scan(layer &l, std::string &path);
+};
+
+// lowerdirs of the overlayfs of target below its upperdir, top layer first: the frozen
+// generations which have target, then the module layers with files under target when
+// layers is given and pruning keeps the view the same, else <writable>/master<target>
+// if the master is mounted. The real directory is not included. Returns true if upper
+// is not right above the chain through the master, so read-only mounts have to stack
+// it themselves
+bool overlay_lowers(const std::string &writable, const std::string &target,
+                    const std::vector<std::string> &generations, const layer_index *layers,
+                    bool master, std::vector<std::string> &out);
@@ -1,46 +1,242 @@
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <android/log.h>
-#include <sys/uio.h>
-#include <sys/time.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <string>
+#include <vector>
 #include <unistd.h>
+#include "logging.hpp"
 
-void log_to_file(int fd, int prio, const char *log) {
-    if (fd < 0) {
-        printf("%s", log);
-        return;
-    }
-    char prio_c = 'I';
+#define LOG_BUF_SIZE (128 * 1024)
+#define LOG_LINE_MAX 4098
+#define LOG_RECORD_MAGIC 0x4c53564f
+
+// record of binary log, followed by len bytes of message
+struct log_record {
+    uint32_t magic;
+    uint16_t len;
+    uint8_t prio;
+    uint8_t reserved;
+    int64_t sec;
+    uint32_t usec;
+    int32_t pid;
+    int32_t tid;
+    uint32_t reserved2;
+};
+
+// lines wait here until the buffer is full, an error is logged or the process exits
+static char log_buf[LOG_BUF_SIZE];
+static size_t log_len = 0;
+static bool log_binary = false;
+static int log_pid = 0;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int log_tid = 0;
+
+// "%m-%d %T" is only formatted again when the second changes
+static time_t cached_sec = -1;
+static char cached_time[32];
+static size_t cached_time_len = 0;
+
+static char prio_char(int prio) {
     switch (prio) {
         case ANDROID_LOG_DEBUG:
-            prio_c = 'D';
-            break;
+            return 'D';
         case ANDROID_LOG_WARN:
-            prio_c = 'W';
-            break;
+            return 'W';
         case ANDROID_LOG_VERBOSE:
-            prio_c = 'V';
-            break;
+            return 'V';
         case ANDROID_LOG_ERROR:
-            prio_c = 'E';
-            break;
+            return 'E';
         case ANDROID_LOG_FATAL:
-            prio_c = 'F';
-            break;
+            return 'F';
         default:
-            prio_c = 'I';
-            break;
+            return 'I';
     }
-    char buf[4098];
-    // current date/time based on current system
-    timeval tv;
+}
+
+static size_t format_time(char *buf, size_t size, time_t sec) {
     tm tm;
-    gettimeofday(&tv, nullptr);
-    localtime_r(&tv.tv_sec, &tm);
-    long ms = tv.tv_usec / 1000;
-    size_t off = strftime(buf, sizeof(buf), "%m-%d %T", &tm);
-    snprintf(buf + off, sizeof(buf) - off,
-        ".%03ld %5d %5d %c : %s", ms, getpid(), gettid(), prio_c, log);
-    write(fd, buf, strlen(buf));
+    localtime_r(&sec, &tm);
+    return strftime(buf, size, "%m-%d %T", &tm);
+}
+
+// right aligned decimal of at least width digits, padded with pad
+static char *put_num(char *p, long v, int width, char pad) {
+    char tmp[24];
+    int n = 0;
+    bool neg = v < 0;
+    unsigned long u = neg? -(unsigned long) v : v;
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (neg) tmp[n++] = '-';
+    for (int i = n; i < width; i++)
+        *p++ = pad;
+    while (n > 0)
+        *p++ = tmp[--n];
+    return p;
+}
+
+// text header of a line, same as "%m-%d %T.%03ld %5d %5d %c : "
+static size_t format_header(char *buf, const char *time_str, size_t time_len,
+                            long ms, int pid, int tid, int prio) {
+    char *p = buf;
+    memcpy(p, time_str, time_len);
+    p += time_len;
+    *p++ = '.';
+    p = put_num(p, ms, 3, '0');
+    *p++ = ' ';
+    p = put_num(p, pid, 5, ' ');
+    *p++ = ' ';
+    p = put_num(p, tid, 5, ' ');
+    *p++ = ' ';
+    *p++ = prio_char(prio);
+    memcpy(p, " : ", 3);
+    p += 3;
+    return p - buf;
+}
+
+static void write_all(int fd, const char *p, size_t left) {
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+}
+
+static void flush_locked() {
+    if (log_len > 0 && log_fd >= 0)
+        write_all(log_fd, log_buf, log_len);
+    log_len = 0;
+}
+
+static void push_locked(const void *data, size_t len) {
+    if (len > LOG_BUF_SIZE - log_len)
+        flush_locked();
+    if (len > LOG_BUF_SIZE) {
+        write_all(log_fd, (const char *) data, len);
+        return;
+    }
+    memcpy(log_buf + log_len, data, len);
+    log_len += len;
+}
+
+void log_flush() {
+    pthread_mutex_lock(&log_lock);
+    flush_locked();
+    pthread_mutex_unlock(&log_lock);
+}
+
+void log_open_fd(int fd, bool binary) {
+    log_binary = binary;
+    log_pid = getpid();
+    log_fd = fd;
+    if (log_fd >= 0)
+        atexit(log_flush);
+}
+
+void log_open(const char *path, bool binary) {
+    log_open_fd(open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666), binary);
+}
+
+static void log_append(int prio, const char *msg, size_t len) {
+    if (log_fd < 0) {
+        printf("%s", msg);
+        return;
+    }
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (log_tid == 0)
+        log_tid = gettid();
+
+    pthread_mutex_lock(&log_lock);
+    if (log_binary) {
+        log_record rec{};
+        rec.magic = LOG_RECORD_MAGIC;
+        rec.len = len;
+        rec.prio = prio;
+        rec.sec = ts.tv_sec;
+        rec.usec = ts.tv_nsec / 1000;
+        rec.pid = log_pid;
+        rec.tid = log_tid;
+        push_locked(&rec, sizeof(rec));
+    } else {
+        if (ts.tv_sec != cached_sec) {
+            cached_sec = ts.tv_sec;
+            cached_time_len = format_time(cached_time, sizeof(cached_time), ts.tv_sec);
+        }
+        char head[96];
+        size_t n = format_header(head, cached_time, cached_time_len,
+                                 ts.tv_nsec / 1000000, log_pid, log_tid, prio);
+        push_locked(head, n);
+    }
+    push_locked(msg, len);
+    // errors are written out right away, in case we do not make it to exit
+    if (prio >= ANDROID_LOG_ERROR)
+        flush_locked();
+    pthread_mutex_unlock(&log_lock);
+}
+
+void log_print(int prio, const char *tag, const char *fmt, ...) {
+    int saved_errno = errno;
+    char msg[LOG_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(msg, sizeof(msg) - 1, fmt, ap);
+    va_end(ap);
+    if (len >= 0) {
+        if (len >= (int) sizeof(msg) - 1)
+            len = sizeof(msg) - 2;
+        __android_log_write(prio, tag, msg);
+        log_append(prio, msg, len);
+    }
+    errno = saved_errno;
+}
+
+int log_decode(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 1;
+    }
+    std::vector<char> data;
+    char buf[64 * 1024];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        data.insert(data.end(), buf, buf + n);
+    }
+    close(fd);
+
+    std::string out;
+    char time_str[32];
+    char head[96];
+    size_t off = 0;
+    while (off + sizeof(log_record) <= data.size()) {
+        log_record rec;
+        memcpy(&rec, data.data() + off, sizeof(rec));
+        if (rec.magic != LOG_RECORD_MAGIC || off + sizeof(rec) + rec.len > data.size()) {
+            fprintf(stderr, "%s: bad record at offset %zu\n", path, off);
+            fwrite(out.data(), 1, out.size(), stdout);
+            return 1;
+        }
+        off += sizeof(rec);
+        size_t time_len = format_time(time_str, sizeof(time_str), rec.sec);
+        out.append(head, format_header(head, time_str, time_len, rec.usec / 1000, rec.pid, rec.tid, rec.prio));
+        out.append(data.data() + off, rec.len);
+        off += rec.len;
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
 }
@@ -3,21 +3,47 @@
 #include <errno.h>
 #define LOG_TAG "OverlayFS"
 
+// lowest priority compiled in, lines below it cost nothing
+// 2 - verbose, 3 - debug, 4 - info, 5 - warn, 6 - error
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 3
+#endif
+
 extern int log_fd;
 
-#define write_log(PRIO, TAG, ...) \
-    { \
-      char logbuffer[4098]; \
-      __android_log_print(PRIO, TAG, __VA_ARGS__); \
-      snprintf(logbuffer, sizeof(logbuffer)-1, __VA_ARGS__); \
-      log_to_file(log_fd, PRIO, logbuffer); \
-    }
+// lines are formatted once, sent to logcat and appended to a buffer
+// which is written to log_fd when full, on errors and at exit
+#define write_log(PRIO, TAG, ...) log_print(PRIO, TAG, __VA_ARGS__)
+// lines of disabled levels are still checked by the compiler, but never evaluated
+#define LOG_DISCARD(...) ((void) (false && (log_print(ANDROID_LOG_DEFAULT, LOG_TAG, __VA_ARGS__), 0)))
 
-#define LOGD(...) write_log(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#if LOG_LEVEL <= 2
 #define LOGV(...) __android_log_print(ANDROID_LOG_VERBOSE, LOG_TAG, __VA_ARGS__)
+#else
+#define LOGV(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_LEVEL <= 3
+#define LOGD(...) write_log(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#else
+#define LOGD(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_LEVEL <= 4
 #define LOGI(...) write_log(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#else
+#define LOGI(...) LOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_LEVEL <= 5
 #define LOGW(...) write_log(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+#else
+#define LOGW(...) LOG_DISCARD(__VA_ARGS__)
+#endif
 #define LOGE(...) write_log(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 #define PLOGE(fmt, args...) LOGE(fmt " failed with %d: %s\n", ##args, errno, std::strerror(errno))
 
-void log_to_file(int fd, int prio, const char *log);
+// open log file, binary logs are decoded with log_decode()
+void log_open(const char *path, bool binary);
+void log_open_fd(int fd, bool binary);
+void log_print(int prio, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void log_flush();
+// print binary log in text format
+int log_decode(const char *path);
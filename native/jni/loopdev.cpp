@@ -0,0 +1,362 @@
+#include "loopdev.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+#include "dirscan.hpp"
+#include "prefetch.hpp"
+#include <sys/ioctl.h>
+#include <linux/loop.h>
+
+using namespace std;
+
+#define OVL_LOOP_CONFIGURE      0x4C0A
+#define OVL_LOOP_SET_DIRECT_IO  0x4C08
+#define OVL_LOOP_SET_BLOCK_SIZE 0x4C09
+#define OVL_LO_FLAGS_READ_ONLY  1
+#define OVL_LO_FLAGS_AUTOCLEAR  4
+#define OVL_LO_FLAGS_DIRECT_IO  16
+
+// LOOP_CONFIGURE argument, not in older uapi headers
+struct ovl_loop_config {
+    uint32_t fd;
+    uint32_t block_size;
+    struct loop_info64 info;
+    uint64_t reserved[8];
+};
+
+// loop nodes are not always created for every minor, same as losetup in mount.sh
+static int loop_minor_step() {
+    static int step = -1;
+    if (step < 0) {
+        struct stat st;
+        step = 1;
+        if (stat("/dev/block/loop1", &st) == 0 && S_ISBLK(st.st_mode) && minor(st.st_rdev) > 0)
+            step = minor(st.st_rdev);
+    }
+    return step;
+}
+
+static int open_loop(int num, string &dev) {
+    struct stat st;
+    char buf[64];
+    snprintf(buf, sizeof(buf), (access("/dev/block", F_OK) == 0)? "/dev/block/loop%d" : "/dev/loop%d", num);
+    dev = buf;
+    prof_syscall(2);
+    if (stat(buf, &st) != 0)
+        mknod(buf, S_IFBLK | 0600, makedev(7, num * loop_minor_step()));
+    return open(buf, O_RDWR | O_CLOEXEC);
+}
+
+static unsigned read_uint(const char *path) {
+    char buf[32] = {};
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    return (n > 0)? strtoul(buf, nullptr, 10) : 0;
+}
+
+// logical block size of the block device under file, 0 if unknown
+static unsigned backing_block_size(int file) {
+    struct stat st;
+    char path[128];
+    if (fstat(file, &st) != 0)
+        return 0;
+    unsigned maj = major(st.st_dev), min = minor(st.st_dev);
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/logical_block_size", maj, min);
+    unsigned size = read_uint(path);
+    if (size == 0) {
+        // partitions have no queue of their own
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/logical_block_size", maj, min);
+        size = read_uint(path);
+    }
+    return size;
+}
+
+// block size of ext4 filesystem in file, 0 if it is not ext4
+static unsigned ext4_block_size(int file) {
+    unsigned char sb[1024];
+    if (pread(file, sb, sizeof(sb), 1024) != (ssize_t) sizeof(sb))
+        return 0;
+    // s_magic at 56, s_log_block_size at 24, little endian
+    if (sb[56] != 0x53 || sb[57] != 0xEF)
+        return 0;
+    uint32_t log = sb[24] | (sb[25] << 8) | (sb[26] << 16) | ((uint32_t) sb[27] << 24);
+    return (log <= 6)? 1024u << log : 0;
+}
+
+// direct I/O only works if the loop device uses at least the logical block size of the
+// backing device, which in turn must not exceed the block size of ext4 on it
+static unsigned dio_block_size(int file, string &why) {
+    struct stat st;
+    unsigned lbs = backing_block_size(file);
+    unsigned fs_bs = ext4_block_size(file);
+    if (lbs == 0) {
+        why = "unknown backing block size";
+        return 0;
+    }
+    if (fs_bs < lbs) {
+        why = "ext4 block size " + to_string(fs_bs) + " < " + to_string(lbs);
+        return 0;
+    }
+    if (fstat(file, &st) != 0 || st.st_size % lbs != 0) {
+        why = "image size not aligned to " + to_string(lbs);
+        return 0;
+    }
+    return lbs;
+}
+
+static bool dio_enabled(int loop) {
+    struct stat st;
+    char path[128];
+    if (fstat(loop, &st) != 0)
+        return false;
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/loop/dio", major(st.st_rdev), minor(st.st_rdev));
+    return read_uint(path) == 1;
+}
+
+static int configure(int loop, int file, const char *image, bool rdonly, unsigned block_size) {
+    ovl_loop_config cfg{};
+    cfg.fd = file;
+    cfg.block_size = block_size;
+    cfg.info.lo_flags = OVL_LO_FLAGS_AUTOCLEAR;
+    if (block_size)
+        cfg.info.lo_flags |= OVL_LO_FLAGS_DIRECT_IO;
+    if (rdonly)
+        cfg.info.lo_flags |= OVL_LO_FLAGS_READ_ONLY;
+    strncpy((char *) cfg.info.lo_file_name, image, LO_NAME_SIZE - 1);
+    prof_syscall();
+    if (ioctl(loop, OVL_LOOP_CONFIGURE, &cfg) == 0)
+        return 0;
+    if (errno == EINVAL && block_size) {
+        // direct I/O or block size is refused, use buffered I/O
+        cfg.block_size = 0;
+        cfg.info.lo_flags &= ~OVL_LO_FLAGS_DIRECT_IO;
+        prof_syscall();
+        if (ioctl(loop, OVL_LOOP_CONFIGURE, &cfg) == 0)
+            return 0;
+    }
+    if (errno != EINVAL && errno != ENOTTY)
+        return -1;
+
+    // kernel before 5.8, read-only comes from the mode of file
+    prof_syscall();
+    if (ioctl(loop, LOOP_SET_FD, file) != 0)
+        return -1;
+    struct loop_info64 info{};
+    info.lo_flags = OVL_LO_FLAGS_AUTOCLEAR;
+    strncpy((char *) info.lo_file_name, image, LO_NAME_SIZE - 1);
+    prof_syscall(2);
+    if (ioctl(loop, LOOP_SET_STATUS64, &info) != 0) {
+        ioctl(loop, LOOP_CLR_FD, 0);
+        return -1;
+    }
+    if (block_size) {
+        prof_syscall(2);
+        if (ioctl(loop, OVL_LOOP_SET_BLOCK_SIZE, block_size) == 0)
+            ioctl(loop, OVL_LOOP_SET_DIRECT_IO, 1);
+    }
+    return 0;
+}
+
+// direct is false to configure buffered I/O even where direct I/O works
+static int attach(const char *image, bool rdonly, string &dev, bool direct) {
+    prof_syscall();
+    int file = open(image, (rdonly? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (file < 0) {
+        PLOGE("open %s", image);
+        return -1;
+    }
+    string why = direct? "" : "requested";
+    unsigned block_size = direct? dio_block_size(file, why) : 0;
+    int loop = -1;
+    prof_syscall();
+    int ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (ctl >= 0) {
+        // another process can take the device between GET_FREE and configure
+        for (int tries = 0; loop < 0 && tries < 16; tries++) {
+            prof_syscall();
+            int num = ioctl(ctl, LOOP_CTL_GET_FREE);
+            if (num < 0)
+                break;
+            loop = open_loop(num, dev);
+            if (loop < 0)
+                break;
+            if (configure(loop, file, image, rdonly, block_size) != 0) {
+                int err = errno;
+                close(loop);
+                loop = -1;
+                if (err != EBUSY)
+                    break;
+            }
+        }
+        close(ctl);
+    } else {
+        // no loop-control, try every device
+        for (int num = 0; loop < 0 && num < 2048; num++) {
+            loop = open_loop(num, dev);
+            if (loop >= 0 && configure(loop, file, image, rdonly, block_size) != 0) {
+                close(loop);
+                loop = -1;
+            }
+        }
+    }
+    close(file);
+    if (loop < 0) {
+        LOGE("cannot setup loop device for %s\n", image);
+        return -1;
+    }
+    if (block_size && why.empty())
+        why = "refused by kernel";
+    if (dio_enabled(loop))
+        LOGI("loop: %s <- %s%s, direct I/O, %u byte blocks\n", dev.data(), image, rdonly? " (ro)" : "", block_size);
+    else
+        LOGI("loop: %s <- %s%s, buffered I/O%s%s\n", dev.data(), image, rdonly? " (ro)" : "",
+             why.empty()? "" : ": ", why.data());
+    return loop;
+}
+
+int loop_attach(const char *image, bool rdonly, string &dev) {
+    return attach(image, rdonly, dev, true);
+}
+
+bool is_ext4(const char *path) {
+    struct statfs stfs{};
+    prof_syscall();
+    return statfs(path, &stfs) == 0 && stfs.f_type == EXT4_SUPER_MAGIC;
+}
+
+int mount_image(const char *image, const char *target, bool rdonly, string &dev) {
+    int loop = loop_attach(image, rdonly, dev);
+    if (loop < 0)
+        return -1;
+    int ret = verbose_mount(dev.data(), target, "ext4", rdonly? MS_RDONLY : 0, nullptr);
+    close(loop);
+    if (ret && rdonly && errno == EROFS) {
+        // journal of the image needs recovery, which cannot be done on a read-only device
+        LOGW("retry %s with writable loop device\n", image);
+        if ((loop = loop_attach(image, false, dev)) < 0)
+            return -1;
+        ret = verbose_mount(dev.data(), target, "ext4", MS_RDONLY, nullptr);
+        close(loop);
+    }
+    if (ret)
+        return -1;
+    if (!is_ext4(target)) {
+        LOGE("%s is not ext4\n", target);
+        verbose_umount(target, MNT_DETACH);
+        return -1;
+    }
+    return 0;
+}
+
+struct loop_cost {
+    bool dio = false;
+    size_t files = 0;
+    uint64_t bytes = 0;
+    uint64_t read_us = 0;
+    // page cache of the image file under the loop device and of the files on it
+    uint64_t image_cached = 0;
+    uint64_t files_cached = 0;
+};
+
+static void list_tree(const string &dir, vector<string> &files) {
+    dir_list list;
+    int fd = scan_dir(AT_FDCWD, dir.data(), list);
+    if (fd < 0)
+        return;
+    close(fd);
+    for (size_t i = 0; i < list.size(); i++) {
+        string path = dir + "/" + list.name(i);
+        if (list.type(i) == DT_DIR)
+            list_tree(path, files);
+        else if (list.type(i) == DT_REG)
+            files.emplace_back(std::move(path));
+    }
+}
+
+// mount image read-only at target and read every file on it once
+static bool measure_loop(const char *image, const string &target, bool direct, loop_cost &cost) {
+    int file = open(image, O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+        PLOGE("open %s", image);
+        return false;
+    }
+    // nothing of the previous run stays in the cache of the image
+    posix_fadvise(file, 0, 0, POSIX_FADV_DONTNEED);
+    string dev;
+    int loop = attach(image, true, dev, direct);
+    if (loop < 0) {
+        close(file);
+        return false;
+    }
+    cost.dio = dio_enabled(loop);
+    int ret = verbose_mount(dev.data(), target.data(), "ext4", MS_RDONLY, nullptr);
+    close(loop);
+    if (ret) {
+        close(file);
+        return false;
+    }
+    vector<string> files;
+    list_tree(target, files);
+    vector<char> buf(1 << 20);
+    uint64_t start = prof_now();
+    for (auto &f : files) {
+        int fd = open(f.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        ssize_t n;
+        while ((n = read(fd, buf.data(), buf.size())) > 0)
+            cost.bytes += n;
+        close(fd);
+    }
+    cost.read_us = (prof_now() - start) / 1000;
+    cost.files = files.size();
+    uint64_t resident, extent;
+    for (auto &f : files) {
+        int fd = open(f.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (cached_range(fd, resident, extent))
+            cost.files_cached += resident;
+        close(fd);
+    }
+    if (cached_range(file, resident, extent))
+        cost.image_cached = resident;
+    close(file);
+    // the loop device is autoclear and goes away with the mount
+    verbose_umount(target.data(), 0);
+    return true;
+}
+
+static string loop_json(const loop_cost &c) {
+    char buf[256];
+    double mbps = c.read_us? (double) c.bytes / c.read_us : 0;
+    snprintf(buf, sizeof(buf), "{\"dio\": %s, \"files\": %zu, \"bytes\": %llu, \"read_us\": %llu, "
+             "\"mb_per_s\": %.1f, \"image_cached_bytes\": %llu, \"files_cached_bytes\": %llu}",
+             c.dio? "true" : "false", c.files, (unsigned long long) c.bytes, (unsigned long long) c.read_us,
+             mbps, (unsigned long long) c.image_cached, (unsigned long long) c.files_cached);
+    return buf;
+}
+
+int loop_bench(const char *image) {
+    // mounts of the benchmark stay in a namespace of their own
+    if (unshare(CLONE_NEWNS) != 0 || mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0) {
+        PLOGE("private mount namespace");
+        return 1;
+    }
+    string target = string(image) + ".XXXXXX";
+    if (mkdtemp(target.data()) == nullptr) {
+        PLOGE("mkdtemp %s", target.data());
+        return 1;
+    }
+    loop_cost buffered, direct;
+    bool ok = measure_loop(image, target, false, buffered) && measure_loop(image, target, true, direct);
+    rmdir(target.data());
+    if (!ok)
+        return 1;
+    printf("{\n  \"image\": \"%s\",\n  \"buffered\": %s,\n  \"direct\": %s\n}\n",
+           image, loop_json(buffered).data(), loop_json(direct).data());
+    return 0;
+}
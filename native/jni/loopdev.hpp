@@ -0,0 +1,17 @@
+#pragma once
+#include "base.hpp"
+
+// Loop device setup without losetup
+// Free devices come from /dev/loop-control and are configured with LOOP_CONFIGURE
+// (LOOP_SET_FD + LOOP_SET_STATUS64 on kernels before 5.8). Devices are autoclear,
+// they go away by themselves once the filesystem on them is unmounted
+
+// attach image to a free loop device, dev is set to the device node
+// returns fd of the loop device, the device is released when it is closed unless mounted
+int loop_attach(const char *image, bool rdonly, std::string &dev);
+// attach image and mount it as ext4 at target, returns 0 on success
+int mount_image(const char *image, const char *target, bool rdonly, std::string &dev);
+bool is_ext4(const char *path);
+// mount image read-only through a buffered and a direct I/O loop device, read every
+// file on it and print throughput and page cache of image and files as JSON
+int loop_bench(const char *image);
@@ -2,54 +2,619 @@
 #include "logging.hpp"
 #include "mountinfo.hpp"
 #include "utils.hpp"
+#include "profiler.hpp"
+#include "mounttable.hpp"
+#include "threadpool.hpp"
+#include "attrs.hpp"
+#include "skeleton.hpp"
+#include "dirbuilder.hpp"
+#include "stage.hpp"
+#include "plan.hpp"
+#include "layers.hpp"
+#include "loopdev.hpp"
+#include "imagebuild.hpp"
+#include "compact.hpp"
+#include "dedup.hpp"
+#include "prefetch.hpp"
+#include "overlayopts.hpp"
+#include "dirscan.hpp"
+#include "sysops.hpp"
+#include "generations.hpp"
+#include "supervise.hpp"
+#include <unordered_set>
 
 using namespace std;
 
 #define mount(a,b,c,d,e) verbose_mount(a,b,c,d,e)
 #define umount2(a,b) verbose_umount(a,b)
 
-#define UNDER(s) (starts_with(info.target.data(), s "/") || info.target == s)
-
-#define MAKEDIR(s) \
-    if (std::find(mountpoint.begin(), mountpoint.end(), "/" s) != mountpoint.end()) { \
-        mkdir(std::string(tmp_dir + "/" s).data(), 0755); \
-        if ((dirfp = opendir("/" s)) != nullptr) { \
-            char buf[4098]; \
-            struct stat st; \
-            while ((dp = readdir(dirfp)) != nullptr) { \
-                snprintf(buf, sizeof(buf) - 1, "/" s "/%s", dp->d_name); \
-                if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 || \
-                lstat(buf, &st) != 0 || !S_ISDIR(st.st_mode)) \
-                    continue; \
-                mkdir(std::string(tmp_dir + buf).data(), 0755); \
-                mount_list.push_back(buf); \
-            } \
-            closedir(dirfp); \
-        } \
+// count syscalls for profiler, the backend decides where they go
+#define stat(a,b) (prof_syscall(), sys().stat(a,b))
+#define mkdir(a,b) (prof_syscall(), sys().mkdir(a,b))
+#define rmdir(a) (prof_syscall(), sys().rmdir(a))
+
+#define LOG_FILE "/cache/overlayfs.log"
+#define LOG_BIN_FILE "/cache/overlayfs.log.bin"
+#define PROF_REPORT "/cache/overlayfs"
+#define HOT_LIST "/data/adb/overlay.hot"
+#define UNBLOCK_FILE "/dev/.overlayfs_service_unblock"
+#define PREFETCH_JOBS 4
+
+#define RELEASE \
+    upper_tree.close_all(); \
+    worker_tree.close_all(); \
+    staged.release(); \
+    if (!tmp_dir.empty()) { \
+        umount2(tmp_dir.data(), MNT_DETACH); \
+        rmdir(tmp_dir.data()); \
     }
 
 #define CLEANUP \
+    prof_begin("cleanup"); \
     LOGI("clean up\n"); \
-    umount2(tmp_dir.data(), MNT_DETACH); \
-    rmdir(tmp_dir.data());
+    RELEASE \
+    prof_end(); \
+    prof_write_report(report_base.data());
 
 int log_fd = -1;
 std::string tmp_dir;
+// upper, worker and staging trees, directories are created relative to held dirfds
+static dir_builder upper_tree, worker_tree, staging_tree;
+static mount_stage staged;
+static layer_index module_layers;
+static bool prune_layers;
+// leave directories without files in upper or module layers on their stock mounts
+static bool selective;
+// directories left alone by selective mode, and overlayfs superblocks created
+static std::vector<std::string> deferred;
+static size_t overlay_count;
+// OVERLAY_PROFILE features the kernel supports
+static unsigned overlay_features;
+// frozen generations of upper, newest first
+static std::vector<std::string> generations;
+// --replay runs against a recorded trace, reports go to its scratch dir
+static bool replaying;
+static std::string report_base = PROF_REPORT;
 
-int main(int argc, const char **argv) {
-    bool overlay = false;
-    FILE *fp = fopen("/proc/filesystems", "re");
-    if (fp) {
-        char buf[1024];
-        while (fgets(buf, sizeof(buf), fp)) {
-            buf[strlen(buf)-1] = '\0';
-            if (strcmp(buf + 6, "overlay") == 0) {
-                overlay = true;
+// stage overlayfs with the option profile, then with the plain options if the kernel refuses it
+static int stage_overlay(const std::string &target, bool rdonly, const std::function<std::string(unsigned)> &opts) {
+    if (staged.overlay(target, opts(overlay_features), rdonly) == 0)
+        return 0;
+    if (overlay_features == 0)
+        return 1;
+    LOGW("overlay profile refused for [%s], retry with plain options\n", target.data());
+    return staged.overlay(target, opts(0), rdonly);
+}
+
+// setup upperdir and workdir of [info] and stage overlayfs for it
+// return 0 on success, 1 if overlayfs cannot be mounted, -1 if upperdir or workdir cannot be created
+static int mount_overlay(const char *writable, const std::string &info, int OVERLAY_MODE, bool merged, skeleton *skel) {
+    std::string upperdir = std::string(writable) + "/upper" + info;
+    std::string workerdir = std::string(writable) + "/worker" + info;
+    // upperdir and workdir created by previous boots are reused as is
+    if (skel->contains(info) && is_dir(upperdir.data()) && is_dir(workerdir.data())) {
+        const file_attr *attr = get_attr(info.data());
+        if (!skel->matches(info, attr)) {
+            // the stock directory changed owner, mode or label since upperdir was cloned from it
+            LOGD("clone attr [%s] again from [%s]\n", attr->con.data(), info.data());
+            clone_attrs(AT_FDCWD, upperdir.data(), attr);
+            skel->add(info, attr);
+        }
+        goto setup_done;
+    }
+    {
+        // new directories of upperdir clone attributes from the real ones
+        auto clone = [](int dirfd, const char *name, std::string_view path) {
+            std::string src = "/" + std::string(path);
+            if (const file_attr *attr = get_attr(src.data())) {
+                LOGD("clone attr [%s] from [%s]\n", attr->con.data(), src.data());
+                clone_attrs(dirfd, name, attr);
+            }
+        };
+        if (upper_tree.mkdirs(info, 0755, clone) < 0 ||
+            worker_tree.mkdirs(info, 0755) < 0) {
+            LOGD("setup upperdir or workdir failed!\n");
+            return -1;
+        }
+    }
+    skel->add(info, get_attr(info.data()));
+
+    setup_done:
+    {
+        // generations, then only module layers with files under info, or the master with all of them
+        std::vector<std::string> lowers;
+        bool with_upper = overlay_lowers(writable, info, generations, prune_layers? &module_layers : nullptr,
+                                         merged, lowers);
+        std::string lowerdir = overlay_lowerdir(lowers, info);
+        auto rw = [&](unsigned features) {
+            // a refused volatile mount may leave its marker, which blocks every later mount of workdir
+            if ((overlay_features & OVL_FEAT_VOLATILE) && !(features & OVL_FEAT_VOLATILE)) {
+                unlink((workerdir + "/work/incompat/volatile/dirty").data());
+                rmdir((workerdir + "/work/incompat/volatile").data());
+            }
+            return overlay_rw_opts(lowerdir, upperdir, workerdir, features);
+        };
+        auto ro = [&](unsigned features) { return overlay_ro_opts(lowerdir, upperdir, with_upper, features); };
+
+        // 0 - read-only
+        // 1 - read-write default
+        // 2 - read-only locked
+
+        if (OVERLAY_MODE == 2 || stage_overlay(info, OVERLAY_MODE != 1, rw)) {
+            if (stage_overlay(info, false, ro))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+// nothing in upper, a generation or any module layer under info, its overlayfs would only show the stock files
+static bool untouched(const std::string &writable, const std::string &info) {
+    std::vector<std::string> lowers;
+    if (!module_layers.lowers(info, lowers) || !lowers.empty())
+        return false;
+    // upper dirs are created for every overlay, so one from an older boot may be empty
+    std::vector<std::string> dirs = { writable + "/upper" + info };
+    for (auto &gen : generations)
+        dirs.emplace_back(gen + info);
+    for (auto &dir : dirs) {
+        dir_list list;
+        int fd = scan_dir(AT_FDCWD, dir.data(), list);
+        if (fd < 0) {
+            if (errno != ENOENT)
+                return false;
+            continue;
+        }
+        close(fd);
+        if (list.size() != 0)
+            return false;
+    }
+    return true;
+}
+
+// profiler phase of every step of the plan
+static const char *phase_of(const plan_op &op) {
+    switch (op.type) {
+        case PLAN_MASTER: return "master";
+        case PLAN_OVERLAY: return (op.fallback == PLAN_FALLBACK_SKIP)? "prepare_mounts" : "stock_mounts";
+        case PLAN_BIND: return "stock_mounts";
+        case PLAN_ATTACH: return "load_overlayfs";
+        case PLAN_PROPAGATE: return "propagation";
+        case PLAN_MIRROR: return "mirrors";
+    }
+    return "unknown";
+}
+
+// stage overlays of ops [begin, end), all of them with PLAN_FALLBACK_SKIP
+// with OVERLAY_JOBS > 1, overlays are prepared and staged on a worker pool,
+// results are collected in plan order so the next steps stay deterministic
+static int prepare_mounts(const mount_plan &plan, size_t begin, size_t end, const plan_input &in,
+                          int jobs, bool merged, skeleton *skel, std::unordered_set<std::string_view> &done) {
+    if (!staged.detached()) {
+        for (size_t i = begin; i < end; i++)
+            staging_tree.mkdirs(plan.ops[i].target, 0755);
+        // staging tree is covered by overlays from now on
+        staging_tree.close_all();
+    }
+    if (jobs > 1)
+        LOGI("prepare mounts with %d threads\n", jobs);
+    std::vector<int> results(end - begin, 2);
+    std::atomic<bool> failed(false);
+    int parent_phase = prof_current();
+    parallel_for(end - begin, jobs, [&](size_t i) {
+        auto &info = plan.ops[begin + i].target;
+        if (failed)
+            return;
+        prof_set_current(parent_phase);
+        PROF_PHASE(("overlay:" + info).data());
+        if (selective && untouched(in.writable, info)) {
+            results[i] = 3;
+            return;
+        }
+        results[i] = mount_overlay(in.writable.data(), info, in.overlay_mode, merged, skel);
+        if (results[i] < 0)
+            failed = true;
+    });
+    if (failed)
+        return 1;
+    for (size_t i = begin; i < end; i++) {
+        if (results[i - begin] == 1)
+            LOGW("Unable to add [%s], ignore!\n", plan.ops[i].target.data());
+        if (results[i - begin] == 3) {
+            LOGD("selective: keep stock [%s]\n", plan.ops[i].target.data());
+            deferred.push_back(plan.ops[i].target);
+        }
+        if (results[i - begin] == 0) {
+            done.insert(plan.ops[i].target);
+            overlay_count++;
+        }
+    }
+    return 0;
+}
+
+static int execute_ops(const mount_plan &plan, const plan_input &in, int jobs, skeleton *skel) {
+    // targets with a staged mount
+    std::unordered_set<std::string_view> done;
+    const char *phase = nullptr;
+    bool merged = false;
+    bool mirroring = false;
+    // stock mounts under deferred directories stay as they are too
+    mount_table deferred_index;
+    for (size_t i = 0; i < plan.ops.size(); i++) {
+        auto &op = plan.ops[i];
+        auto &info = op.target;
+        const char *next = phase_of(op);
+        if (phase == nullptr || strcmp(phase, next) != 0) {
+            if (phase)
+                prof_end();
+            prof_begin(next);
+            phase = next;
+            if (strcmp(phase, "prepare_mounts") == 0)
+                LOGI("** Prepare mounts\n");
+            else if (strcmp(phase, "load_overlayfs") == 0)
+                LOGI("** Loading overlayfs\n");
+        }
+        switch (op.type) {
+        case PLAN_MASTER: {
+            std::string upperdir = in.writable + "/upper";
+            if (!in.overlaylist.empty()) {
+                std::string opts = overlay_master_opts(upperdir, in.overlaylist, overlay_features);
+                merged = (mount("overlay", info.data(), "overlay", 0, opts.data()) == 0)? true : false;
+                if (!merged && overlay_features) {
+                    LOGW("overlay profile refused for master, retry with plain options\n");
+                    opts = overlay_master_opts(upperdir, in.overlaylist);
+                    merged = (mount("overlay", info.data(), "overlay", 0, opts.data()) == 0)? true : false;
+                }
+                if (merged)
+                    overlay_count++;
+            } else {
+                merged = (mount(upperdir.data(), info.data(), nullptr, MS_BIND, nullptr) == 0)? true : false;
+            }
+            break;
+        }
+        case PLAN_OVERLAY:
+            if (op.fallback == PLAN_FALLBACK_SKIP) {
+                size_t end = i;
+                while (end < plan.ops.size() && plan.ops[end].type == PLAN_OVERLAY &&
+                       plan.ops[end].fallback == PLAN_FALLBACK_SKIP)
+                    end++;
+                if (prepare_mounts(plan, i, end, in, jobs, merged, skel, done))
+                    return 1;
+                for (auto &s : deferred)
+                    deferred_index.insert(s);
+                i = end - 1;
+                break;
+            } else {
+                if (deferred_index.is_under(info))
+                    break;
+                PROF_PHASE(("stock:" + info).data());
+                switch (mount_overlay(in.writable.data(), info, in.overlay_mode, merged, skel)) {
+                    case -1:
+                        return 1;
+                    case 0:
+                        overlay_count++;
+                        break;
+                    case 1:
+                        // for some reason, overlayfs does not support some filesystems such as vfat, tmpfs, f2fs
+                        // then bind mount it back but we will not be able to modify its content
+                        LOGW("mount overlayfs failed, fall to bind mount!\n");
+                        if (staged.bind(info)) {
+                            LOGE("mount failed, abort!\n");
+                            return 1;
+                        }
+                }
+                done.insert(info);
                 break;
             }
+        case PLAN_BIND: {
+            if (deferred_index.is_under(info))
+                break;
+            PROF_PHASE(("stock:" + info).data());
+            if (staged.bind(info)) {
+                // mount fails
+                LOGE("mount failed, abort!\n");
+                return 1;
+            }
+            done.insert(info);
+            break;
+        }
+        case PLAN_ATTACH:
+            if (done.count(info) && staged.attach(info)) {
+                LOGE("mount failed, abort!\n");
+                // revert all mounts
+                staged.rollback();
+                return 1;
+            }
+            break;
+        case PLAN_PROPAGATE:
+            // mirrors are best effort
+            if (staged.propagate() && !mirroring) {
+                LOGE("mount failed, abort!\n");
+                staged.rollback();
+                return 1;
+            }
+            break;
+        case PLAN_MIRROR:
+            mirroring = true;
+            if (done.count(info))
+                staged.mirror(info, in.mirrors + info);
+            break;
+        }
+    }
+    return 0;
+}
+
+// apply plan, returns 0 on success
+// on failure everything attached so far is detached again
+static int execute_plan(const mount_plan &plan, const plan_input &in, int jobs, skeleton *skel) {
+    int base = prof_current();
+    int ret = execute_ops(plan, in, jobs, skel);
+    // end the phase of the last step, also when it failed
+    while (prof_current() != base)
+        prof_end();
+    return ret;
+}
+
+// legacy backend stages overlays in a private tmpfs under /mnt
+static int init_staging(bool use_fsmount) {
+    if (!use_fsmount) {
+        tmp_dir = std::string("/mnt/") + "overlayfs_" + random_strc(20);
+        if (mkdir(tmp_dir.data(), 750) != 0) {
+            LOGE("Cannot create temp folder, please make sure /mnt is clean and write-able!\n");
+            return -1;
+        }
+        mount("tmpfs", tmp_dir.data(), "tmpfs", 0, nullptr);
+        staging_tree.open_root(tmp_dir.data());
+    }
+    staged.init(use_fsmount, tmp_dir);
+    if (!use_fsmount)
+        staged.private_staging();
+    return 0;
+}
+
+// Magisk mirrors dir, empty if there is none
+static std::string magisk_mirrors() {
+    const char *MAGISKTMP_env = xgetenv("MAGISKTMP");
+    struct stat st;
+    if (str_empty(MAGISKTMP_env))
+        return "";
+    std::string mirrors = std::string(MAGISKTMP_env) + "/.magisk/mirror";
+    if (stat(mirrors.data(), &st) != 0 || !S_ISDIR(st.st_mode))
+        return "";
+    LOGD("Magisk mirrors path is %s\n", mirrors.data());
+    return mirrors;
+}
+
+// features of OVERLAY_PROFILE which the kernel knows
+static unsigned probe_profile(const char *writable) {
+    const char *OVERLAY_PROFILE_env = xgetenv("OVERLAY_PROFILE");
+    unsigned wanted = overlay_profile(OVERLAY_PROFILE_env? atoi(OVERLAY_PROFILE_env) : 0);
+    if (wanted == 0)
+        return 0;
+    unsigned features = wanted & overlay_probe_features();
+    // upper is not synced, after a crash it may be broken, fine for a tmpfs which is gone anyway
+    struct statfs stfs{};
+    if ((features & OVL_FEAT_VOLATILE) && (statfs(writable, &stfs) != 0 || stfs.f_type != TMPFS_MAGIC)) {
+        LOGW("volatile is only used when %s is a tmpfs\n", writable);
+        features &= ~OVL_FEAT_VOLATILE;
+    }
+    LOGI("overlay profile: %s\n", overlay_feature_names(features).data());
+    if (features != wanted)
+        LOGI("overlay profile: kernel or writable dir lacks %s\n", overlay_feature_names(wanted & ~features).data());
+    return features;
+}
+
+// one directory per line
+static bool save_deferred(const char *path) {
+    std::string data;
+    for (auto &dir : deferred)
+        data += dir + "\n";
+    std::string tmp = std::string(path) + ".tmp";
+    int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t) data.size() && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.data(), path) != 0) {
+        unlink(tmp.data());
+        return false;
+    }
+    return true;
+}
+
+static bool load_deferred(const char *path) {
+    FILE *fp = fopen(path, "re");
+    if (fp == nullptr)
+        return false;
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    deferred.clear();
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (line[0] == '/')
+            deferred.emplace_back(line);
+    }
+    free(line);
+    fclose(fp);
+    return true;
+}
+
+// --mount-dir <writable> <dir>
+// mount the overlayfs which selective mode skipped for dir or a parent of it, the same
+// way OVERLAY_MODE=0 does, so it can be remounted as read-write.
+// writable is where the image is reachable after boot, $MAGISKTMP/overlayfs_mnt
+static int mount_deferred(const char *writable, const char *dir) {
+    log_open(LOG_FILE, false);
+    prof_init();
+    std::string list = std::string(writable) + "/.deferred";
+    if (!load_deferred(list.data())) {
+        printf("%s was not left on its stock mount\n", dir);
+        return 1;
+    }
+    mount_table index;
+    for (size_t i = 0; i < deferred.size(); i++)
+        index.insert(deferred[i], i);
+    int idx = index.covering(dir);
+    if (idx < 0) {
+        printf("%s was not left on its stock mount\n", dir);
+        return 1;
+    }
+    plan_input in;
+    in.writable = writable;
+    in.mirrors = magisk_mirrors();
+    in.overlay_mode = 0;
+    in.subtree = deferred[idx];
+    // nothing is skipped from here on, stock mounts under subtree are restored as usual
+    deferred.clear();
+    mount_info_table mounts;
+    parse_mount_info_view("self", mounts);
+    for (auto &m : mounts.entries) {
+        if (m.type == "overlay" && m.target == in.subtree) {
+            printf("%s is already mounted\n", in.subtree.data());
+            return 0;
+        }
+    }
+    LOGI("* Mount deferred %s\n", in.subtree.data());
+    mount_plan plan;
+    build_plan(in, mounts, plan);
+    const char *OVERLAY_MOUNT_API_env = xgetenv("OVERLAY_MOUNT_API");
+    bool use_fsmount = (OVERLAY_MOUNT_API_env? atoi(OVERLAY_MOUNT_API_env) : 1) != 0 && fsmount_supported();
+    if (init_staging(use_fsmount) != 0)
+        return 1;
+    overlay_features = probe_profile(writable);
+    generations = gen_layers(writable);
+    upper_tree.open_root((in.writable + "/upper").data());
+    worker_tree.open_root((in.writable + "/worker").data());
+    // no module has files under a deferred directory, the master is not needed
+    prune_layers = true;
+    // no skeleton, the upper dir of a deferred directory may not exist yet
+    skeleton skel;
+    int ret = execute_plan(plan, in, 1, &skel);
+    if (ret == 0 && overlay_count == 0)
+        ret = 1;
+    RELEASE
+    if (ret != 0) {
+        printf("Unable to mount %s\n", in.subtree.data());
+        return 1;
+    }
+    printf("%s is mounted, remount it as read-write with: mount -o remount,rw %s\n",
+           in.subtree.data(), in.subtree.data());
+    return 0;
+}
+
+// --mount-images <rw|ro> <image> <target> ...
+// attach and mount all images in parallel, print "<target> <loop device>" for every
+// image which is mounted as ext4, in the order they are given
+static int mount_images(int argc, const char **argv) {
+    if (argc == 0 || argc % 3 != 0) {
+        printf("Usage: --mount-images <rw|ro> <image> <target> ...\n");
+        return 1;
+    }
+    log_open(LOG_FILE, false);
+    size_t n = argc / 3;
+    std::vector<std::string> devs(n);
+    std::vector<int> results(n, -1);
+    parallel_for(n, std::min<size_t>(n, 8), [&](size_t i) {
+        const char **arg = argv + i * 3;
+        bool rdonly = strcmp(arg[0], "ro") == 0;
+        results[i] = mount_image(arg[1], arg[2], rdonly, devs[i]);
+    });
+    int ret = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (results[i] == 0)
+            printf("%s %s\n", argv[i * 3 + 2], devs[i].data());
+        else
+            ret = 1;
+    }
+    return ret;
+}
+
+// frozen generations of upper on top of the module layers
+static std::string lower_layers(const char *writable, const char *overlaylist) {
+    std::string layers;
+    for (auto &gen : gen_layers(writable))
+        layers += gen + ":";
+    if (!str_empty(overlaylist))
+        layers += overlaylist;
+    else if (!layers.empty())
+        layers.pop_back();
+    return layers;
+}
+
+// true if an overlayfs uses a layer under writable
+static bool writable_in_use(const char *writable) {
+    mount_info_table mounts;
+    std::string dir = std::string(writable) + "/";
+    if (!parse_mount_info_view("self", mounts))
+        return false;
+    for (auto &m : mounts.entries) {
+        if (m.type == "overlay" && m.fs_option.find(dir) != std::string_view::npos) {
+            LOGE("%s is in use by %s\n", writable, m.target.data());
+            return true;
+        }
+    }
+    return false;
+}
+
+// --compact <writable>
+// garbage collect <writable>/upper before it is used by any overlayfs
+static int compact(const char *writable) {
+    log_open(LOG_FILE, false);
+    prof_init();
+    if (writable_in_use(writable))
+        return 1;
+    gen_apply(writable);
+    module_layers.load(lower_layers(writable, xgetenv("OVERLAYLIST")).data());
+    int jobs = std::max(1L, std::min(8L, sysconf(_SC_NPROCESSORS_ONLN)));
+    compact_stats stats;
+    if (compact_upper(writable, module_layers, jobs, stats) != 0)
+        return 1;
+    printf("compact: removed %zu copy-ups, %zu whiteouts, %zu empty dirs, %llu KiB reclaimed\n",
+           stats.copyups, stats.whiteouts, stats.dirs, (unsigned long long) (stats.bytes / 1024));
+    return 0;
+}
+
+// --dedup <writable>
+// build <writable>/dedup for OVERLAYLIST, mount.sh puts it on top of the module layers
+static int dedup(const char *writable) {
+    log_open(LOG_FILE, false);
+    prof_init();
+    if (writable_in_use(writable))
+        return 1;
+    const char *overlaylist = xgetenv("OVERLAYLIST");
+    module_layers.load(overlaylist);
+    int jobs = std::max(1L, std::min(8L, sysconf(_SC_NPROCESSORS_ONLN)));
+    dedup_stats stats;
+    if (dedup_layers(writable, overlaylist, module_layers, jobs, stats) != 0)
+        return 1;
+    LOGI("dedup: %zu files linked to %zu shared copies, page cache estimated %llu KiB -> %llu KiB\n",
+         stats.links, stats.objects, (unsigned long long) (stats.footprint_before / 1024),
+         (unsigned long long) (stats.footprint_after / 1024));
+    return 0;
+}
+
+// mount everything for writable argv[1], also --plan and --test
+static int boot(int argc, const char **argv) {
+    // OVERLAY_TRACE=<file> records what this boot reads and does, for --replay
+    const char *OVERLAY_TRACE_env = getenv("OVERLAY_TRACE");
+    if (!replaying && !str_empty(OVERLAY_TRACE_env) && argc >= 2 && argv[1][0] == '/')
+        sys_use(sys_recorder(OVERLAY_TRACE_env, argv[1]));
+    prof_init();
+    prof_begin("probe_filesystems");
+    bool overlay = false;
+    std::vector<char> filesystems;
+    if (sys().read_file("/proc/filesystems", filesystems)) {
+        std::string_view list(filesystems.data(), filesystems.size());
+        while (!list.empty() && !overlay) {
+            size_t eol = std::min(list.find('\n'), list.size());
+            std::string_view line = list.substr(0, eol);
+            overlay = line.size() > 6 && line.substr(6) == "overlay";
+            list.remove_prefix(std::min(eol + 1, list.size()));
         }
-        fclose(fp);
     }
+    prof_end();
     if (!overlay) {
         printf("No overlay supported by kernel!\n");
         return 1;
@@ -58,14 +623,17 @@ int main(int argc, const char **argv) {
         printf("You forgot to tell me the write-able folder :v\n");
         return 1;
     }
+    // --plan only prints what would be done as JSON, nothing is mounted or created
+    bool dry_run = argc >= 3 && strcmp(argv[1], "--plan") == 0;
+    if (dry_run) {
+        argc--;
+        argv++;
+    }
     if (strcmp(argv[1], "--test") == 0) {
         argc--;
         argv++;
-        if (argc >= 3 && strcmp(argv[1], "--check-ext4") == 0) {
-            struct statfs stfs{};
-            return (statfs(argv[2], &stfs) == 0 && stfs.f_type == EXT4_SUPER_MAGIC)?
-                0 : 1;
-        }
+        if (argc >= 3 && strcmp(argv[1], "--check-ext4") == 0)
+            return is_ext4(argv[2])? 0 : 1;
         return 0;
     } else if (argv[1][0] != '/') {
         printf("Please tell me the full path of folder >:)\n");
@@ -82,311 +650,220 @@ int main(int argc, const char **argv) {
         return 1;
     }
 
-    log_fd = open("/cache/overlayfs.log", O_RDWR | O_CREAT | O_APPEND, 0666);
+    if (dry_run) {
+        // keep stdout for the plan
+        log_open_fd(STDERR_FILENO, false);
+    } else if (!replaying) {
+        // binary log skips time formatting, use --decode-log to read it
+        const char *OVERLAY_LOG_BINARY_env = getenv("OVERLAY_LOG_BINARY");
+        if (OVERLAY_LOG_BINARY_env && atoi(OVERLAY_LOG_BINARY_env) != 0)
+            log_open(LOG_BIN_FILE, true);
+        else
+            log_open(LOG_FILE, false);
+    }
     LOGI("* Mount OverlayFS started\n");
 
+    {
+        PROF_PHASE("generations");
+        if (!dry_run)
+            gen_apply(argv[1]);
+        generations = gen_layers(argv[1]);
+    }
+
     const char *OVERLAY_MODE_env = xgetenv("OVERLAY_MODE");
     const char *OVERLAYLIST_env = xgetenv("OVERLAYLIST");
-    const char *MAGISKTMP_env = xgetenv("MAGISKTMP");
+    const char *OVERLAY_JOBS_env = xgetenv("OVERLAY_JOBS");
+    const char *OVERLAY_MOUNT_API_env = xgetenv("OVERLAY_MOUNT_API");
+    const char *OVERLAY_PRUNE_LAYERS_env = xgetenv("OVERLAY_PRUNE_LAYERS");
+    const char *OVERLAY_PREFETCH_env = xgetenv("OVERLAY_PREFETCH");
+    const char *OVERLAY_SELECTIVE_env = xgetenv("OVERLAY_SELECTIVE");
 
-    if (OVERLAYLIST_env == nullptr) OVERLAYLIST_env = "";
     int OVERLAY_MODE = (OVERLAY_MODE_env)? atoi(OVERLAY_MODE_env) : 0;
 
-    const char *mirrors = nullptr;
-    if (!str_empty(MAGISKTMP_env)) {
-        mirrors = string(string(MAGISKTMP_env) + "/.magisk/mirror").data();
-        if (stat(mirrors, &z) != 0 || !S_ISDIR(z.st_mode))
-            mirrors = nullptr;
-    }
-    if (mirrors) {
-        LOGD("Magisk mirrors path is %s\n", mirrors);
+    plan_input in;
+    in.writable = argv[1];
+    in.overlaylist = OVERLAYLIST_env? OVERLAYLIST_env : "";
+    in.mirrors = magisk_mirrors();
+    in.overlay_mode = OVERLAY_MODE;
+
+    prof_begin("parse_mount_info");
+    mount_info_table current_mount_info;
+    parse_mount_info_view("self", current_mount_info);
+    prof_end();
+
+    // 1 - give each overlayfs only the module layers it needs (default)
+    // 0 - stack the master with all modules under every overlayfs
+    prune_layers = (OVERLAY_PRUNE_LAYERS_env? atoi(OVERLAY_PRUNE_LAYERS_env) : 1) != 0 && !in.overlaylist.empty();
+    // 1 - in read-only modes, keep directories nothing is stacked on as stock mounts
+    selective = OVERLAY_MODE != 1 && OVERLAY_SELECTIVE_env && atoi(OVERLAY_SELECTIVE_env) != 0;
+    if ((prune_layers || selective) && !in.overlaylist.empty()) {
+        PROF_PHASE("layers");
+        module_layers.load(in.overlaylist.data());
     }
 
-    std::vector<string> mountpoint;
-    std::vector<mount_info> mountinfo;
+    mount_plan plan;
+    if (dry_run) {
+        build_plan(in, current_mount_info, plan);
+        std::string json = plan_to_json(in, plan, generations, prune_layers? &module_layers : nullptr);
+        fwrite(json.data(), 1, json.size(), stdout);
+        return 0;
+    }
+    // plan of previous boot is reused as long as nothing it was built from changed
+    std::string plan_path = in.writable + "/.plan";
+    bool cached = load_plan(plan_path.data(), plan_key(in, current_mount_info), plan);
+    if (cached)
+        LOGI("use cached mount plan\n");
+    else
+        build_plan(in, current_mount_info, plan);
 
-    // list of directories should be mounted!
-    std::vector<string> mount_list;
+    // 0 - legacy: stage overlays in a tmpfs and bind mount them
+    // 1 - use fsopen/fsmount/move_mount when kernel supports it (default)
+    bool use_fsmount = (OVERLAY_MOUNT_API_env? atoi(OVERLAY_MOUNT_API_env) : 1) != 0 &&
+                       sys().native() && fsmount_supported();
+    LOGI("mount api: %s\n", use_fsmount? "fsmount" : "legacy");
 
-    tmp_dir = std::string("/mnt/") + "overlayfs_" + random_strc(20);
-    if (mkdir(tmp_dir.data(), 750) != 0) {
-        LOGE("Cannot create temp folder, please make sure /mnt is clean and write-able!\n");
+    if (init_staging(use_fsmount) != 0)
         return -1;
-    }
     mkdir(std::string(std::string(argv[1]) + "/upper").data(), 0750);
     mkdir(std::string(std::string(argv[1]) + "/worker").data(), 0750);
     mkdir(std::string(std::string(argv[1]) + "/master").data(), 0750);
-    mount("tmpfs", tmp_dir.data(), "tmpfs", 0, nullptr);
-
-    // trim mountinfo
-    do {
-        auto current_mount_info = parse_mount_info("self");
-        std::reverse(current_mount_info.begin(), current_mount_info.end());
-        for (auto &info : current_mount_info) {
-            struct stat st;
-            // skip mount under another mounr
-            if (stat(info.target.data(), &st) || info.device != st.st_dev)
-                continue;
-            if (UNDER("/system") ||
-                 UNDER("/vendor") ||
-                 UNDER("/system_ext") ||
-                 UNDER("/product")) {
-                for (auto &s : mountpoint) {
-                    if (s == info.target)
-                        goto next_mountpoint;
-                 }
-                //printf("new mount: %s\n", info.target.data());
-                mountpoint.emplace_back(info.target);
-                mountinfo.emplace_back(info);
-            }
-            next_mountpoint:
-            continue;
-        }
-    } while(false);
+    upper_tree.open_root(std::string(std::string(argv[1]) + "/upper").data());
+    worker_tree.open_root(std::string(std::string(argv[1]) + "/worker").data());
 
-    struct mount_info system;
-    system.target = "/system";
-    system.type = "ext4";
-    if (std::find(mountpoint.begin(), mountpoint.end(), "/system") == mountpoint.end()) {
-        mountinfo.emplace_back(system);
-        mountpoint.emplace_back("/system");
+    // manifest of upper/worker dirs created by previous boots
+    skeleton skel;
+    std::string skel_path = std::string(argv[1]) + "/.skeleton";
+    {
+        PROF_PHASE("skeleton");
+        skel.load(skel_path.data(), hash_str(0, get_build_fingerprint()), plan.topology);
     }
-    DIR *dirfp;
-    struct dirent *dp;
 
-    MAKEDIR("system")
-    MAKEDIR("vendor")
-    MAKEDIR("system_ext")
-    MAKEDIR("product")
-
-    mountpoint.clear();
-
-    bool merged = false;
     {
-        std::string upperdir = std::string(argv[1]) + "/upper";
-        std::string masterdir = std::string(argv[1]) + "/master";
-        if (!str_empty(OVERLAYLIST_env)) {
-            std::string opts = "lowerdir=";
-            opts += upperdir + ":" + OVERLAYLIST_env;
-            merged = (mount("overlay", masterdir.data(), "overlay", 0, opts.data()) == 0)? true : false;
-        } else {
-            merged = (mount(upperdir.data(), masterdir.data(), nullptr, MS_BIND, nullptr) == 0)? true : false;
-        }
+        PROF_PHASE("overlay_features");
+        overlay_features = probe_profile(argv[1]);
     }
 
-    LOGI("** Prepare mounts\n");
-    // mount overlayfs for subdirectories of /system /vendor /product /system_ext
-    std::reverse(mountinfo.begin(), mountinfo.end());
-    for (auto &info : mount_list) {
-        struct stat st;
-        if (stat(info.data(), &st))
-            continue;
-        std::string tmp_mount = tmp_dir + info;
-
-        std::string upperdir = std::string(argv[1]) + "/upper" + info;
-        std::string workerdir = std::string(argv[1]) + "/worker" + info;
-        std::string masterdir = std::string(argv[1]) + "/master" + info;
-        char *con;
-        {
-            char *s = strdup(info.data());
-            char *ss = s;
-            while ((ss = strchr(ss, '/')) != nullptr) {
-                ss[0] = '\0';
-                auto sub = std::string(argv[1]) + "/upper" + s;
-                if (mkdir(sub.data(), 0755) == 0 && getfilecon(s, &con) >= 0) {
-                    LOGD("clone attr [%s] from [%s]\n", con, s);
-                    chown(sub.data(), getuidof(s), getgidof(s));
-                    chmod(sub.data(), getmod(s));
-                    setfilecon(sub.data(), con);
-                    freecon(con);
-                }
-                ss[0] = '/';
-                ss++;
-            }
-            free(s);
-        };
-        
-        {
-            if (mkdir(upperdir.data(), 0755) == 0 && getfilecon(info.data(), &con) >= 0) {
-                LOGD("clone attr [%s] from [%s]\n", con, info.data());
-                chown(upperdir.data(), getuidof(info.data()), getgidof(info.data()));
-                chmod(upperdir.data(), getmod(info.data()));
-                setfilecon(upperdir.data(), con);
-                freecon(con);
-            }
-            mkdirs(workerdir.data(), 0755);
+    int jobs = OVERLAY_JOBS_env? atoi(OVERLAY_JOBS_env) : 1;
+    prof_begin("execute");
+    int ret = execute_plan(plan, in, jobs, &skel);
+    prof_end();
+    if (ret == 0) {
+        LOGI("mount done!\n");
+        LOGI("%zu overlayfs superblocks, %zu directories left on stock mounts\n", overlay_count, deferred.size());
+        // only read-only but remountable mode can mount them later
+        std::string deferred_path = in.writable + "/.deferred";
+        if (OVERLAY_MODE == 0 && !deferred.empty())
+            save_deferred(deferred_path.data());
+        else
+            unlink(deferred_path.data());
+        skel.save(skel_path.data());
+        if (!cached)
+            save_plan(plan_path.data(), plan);
+        if (!replaying && OVERLAY_PREFETCH_env && atoi(OVERLAY_PREFETCH_env) > 0)
+            prefetch_background(HOT_LIST, PREFETCH_JOBS);
+        if (!replaying)
+            gen_gc_background(argv[1]);
+    }
+    CLEANUP
+    return ret;
+}
 
-            if (!is_dir(upperdir.data()) ||
-                !is_dir(workerdir.data())) {
-                LOGD("setup upperdir or workdir failed!\n");
-                CLEANUP
-                return 1;
-            }
-        }
-        {
-            std::string opts;
-            opts += "lowerdir=";
-            if (stat(masterdir.data(), &st) == 0 && S_ISDIR(st.st_mode))
-                opts += masterdir + ":";
-            opts += info.data();
-            opts += ",upperdir=";
-            opts += upperdir;
-            opts += ",workdir=";
-            opts += workerdir;
-            
-            // 0 - read-only
-            // 1 - read-write default
-            // 2 - read-only locked
-            
-            if (OVERLAY_MODE == 2 || mount("overlay", tmp_mount.data(), "overlay", ((OVERLAY_MODE == 1)? 0 : MS_RDONLY), opts.data())) {
-                opts = "lowerdir=";
-                if (!merged) {
-                    opts += upperdir;
-                    opts += ":";
-                }
-                if (stat(masterdir.data(), &st) == 0 && S_ISDIR(st.st_mode))
-                    opts += masterdir + ":";
-                opts += info.data();
-                if (mount("overlay", tmp_mount.data(), "overlay", 0, opts.data())) {
-                    LOGW("Unable to add [%s], ignore!\n", info.data());
-                    continue;
-                }
-            }
-        }
-        mountpoint.emplace_back(info);
-    }
-
-    // restore stock mounts if possible
-    // if stock mount is directory, merge it with overlayfs
-    // if stock mount is file, then we bind mount it back
-    for (auto &mnt : mountinfo) {
-        auto info = mnt.target;
-        std::string tmp_mount = tmp_dir + info;
-        struct stat st;
-        for (auto &s : mount_list) {
-            // only care about mountpoint under overlayfs mounted subdirectories
-            if (!starts_with(info.data(), string(s + "/").data()))
-               continue;
-            char *con;
-            std::string upperdir = std::string(argv[1]) + "/upper" + info;
-            std::string workerdir = std::string(argv[1]) + "/worker" + info;
-            std::string masterdir = std::string(argv[1]) + "/master" + info;
-            if (stat(info.data(), &st) == 0 && !S_ISDIR(st.st_mode))
-                goto bind_mount;
-            {
-                char *s = strdup(info.data());
-                char *ss = s;
-                while ((ss = strchr(ss, '/')) != nullptr) {
-                    ss[0] = '\0';
-                    auto sub = std::string(argv[1]) + "/upper" + s;
-                    if (mkdir(sub.data(), 0755) == 0 && getfilecon(s, &con) >= 0) {
-                        LOGD("clone attr [%s] from [%s]\n", con, s);
-                        chown(sub.data(), getuidof(s), getgidof(s));
-                        chmod(sub.data(), getmod(s));
-                        setfilecon(sub.data(), con);
-                        freecon(con);
-                    }
-                    ss[0] = '/';
-                    ss++;
-                }
-                free(s);
-            };
-            {
-                if (mkdir(upperdir.data(), 0755) == 0 && getfilecon(info.data(), &con) >= 0) {
-                    LOGD("clone attr [%s] from [%s]\n", con, info.data());
-                    chown(upperdir.data(), getuidof(info.data()), getgidof(info.data()));
-                    chmod(upperdir.data(), getmod(info.data()));
-                    setfilecon(upperdir.data(), con);
-                    freecon(con);
-                }
-                mkdirs(workerdir.data(), 0755);
-    
-                if (!is_dir(upperdir.data()) ||
-                    !is_dir(workerdir.data())) {
-                    LOGD("setup upperdir or workdir failed!\n");
-                    CLEANUP
-                    return 1;
-                }
-            }
-            {
-                std::string opts;
-                opts += "lowerdir=";
-                if (stat(masterdir.data(), &st) == 0 && S_ISDIR(st.st_mode))
-                    opts += masterdir + ":";
-                opts += info.data();
-                opts += ",upperdir=";
-                opts += upperdir;
-                opts += ",workdir=";
-                opts += workerdir;
-                
-                // 0 - read-only
-                // 1 - read-write default
-                // 2 - read-only locked
-                
-                if (OVERLAY_MODE == 2 || mount("overlay", tmp_mount.data(), "overlay", ((OVERLAY_MODE == 1)? 0 : MS_RDONLY), opts.data())) {
-                    opts = "lowerdir=";
-                    if (!merged) {
-                        opts += upperdir;
-                        opts += ":";
-                     }
-                    if (stat(masterdir.data(), &st) == 0 && S_ISDIR(st.st_mode))
-                        opts += masterdir + ":";
-                    opts += info.data();
-                    if (mount("overlay", tmp_mount.data(), "overlay", 0, opts.data())) {
-                        // for some reason, overlayfs does not support some filesystems such as vfat, tmpfs, f2fs
-                        // then bind mount it back but we will not be able to modify its content
-                        LOGW("mount overlayfs failed, fall to bind mount!\n");
-                        goto bind_mount;
-                    }
-                }
-            }
-            goto mount_done;
-               
-            bind_mount:
-            if (mount(info.data(), tmp_mount.data(), nullptr, MS_BIND, nullptr)) {
-                // mount fails
-                LOGE("mount failed, abort!\n");
-                CLEANUP
-                return 1;
-            }
-            
-            mount_done:
-            mountpoint.emplace_back(info);
-            break;
+// --replay <trace> [scratch dir]
+// run the boot recorded with OVERLAY_TRACE against the trace instead of the kernel,
+// scratch (a new temp dir by default) stands in for the writable dir of the device
+// and gets the log, profiler report, plan and skeleton. Prints a JSON summary
+static int replay(const char *trace, const char *scratch) {
+    log_open_fd(STDERR_FILENO, false);
+    std::string dir = scratch? scratch : "";
+    if (dir.empty()) {
+        char tmp[] = "/tmp/overlayfs_replay.XXXXXX";
+        if (mkdtemp(tmp) == nullptr) {
+            PLOGE("mkdtemp");
+            return 1;
         }
+        dir = tmp;
     }
+    sys_ops *sim = sys_simulator(trace, dir.data());
+    if (sim == nullptr)
+        return 1;
+    sys_use(sim);
+    replaying = true;
+    report_base = dir + "/overlayfs";
+    const char *args[] = { "overlayfs_system", dir.data() };
+    int ret = boot(2, args);
+    sim->finish();
+    return ret;
+}
 
-
-    LOGI("** Loading overlayfs\n");
-    std::vector<string> mounted;
-    for (auto &info : mountpoint) {
-        std::string tmp_mount = tmp_dir + info;
-        if (mount(tmp_mount.data(), info.data(), nullptr, MS_BIND, nullptr) ||
-#undef mount
-            mount("", info.data(), nullptr, MS_PRIVATE, nullptr) ||
-            mount("", info.data(), nullptr, MS_SHARED, nullptr)) {
-            LOGE("mount failed, abort!\n");
-            // revert all mounts
-            std::reverse(mounted.begin(), mounted.end());
-            for (auto &dir : mounted) {
-                umount2(dir.data(), MNT_DETACH);
-            }
-            CLEANUP
+int main(int argc, const char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "--decode-log") == 0)
+        return log_decode(argv[2]);
+    if (argc >= 2 && strcmp(argv[1], "--mount-images") == 0)
+        return mount_images(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--build-image") == 0) {
+        if (argc < 4) {
+            printf("Usage: --build-image <system dir> <image> [extra kb]\n");
             return 1;
         }
-        mounted.emplace_back(info);
-    }
-    // inject mount back to to magisk mirrors so Magic mount won't override it
-    if (mirrors != nullptr) {
-        for (auto &info : mountpoint) {
-            std::string tmp_mount = tmp_dir + info;
-            std::string mirror_dir = string(mirrors) + info;
-            mount(tmp_mount.data(), mirror_dir.data(), nullptr, MS_BIND, nullptr);
-            mount("", mirror_dir.data(), nullptr, MS_PRIVATE, nullptr);
-            mount("", mirror_dir.data(), nullptr, MS_SHARED, nullptr);
+        // progress goes to the installer, details to stderr
+        log_open_fd(STDERR_FILENO, false);
+        return build_image(argv[2], argv[3], (argc >= 5)? atol(argv[4]) : 0);
+    }
+    if (argc >= 3 && strcmp(argv[1], "--compact") == 0)
+        return compact(argv[2]);
+    if (argc >= 3 && strcmp(argv[1], "--dedup") == 0)
+        return dedup(argv[2]);
+    if (argc >= 3 && strcmp(argv[1], "--dedup-bench") == 0) {
+        // JSON goes to stdout, details to stderr
+        log_open_fd(STDERR_FILENO, false);
+        return dedup_bench(argv[2], xgetenv("OVERLAYLIST"));
+    }
+    if (argc >= 3 && strcmp(argv[1], "--loop-bench") == 0) {
+        log_open_fd(STDERR_FILENO, false);
+        return loop_bench(argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--mountinfo-bench") == 0)
+        return mountinfo_bench((argc >= 3)? atoi(argv[2]) : 10000, (argc >= 4)? atoi(argv[3]) : 50);
+    if (argc >= 2 && strcmp(argv[1], "--mounttable-bench") == 0) {
+        std::vector<int> sizes;
+        for (int i = 2; i < argc; i++)
+            sizes.push_back(atoi(argv[i]));
+        if (sizes.empty())
+            sizes = { 1000, 2000, 5000, 10000 };
+        return mounttable_bench(sizes);
+    }
+    if (argc >= 3 && strcmp(argv[1], "--dirbuilder-bench") == 0) {
+        log_open_fd(STDERR_FILENO, false);
+        return dirbuilder_bench(argv[2], (argc >= 4)? atoi(argv[3]) : 8, (argc >= 5)? atoi(argv[4]) : 3);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--record-hot") == 0) {
+        log_open(LOG_FILE, false);
+        return record_hot((argc >= 3)? argv[2] : HOT_LIST);
+    }
+    if (argc >= 4 && strcmp(argv[1], "--mount-dir") == 0)
+        return mount_deferred(argv[2], argv[3]);
+    if (argc >= 2 && strcmp(argv[1], "--prefetch-bench") == 0)
+        return prefetch_bench((argc >= 3)? argv[2] : HOT_LIST, PREFETCH_JOBS);
+    if (argc >= 3 && strcmp(argv[1], "--snapshot") == 0)
+        return gen_snapshot(argv[2]);
+    if (argc >= 4 && strcmp(argv[1], "--rollback") == 0) {
+        char *end;
+        long id = strtol(argv[3], &end, 10);
+        if (argv[3][0] == '\0' || *end != '\0') {
+            printf("Usage: --rollback <writable> <generation>\n");
+            return 1;
         }
+        return gen_rollback(argv[2], id);
     }
-    LOGI("mount done!\n");
-    CLEANUP
-    return 0;
+    if (argc >= 3 && strcmp(argv[1], "--generations") == 0)
+        return gen_list(argv[2]);
+    if (argc >= 3 && strcmp(argv[1], "--supervise") == 0) {
+        log_open(LOG_FILE, false);
+        return supervise(UNBLOCK_FILE, std::vector<std::string>(argv + 2, argv + argc));
+    }
+    if (argc >= 3 && strcmp(argv[1], "--replay") == 0)
+        return replay(argv[2], (argc >= 4)? argv[3] : nullptr);
+    int ret = boot(argc, argv);
+    sys().finish();
+    return ret;
 }
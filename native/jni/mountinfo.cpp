@@ -1,19 +1,147 @@
 #include "base.hpp"
 #include "mountinfo.hpp"
+#include "sysops.hpp"
+#include "profiler.hpp"
 #define ssprintf snprintf
-#define parse_int(s) atoi(s.data())
 
 // based on mountinfo code from https://github.com/yujincheng08
 
 using namespace std;
 
-std::vector<mount_info> parse_mount_info(const char *pid) {
-    char buf[4098] = {};
+// decode octal escapes (\040, \011, \012, \134) in place
+static string_view unescape(char *s, size_t len) {
+    char *w = s;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\\' && i + 3 < len &&
+            s[i + 1] >= '0' && s[i + 1] <= '3' &&
+            s[i + 2] >= '0' && s[i + 2] <= '7' &&
+            s[i + 3] >= '0' && s[i + 3] <= '7') {
+            *w++ = (char) (((s[i + 1] - '0') << 6) | ((s[i + 2] - '0') << 3) | (s[i + 3] - '0'));
+            i += 3;
+        } else {
+            *w++ = s[i];
+        }
+    }
+    return string_view(s, w - s);
+}
+
+static unsigned int parse_uint(const char *&p, const char *end) {
+    unsigned int v = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        v = v * 10 + (*p++ - '0');
+    return v;
+}
+
+// next space separated field of the line, moves p past it
+// the separator is overwritten so every field is also a C string
+static string_view next_field(char *&p, char *eol, bool decode) {
+    while (p < eol && *p == ' ') p++;
+    char *start = p;
+    while (p < eol && *p != ' ') p++;
+    auto field = decode? unescape(start, p - start) : string_view(start, p - start);
+    start[field.size()] = '\0';
+    if (p < eol) p++;
+    return field;
+}
+
+static unsigned int tag_value(string_view field, string_view tag) {
+    if (field.compare(0, tag.size(), tag) != 0)
+        return 0;
+    const char *p = field.data() + tag.size();
+    return parse_uint(p, field.data() + field.size());
+}
+
+bool parse_mount_info_buf(mount_info_table &table) {
+    table.entries.clear();
+    // every line must end with '\n', it is where the last field gets terminated
+    if (!table.arena.empty() && table.arena.back() != '\n')
+        table.arena.push_back('\n');
+    char *p = table.arena.data();
+    char *end = p + table.arena.size();
+    while (p < end) {
+        char *eol = static_cast<char *>(memchr(p, '\n', end - p));
+
+        mount_info_view m{};
+        const char *q = p;
+        m.id = parse_uint(q, eol);
+        while (q < eol && *q == ' ') q++;
+        m.parent = parse_uint(q, eol);
+        while (q < eol && *q == ' ') q++;
+        unsigned int maj = parse_uint(q, eol);
+        if (q < eol && *q == ':') q++;
+        unsigned int min = parse_uint(q, eol);
+        m.device = static_cast<dev_t>(makedev(maj, min));
+
+        char *f = p + (q - p);
+        m.root = next_field(f, eol, true);
+        m.target = next_field(f, eol, true);
+        m.vfs_option = next_field(f, eol, true);
+        // (7) optional fields, terminated by a single "-"
+        for (;;) {
+            auto opt = next_field(f, eol, false);
+            if (opt.empty() || opt == "-")
+                break;
+            if (auto v = tag_value(opt, "shared:")) m.optional.shared = v;
+            else if (auto v = tag_value(opt, "master:")) m.optional.master = v;
+            else if (auto v = tag_value(opt, "propagate_from:")) m.optional.propagate_from = v;
+        }
+        m.type = next_field(f, eol, true);
+        m.source = next_field(f, eol, true);
+        m.fs_option = next_field(f, eol, true);
+
+        if (!m.target.empty())
+            table.entries.emplace_back(m);
+        p = eol + 1;
+    }
+    return true;
+}
+
+bool parse_mount_info_view(const char *pid, mount_info_table &table) {
+    char buf[64];
     ssprintf(buf, sizeof(buf), "/proc/%s/mountinfo", pid);
+    table.entries.clear();
+    if (!sys().read_file(buf, table.arena))
+        return false;
+    // average mountinfo line is way longer than 64 bytes
+    table.entries.reserve(table.arena.size() / 64);
+    return parse_mount_info_buf(table);
+}
+
+mount_info to_mount_info(const mount_info_view &v) {
+    mount_info mnt_entry;
+    mnt_entry.id = v.id;
+    mnt_entry.parent = v.parent;
+    mnt_entry.device = v.device;
+    mnt_entry.root = v.root;
+    mnt_entry.target = v.target;
+    mnt_entry.vfs_option = v.vfs_option;
+    mnt_entry.optional = {
+        .shared = v.optional.shared,
+        .master = v.optional.master,
+        .propagate_from = v.optional.propagate_from,
+        };
+    mnt_entry.type = v.type;
+    mnt_entry.source = v.source;
+    mnt_entry.fs_option = v.fs_option;
+    return mnt_entry;
+}
+
+std::vector<mount_info> parse_mount_info(const char *pid) {
     std::vector<mount_info> result;
-    FILE *fp = fopen(buf, "re");
-    if (fp == nullptr) return result;
+    mount_info_table table;
+    if (!parse_mount_info_view(pid, table))
+        return result;
+    result.reserve(table.entries.size());
+    for (auto &v : table.entries)
+        result.emplace_back(to_mount_info(v));
+    return result;
+}
 
+// the fgets/sscanf parser parse_mount_info() used before the view table, kept as
+// the baseline of mountinfo_bench()
+static vector<mount_info> parse_mount_info_fgets(FILE *fp) {
+    char buf[4098] = {};
+    vector<mount_info> result;
     while (fgets(buf, sizeof(buf), fp)) {
         string_view line = buf;
         int root_start = 0, root_end = 0;
@@ -39,53 +167,101 @@ std::vector<mount_info> parse_mount_info(const char *pid) {
                &target_end, &vfs_option_start, &vfs_option_end,
                &optional_start, &optional_end, &type_start, &type_end,
                &source_start, &source_end, &fs_option_start, &fs_option_end);
-
-        auto root = line.substr(root_start, root_end - root_start);
-        auto target = line.substr(target_start, target_end - target_start);
-        auto vfs_option =
-                line.substr(vfs_option_start, vfs_option_end - vfs_option_start);
         ++optional_start;
         --optional_end;
         auto optional = line.substr(
                 optional_start,
                 optional_end - optional_start > 0 ? optional_end - optional_start : 0);
-
-        auto type = line.substr(type_start, type_end - type_start);
-        auto source = line.substr(source_start, source_end - source_start);
-        auto fs_option =
-                line.substr(fs_option_start, fs_option_end - fs_option_start);
-
-        unsigned int shared = 0;
-        unsigned int master = 0;
-        unsigned int propagate_from = 0;
-        if (auto pos = optional.find("shared:"); pos != std::string_view::npos) {
-            shared = parse_int(optional.substr(pos + 7));
-        }
-        if (auto pos = optional.find("master:"); pos != std::string_view::npos) {
-            master = parse_int(optional.substr(pos + 7));
-        }
-        if (auto pos = optional.find("propagate_from:");
-                pos != std::string_view::npos) {
-            propagate_from = parse_int(optional.substr(pos + 15));
-        }
         mount_info mnt_entry;
         mnt_entry.id = id;
         mnt_entry.parent = parent;
         mnt_entry.device = static_cast<dev_t>(makedev(maj, min));
-        mnt_entry.root = root;
-        mnt_entry.vfs_option = vfs_option;
-        mnt_entry.optional = {
-            .shared = shared,
-            .master = master,
-            .propagate_from = propagate_from,
-            };
-        mnt_entry.root = root;
-        mnt_entry.target = target;
-        mnt_entry.type = type;
-        mnt_entry.source = source;
-        mnt_entry.fs_option = fs_option;
-
+        mnt_entry.optional = {};
+        if (auto pos = optional.find("shared:"); pos != std::string_view::npos)
+            mnt_entry.optional.shared = atoi(optional.data() + pos + 7);
+        if (auto pos = optional.find("master:"); pos != std::string_view::npos)
+            mnt_entry.optional.master = atoi(optional.data() + pos + 7);
+        if (auto pos = optional.find("propagate_from:"); pos != std::string_view::npos)
+            mnt_entry.optional.propagate_from = atoi(optional.data() + pos + 15);
+        mnt_entry.root = line.substr(root_start, root_end - root_start);
+        mnt_entry.target = line.substr(target_start, target_end - target_start);
+        mnt_entry.vfs_option = line.substr(vfs_option_start, vfs_option_end - vfs_option_start);
+        mnt_entry.type = line.substr(type_start, type_end - type_start);
+        mnt_entry.source = line.substr(source_start, source_end - source_start);
+        mnt_entry.fs_option = line.substr(fs_option_start, fs_option_end - fs_option_start);
         result.emplace_back(mnt_entry);
     }
     return result;
 }
+
+// lines like those of an Android device with many module and app mounts
+static string synthetic_mountinfo(int lines) {
+    string out;
+    char line[512];
+    for (int i = 0; i < lines; i++) {
+        const char *opt = (i % 3 == 0)? "shared:" : (i % 3 == 1)? "master:" : "propagate_from:";
+        snprintf(line, sizeof(line),
+                 "%d %d 253:%d / /system/app/Module%d/lib/arm64 ro,relatime %s%d - ext4 "
+                 "/dev/block/dm-%d ro,seclabel,noatime,errors=panic,data=ordered\n",
+                 i + 20, i + 19, i % 64, i, opt, i % 97 + 1, i % 64);
+        out += line;
+    }
+    return out;
+}
+
+int mountinfo_bench(int lines, int iterations) {
+    if (lines <= 0 || iterations <= 0)
+        return 1;
+    string text = synthetic_mountinfo(lines);
+    uint64_t fgets_ns = 0, view_ns = 0, copy_ns = 0;
+    uint64_t fgets_min = UINT64_MAX, view_min = UINT64_MAX, copy_min = UINT64_MAX;
+    bool match = true;
+    for (int it = 0; it < iterations; it++) {
+        FILE *fp = fmemopen(text.data(), text.size(), "r");
+        if (fp == nullptr)
+            return 1;
+        uint64_t start = prof_now();
+        auto old = parse_mount_info_fgets(fp);
+        uint64_t t = prof_now() - start;
+        fclose(fp);
+        fgets_ns += t;
+        fgets_min = min(fgets_min, t);
+
+        // the arena is filled by one read of /proc at boot, copying it in is the same cost
+        mount_info_table table;
+        start = prof_now();
+        table.arena.assign(text.begin(), text.end());
+        table.entries.reserve(table.arena.size() / 64);
+        parse_mount_info_buf(table);
+        t = prof_now() - start;
+        view_ns += t;
+        view_min = min(view_min, t);
+
+        // parse_mount_info(), the view table copied into mount_info strings
+        start = prof_now();
+        vector<mount_info> copied;
+        copied.reserve(table.entries.size());
+        for (auto &v : table.entries)
+            copied.emplace_back(to_mount_info(v));
+        t = prof_now() - start;
+        copy_ns += t;
+        copy_min = min(copy_min, t);
+
+        match = match && old.size() == copied.size();
+        for (size_t i = 0; match && i < old.size(); i++)
+            match = old[i].target == copied[i].target && old[i].fs_option == copied[i].fs_option &&
+                    old[i].optional.shared == copied[i].optional.shared &&
+                    old[i].optional.master == copied[i].optional.master &&
+                    old[i].optional.propagate_from == copied[i].optional.propagate_from;
+    }
+    printf("{\"lines\": %d, \"iterations\": %d, \"match\": %s,\n"
+           " \"fgets_sscanf_us\": {\"mean\": %llu, \"min\": %llu},\n"
+           " \"view_us\": {\"mean\": %llu, \"min\": %llu},\n"
+           " \"view_to_mount_info_us\": {\"mean\": %llu, \"min\": %llu}}\n",
+           lines, iterations, match? "true" : "false",
+           (unsigned long long) (fgets_ns / iterations / 1000), (unsigned long long) (fgets_min / 1000),
+           (unsigned long long) (view_ns / iterations / 1000), (unsigned long long) (view_min / 1000),
+           (unsigned long long) ((view_ns + copy_ns) / iterations / 1000),
+           (unsigned long long) ((view_min + copy_min) / 1000));
+    return match? 0 : 1;
+}
@@ -18,4 +18,34 @@ struct mount_info {
     std::string fs_option;
 };
 
+// zero-copy record, all fields point into mount_info_table::arena
+// and are NUL terminated, octal escapes (\040...) are already decoded
+struct mount_info_view {
+    unsigned int id;
+    unsigned int parent;
+    dev_t device;
+    std::string_view root;
+    std::string_view target;
+    std::string_view vfs_option;
+    struct {
+        unsigned int shared;
+        unsigned int master;
+        unsigned int propagate_from;
+    } optional;
+    std::string_view type;
+    std::string_view source;
+    std::string_view fs_option;
+};
+
+struct mount_info_table {
+    std::vector<char> arena;
+    std::vector<mount_info_view> entries;
+};
+
+bool parse_mount_info_view(const char *pid, mount_info_table &table);
+bool parse_mount_info_buf(mount_info_table &table);
+mount_info to_mount_info(const mount_info_view &v);
 std::vector<mount_info> parse_mount_info(const char *pid);
+// parse a synthetic mountinfo with the old fgets/sscanf parser and with the view
+// table, iterations times each, and print the time per parse as JSON
+int mountinfo_bench(int lines, int iterations);
@@ -0,0 +1,178 @@
+#include "mounttable.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+
+using namespace std;
+
+// split next component of path, skipping duplicated slashes
+static bool next_component(string_view &path, string_view &name) {
+    while (!path.empty() && path[0] == '/')
+        path.remove_prefix(1);
+    if (path.empty())
+        return false;
+    size_t end = path.find('/');
+    if (end == string_view::npos)
+        end = path.size();
+    name = path.substr(0, end);
+    path.remove_prefix(end);
+    return true;
+}
+
+mount_table::mount_table() {
+    clear();
+}
+
+void mount_table::clear() {
+    nodes.clear();
+    nodes.emplace_back();
+    nodes[0].value = -1;
+    nodes[0].used = false;
+    count = 0;
+}
+
+bool mount_table::insert(string_view path, int value) {
+    int cur = 0;
+    string_view name;
+    while (next_component(path, name)) {
+        auto it = nodes[cur].children.find(name);
+        if (it == nodes[cur].children.end()) {
+            int child = nodes.size();
+            nodes[cur].children.emplace(string(name), child);
+            nodes.emplace_back();
+            nodes[child].value = -1;
+            nodes[child].used = false;
+            cur = child;
+        } else {
+            cur = it->second;
+        }
+    }
+    if (nodes[cur].used)
+        return false;
+    nodes[cur].used = true;
+    nodes[cur].value = value;
+    count++;
+    return true;
+}
+
+int mount_table::lookup(string_view path) const {
+    int cur = 0;
+    string_view name;
+    while (next_component(path, name)) {
+        auto it = nodes[cur].children.find(name);
+        if (it == nodes[cur].children.end())
+            return -1;
+        cur = it->second;
+    }
+    return cur;
+}
+
+bool mount_table::contains(string_view path) const {
+    int n = lookup(path);
+    return n >= 0 && nodes[n].used;
+}
+
+int mount_table::covering(string_view path) const {
+    int cur = 0;
+    int found = nodes[0].used? nodes[0].value : -1;
+    string_view name;
+    while (next_component(path, name)) {
+        auto it = nodes[cur].children.find(name);
+        if (it == nodes[cur].children.end())
+            break;
+        cur = it->second;
+        if (nodes[cur].used)
+            found = nodes[cur].value;
+    }
+    return found;
+}
+
+bool mount_table::is_under(string_view path) const {
+    int cur = 0;
+    string_view name;
+    while (next_component(path, name)) {
+        if (nodes[cur].used)
+            return true;
+        auto it = nodes[cur].children.find(name);
+        if (it == nodes[cur].children.end())
+            return false;
+        cur = it->second;
+    }
+    return false;
+}
+
+bool mount_table::overlaps(string_view path) const {
+    if (is_under(path))
+        return true;
+    // nodes are only created by insert, so every node leads to an entry
+    int n = lookup(path);
+    return n >= 0 && (nodes[n].used || !nodes[n].children.empty());
+}
+
+// targets of a device with many nested mounts, ten in each overlaid directory
+static void synthetic_mounts(int mounts, vector<string> &targets, vector<string> &overlaid) {
+    static const char *parts[] = { "/system", "/vendor", "/product" };
+    for (int i = 0; i < mounts; i++) {
+        string dir = string(parts[i % 3]) + "/d" + to_string(i / 30);
+        if (i % 30 < 3)
+            overlaid.push_back(dir);
+        targets.push_back(dir + "/m" + to_string(i));
+    }
+}
+
+static uint64_t bench_us(uint64_t start) {
+    return (prof_now() - start) / 1000;
+}
+
+int mounttable_bench(const vector<int> &sizes) {
+    string json;
+    for (int mounts : sizes) {
+        vector<string> targets, overlaid;
+        synthetic_mounts(mounts, targets, overlaid);
+        // duplicate check while trimming mountinfo, vector scan and trie
+        uint64_t start = prof_now();
+        vector<string> mountpoint;
+        for (auto &t : targets) {
+            if (find(mountpoint.begin(), mountpoint.end(), t) == mountpoint.end())
+                mountpoint.push_back(t);
+        }
+        uint64_t scan_insert_us = bench_us(start);
+        start = prof_now();
+        mount_table index;
+        size_t unique = 0;
+        for (auto &t : targets)
+            unique += index.insert(t);
+        uint64_t trie_insert_us = bench_us(start);
+
+        // stock mounts under an overlaid directory, prefix scan of mount_list and trie
+        start = prof_now();
+        size_t scan_under = 0;
+        for (auto &t : targets) {
+            for (auto &s : overlaid) {
+                if (starts_with(t.data(), string(s + "/").data())) {
+                    scan_under++;
+                    break;
+                }
+            }
+        }
+        uint64_t scan_under_us = bench_us(start);
+        start = prof_now();
+        mount_table list_index;
+        for (auto &s : overlaid)
+            list_index.insert(s);
+        size_t trie_under = 0;
+        for (auto &t : targets)
+            trie_under += list_index.is_under(t);
+        uint64_t trie_under_us = bench_us(start);
+
+        char buf[320];
+        snprintf(buf, sizeof(buf), "  {\"mounts\": %d, \"overlaid\": %zu, \"match\": %s, "
+                 "\"insert_us\": {\"scan\": %llu, \"trie\": %llu}, \"under_us\": {\"scan\": %llu, \"trie\": %llu}}",
+                 mounts, overlaid.size(),
+                 (unique == mountpoint.size() && scan_under == trie_under)? "true" : "false",
+                 (unsigned long long) scan_insert_us, (unsigned long long) trie_insert_us,
+                 (unsigned long long) scan_under_us, (unsigned long long) trie_under_us);
+        json += (json.empty()? "" : ",\n") + string(buf);
+    }
+    printf("[\n%s\n]\n", json.data());
+    return 0;
+}
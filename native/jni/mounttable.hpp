@@ -0,0 +1,33 @@
+#pragma once
+#include "base.hpp"
+#include <map>
+
+// path trie keyed by path components, all lookups are O(path length)
+struct mount_table {
+    mount_table();
+    // returns false if path is already in the table
+    bool insert(std::string_view path, int value = 0);
+    bool contains(std::string_view path) const;
+    // value of the deepest entry which is path or one of its parents, -1 if none
+    int covering(std::string_view path) const;
+    // true if path is strictly under one of entries
+    bool is_under(std::string_view path) const;
+    // true if path is an entry, is under one or has entries under it
+    bool overlaps(std::string_view path) const;
+    size_t size() const { return count; }
+    void clear();
+
+private:
+    struct node {
+        std::map<std::string, int, std::less<>> children;
+        int value;
+        bool used;
+    };
+    std::vector<node> nodes;
+    size_t count;
+    int lookup(std::string_view path) const;
+};
+
+// time the duplicate and is-under checks of main() over synthetic mount counts, with
+// the vector scans they replaced and with mount_table, and print them as JSON
+int mounttable_bench(const std::vector<int> &sizes);
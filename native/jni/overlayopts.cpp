@@ -0,0 +1,104 @@
+#include "overlayopts.hpp"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#define OVL_PARAMETERS "/sys/module/overlay/parameters/"
+
+unsigned overlay_profile(int profile) {
+    unsigned metacopy = OVL_FEAT_METACOPY | OVL_FEAT_REDIRECT_DIR | OVL_FEAT_XINO;
+    switch (profile) {
+        case 1: return metacopy;
+        case 2: return metacopy | OVL_FEAT_INDEX;
+        case 3: return metacopy | OVL_FEAT_VOLATILE;
+    }
+    return 0;
+}
+
+unsigned overlay_probe_features() {
+    static const struct { const char *param; unsigned feature; } params[] = {
+        { "redirect_dir", OVL_FEAT_REDIRECT_DIR },
+        { "index", OVL_FEAT_INDEX },
+        { "xino_auto", OVL_FEAT_XINO },
+        { "metacopy", OVL_FEAT_METACOPY },
+    };
+    unsigned features = 0;
+    for (auto &p : params) {
+        if (access((std::string(OVL_PARAMETERS) + p.param).data(), F_OK) == 0)
+            features |= p.feature;
+    }
+    // volatile has no module parameter, it came with 5.10
+    struct utsname un;
+    int major = 0, minor = 0;
+    if (uname(&un) == 0 && sscanf(un.release, "%d.%d", &major, &minor) == 2 &&
+        (major > 5 || (major == 5 && minor >= 10)))
+        features |= OVL_FEAT_VOLATILE;
+    return features;
+}
+
+std::string overlay_feature_names(unsigned features) {
+    static const char *names[] = { "redirect_dir", "index", "xino", "metacopy", "volatile" };
+    std::string out;
+    for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (features & (1u << i)) {
+            if (!out.empty())
+                out += ",";
+            out += names[i];
+        }
+    }
+    return out.empty()? "none" : out;
+}
+
+// upper is false for mounts which only read layers, there redirects are followed
+// and metacopy files of the upper layer are completed from the layers below
+static std::string feature_opts(unsigned features, bool upper) {
+    std::string opts;
+    if (features & OVL_FEAT_REDIRECT_DIR)
+        opts += upper? ",redirect_dir=on" : ",redirect_dir=follow";
+    if ((features & OVL_FEAT_INDEX) && upper)
+        opts += ",index=on";
+    if (features & OVL_FEAT_XINO)
+        opts += ",xino=auto";
+    if (features & OVL_FEAT_METACOPY)
+        opts += ",metacopy=on";
+    if ((features & OVL_FEAT_VOLATILE) && upper)
+        opts += ",volatile";
+    return opts;
+}
+
+std::string overlay_lowerdir(const std::vector<std::string> &lowers, const std::string &target) {
+    std::string lowerdir;
+    for (auto &dir : lowers)
+        lowerdir += dir + ":";
+    lowerdir += target;
+    return lowerdir;
+}
+
+std::string overlay_rw_opts(const std::string &lowerdir, const std::string &upperdir, const std::string &workdir,
+                            unsigned features) {
+    std::string opts;
+    opts += "lowerdir=";
+    opts += lowerdir;
+    opts += ",upperdir=";
+    opts += upperdir;
+    opts += ",workdir=";
+    opts += workdir;
+    opts += feature_opts(features, true);
+    return opts;
+}
+
+std::string overlay_ro_opts(const std::string &lowerdir, const std::string &upperdir, bool with_upper,
+                            unsigned features) {
+    std::string opts = "lowerdir=";
+    if (with_upper) {
+        opts += upperdir;
+        opts += ":";
+    }
+    opts += lowerdir;
+    opts += feature_opts(features, false);
+    return opts;
+}
+
+std::string overlay_master_opts(const std::string &upperdir, const std::string &overlaylist, unsigned features) {
+    return "lowerdir=" + upperdir + ":" + overlaylist + feature_opts(features, false);
+}
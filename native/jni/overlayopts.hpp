@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// Option strings of the overlayfs mounts
+// Kept free of Android and selinux headers, so overlayfs_bench can be built
+// for the host from the same code
+
+// optional overlayfs features, added on top of lowerdir/upperdir/workdir
+enum {
+    OVL_FEAT_REDIRECT_DIR = 1 << 0,  // rename directories without copying them up
+    OVL_FEAT_INDEX        = 1 << 1,  // hardlinks survive copy-up
+    OVL_FEAT_XINO         = 1 << 2,  // inode numbers unique across layers
+    OVL_FEAT_METACOPY     = 1 << 3,  // chmod/chown copy up metadata only
+    OVL_FEAT_VOLATILE     = 1 << 4,  // no syncs to upper, only for scratch upper layers
+};
+
+// 0 - none
+// 1 - metacopy, redirect_dir, xino
+// 2 - 1 and index
+// 3 - 1 and volatile
+unsigned overlay_profile(int profile);
+// features the running kernel knows, from /sys/module/overlay/parameters
+unsigned overlay_probe_features();
+// "metacopy,xino" for logs
+std::string overlay_feature_names(unsigned features);
+
+// lowers first, top layer first, then the real directory of target
+std::string overlay_lowerdir(const std::vector<std::string> &lowers, const std::string &target);
+// read-write overlay of target
+std::string overlay_rw_opts(const std::string &lowerdir, const std::string &upperdir, const std::string &workdir,
+                            unsigned features = 0);
+// read-only overlay of target, upperdir is stacked as a lower layer
+// unless with_upper is false because the merged master already contains it
+std::string overlay_ro_opts(const std::string &lowerdir, const std::string &upperdir, bool with_upper,
+                            unsigned features = 0);
+// master overlay, upper on top of the module layers
+std::string overlay_master_opts(const std::string &upperdir, const std::string &overlaylist,
+                                unsigned features = 0);
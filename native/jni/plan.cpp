@@ -0,0 +1,317 @@
+#include "plan.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+#include "mounttable.hpp"
+#include "dirscan.hpp"
+#include "sysops.hpp"
+#include <inttypes.h>
+
+using namespace std;
+
+#define PLAN_MAGIC "OVLPLAN"
+#define PLAN_VERSION 1
+
+static const char *partitions[] = { "/system", "/vendor", "/system_ext", "/product" };
+
+static bool under(string_view path, string_view dir) {
+    return path.compare(0, dir.size(), dir) == 0 &&
+        (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+static bool on_partition(string_view path) {
+    for (auto part : partitions) {
+        if (under(path, part))
+            return true;
+    }
+    return false;
+}
+
+uint64_t plan_key(const plan_input &in, const mount_info_table &mounts) {
+    char buf[64];
+    uint64_t h = hash_str(0, PLAN_MAGIC);
+    h = hash_str(h, get_build_fingerprint());
+    h = hash_str(h, in.writable);
+    h = hash_str(h, in.overlaylist);
+    h = hash_str(h, in.mirrors);
+    snprintf(buf, sizeof(buf), "%d", in.overlay_mode);
+    h = hash_str(h, buf);
+    for (auto &m : mounts.entries) {
+        if (!on_partition(m.target))
+            continue;
+        snprintf(buf, sizeof(buf), "%u:%u", major(m.device), minor(m.device));
+        h = hash_str(h, buf);
+        h = hash_str(h, m.root);
+        h = hash_str(h, m.target);
+        h = hash_str(h, m.type);
+        h = hash_str(h, m.source);
+    }
+    return h;
+}
+
+// subdirectories of partition, each of them gets its own overlayfs
+static void scan_partition(const char *part, vector<string> &mount_list) {
+    string phase = string("makedir:") + part;
+    PROF_PHASE(phase.data());
+    dir_list list;
+    if (sys().list_dir(part, list) != 0)
+        return;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list.type(i) == DT_DIR)
+            mount_list.push_back(string(part) + "/" + list.name(i));
+    }
+}
+
+void build_plan(const plan_input &in, const mount_info_table &mounts, mount_plan &plan) {
+    PROF_PHASE("plan");
+    plan.key = plan_key(in, mounts);
+    plan.ops.clear();
+
+    // stock mounts, most recent first
+    vector<string> mountinfo;
+    // index of mountinfo targets, built once while trimming
+    mount_table mount_index;
+    {
+        PROF_PHASE("trim_mountinfo");
+        auto &entries = mounts.entries;
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            auto &info = *it;
+            if (!on_partition(info.target))
+                continue;
+            struct stat st;
+            // skip mount under another mount
+            prof_syscall();
+            if (sys().stat(info.target.data(), &st) || info.device != st.st_dev)
+                continue;
+            if (!mount_index.insert(info.target, mountinfo.size()))
+                continue;
+            mountinfo.emplace_back(info.target);
+        }
+    }
+    if (mount_index.insert("/system", mountinfo.size()))
+        mountinfo.emplace_back("/system");
+
+    // list of directories should be mounted!
+    vector<string> mount_list;
+    if (!in.subtree.empty()) {
+        mount_list.push_back(in.subtree);
+    } else {
+        for (auto part : partitions) {
+            if (mount_index.contains(part))
+                scan_partition(part, mount_list);
+        }
+    }
+    mount_table mount_list_index;
+    for (auto &s : mount_list)
+        mount_list_index.insert(s);
+
+    plan.topology = 0;
+    for (auto &s : mount_list)
+        plan.topology = hash_str(plan.topology, s);
+    for (auto &s : mountinfo)
+        plan.topology = hash_str(plan.topology, s);
+
+    if (in.subtree.empty())
+        plan.ops.push_back({ PLAN_MASTER, PLAN_FALLBACK_NONE, in.writable + "/master" });
+
+    // mount overlayfs for subdirectories of /system /vendor /product /system_ext
+    vector<string> staged;
+    struct stat st;
+    for (auto &s : mount_list) {
+        plan.ops.push_back({ PLAN_OVERLAY, PLAN_FALLBACK_SKIP, s });
+        staged.push_back(s);
+    }
+
+    // restore stock mounts if possible
+    // if stock mount is directory, merge it with overlayfs
+    // if stock mount is file, then we bind mount it back
+    std::reverse(mountinfo.begin(), mountinfo.end());
+    for (auto &s : mountinfo) {
+        // only care about mountpoint under overlayfs mounted subdirectories
+        if (!mount_list_index.is_under(s))
+            continue;
+        prof_syscall();
+        if (sys().stat(s.data(), &st) == 0 && !S_ISDIR(st.st_mode))
+            plan.ops.push_back({ PLAN_BIND, PLAN_FALLBACK_NONE, s });
+        else
+            plan.ops.push_back({ PLAN_OVERLAY, PLAN_FALLBACK_BIND, s });
+        staged.push_back(s);
+    }
+
+    for (auto &s : staged)
+        plan.ops.push_back({ PLAN_ATTACH, PLAN_FALLBACK_NONE, s });
+    plan.ops.push_back({ PLAN_PROPAGATE, PLAN_FALLBACK_NONE, "" });
+
+    // inject mount back to to magisk mirrors so Magic mount won't override it
+    if (!in.mirrors.empty()) {
+        for (auto &s : staged)
+            plan.ops.push_back({ PLAN_MIRROR, PLAN_FALLBACK_NONE, s });
+        plan.ops.push_back({ PLAN_PROPAGATE, PLAN_FALLBACK_NONE, "" });
+    }
+    LOGD("plan: %zu operations\n", plan.ops.size());
+}
+
+// text format, one operation per line: "<type> <fallback> <target>"
+bool load_plan(const char *path, uint64_t key, mount_plan &plan) {
+    FILE *fp = fopen(path, "re");
+    if (fp == nullptr)
+        return false;
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    bool ok = false;
+    char magic[16];
+    unsigned version;
+    uint64_t file_key, topology;
+    plan.ops.clear();
+    if ((len = getline(&line, &cap, fp)) < 0 ||
+        sscanf(line, "%15s %u %" SCNx64 " %" SCNx64, magic, &version, &file_key, &topology) != 4 ||
+        strcmp(magic, PLAN_MAGIC) != 0 || version != PLAN_VERSION) {
+        LOGD("plan: invalid cache\n");
+        goto done;
+    }
+    if (file_key != key) {
+        LOGD("plan: inputs changed\n");
+        goto done;
+    }
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        int type, fallback, off = 0;
+        if (sscanf(line, "%d %d %n", &type, &fallback, &off) != 2 || off == 0 ||
+            type < PLAN_MASTER || type > PLAN_MIRROR ||
+            fallback < PLAN_FALLBACK_NONE || fallback > PLAN_FALLBACK_BIND)
+            goto done;
+        plan.ops.push_back({ (plan_op_type) type, (plan_fallback) fallback, line + off });
+    }
+    plan.key = file_key;
+    plan.topology = topology;
+    ok = !plan.ops.empty();
+
+    done:
+    free(line);
+    fclose(fp);
+    if (!ok)
+        plan.ops.clear();
+    return ok;
+}
+
+bool save_plan(const char *path, const mount_plan &plan) {
+    string data;
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s %u %" PRIx64 " %" PRIx64 "\n",
+             PLAN_MAGIC, PLAN_VERSION, plan.key, plan.topology);
+    data += buf;
+    for (auto &op : plan.ops) {
+        snprintf(buf, sizeof(buf), "%d %d ", op.type, op.fallback);
+        data += buf;
+        data += op.target;
+        data += '\n';
+    }
+    string tmp = string(path) + ".tmp";
+    int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t) data.size() && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.data(), path) != 0) {
+        unlink(tmp.data());
+        return false;
+    }
+    LOGD("plan: saved %zu operations\n", plan.ops.size());
+    return true;
+}
+
+static string json_str(string_view s) {
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char) c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+static const char *op_name(plan_op_type type) {
+    switch (type) {
+        case PLAN_MASTER: return "master";
+        case PLAN_OVERLAY: return "overlay";
+        case PLAN_BIND: return "bind";
+        case PLAN_ATTACH: return "attach";
+        case PLAN_PROPAGATE: return "propagate";
+        case PLAN_MIRROR: return "mirror";
+    }
+    return "unknown";
+}
+
+static const char *fallback_name(plan_fallback fallback) {
+    switch (fallback) {
+        case PLAN_FALLBACK_SKIP: return "skip";
+        case PLAN_FALLBACK_BIND: return "bind";
+        default: return "none";
+    }
+}
+
+string plan_to_json(const plan_input &in, const mount_plan &plan, const vector<string> &generations,
+                    const layer_index *layers) {
+    char buf[128];
+    string upper = in.writable + "/upper";
+    string json = "{\n";
+    snprintf(buf, sizeof(buf), "  \"key\": \"%016" PRIx64 "\",\n  \"topology\": \"%016" PRIx64 "\",\n"
+             "  \"overlay_mode\": %d,\n", plan.key, plan.topology, in.overlay_mode);
+    json += buf;
+    json += "  \"ops\": [\n";
+    for (size_t i = 0; i < plan.ops.size(); i++) {
+        auto &op = plan.ops[i];
+        json += "    {\"op\": \"";
+        json += op_name(op.type);
+        json += "\"";
+        if (!op.target.empty())
+            json += ", \"target\": " + json_str(op.target);
+        switch (op.type) {
+            case PLAN_MASTER:
+                if (!in.overlaylist.empty())
+                    json += ", \"lowerdir\": " + json_str(upper + ":" + in.overlaylist);
+                else
+                    json += ", \"bind\": " + json_str(upper);
+                break;
+            case PLAN_OVERLAY: {
+                // the planned master is assumed to mount
+                vector<string> lowers;
+                bool with_upper = overlay_lowers(in.writable, op.target, generations, layers, true, lowers);
+                lowers.push_back(op.target);
+                // read-only locked mode stacks upper as the top lower layer instead
+                bool rdonly = in.overlay_mode == 2;
+                if (rdonly && with_upper)
+                    lowers.insert(lowers.begin(), upper + op.target);
+                json += ", \"fallback\": \"";
+                json += fallback_name(op.fallback);
+                json += "\", \"lowerdir\": [";
+                for (size_t j = 0; j < lowers.size(); j++)
+                    json += (j? ", " : "") + json_str(lowers[j]);
+                json += "]";
+                if (rdonly)
+                    break;
+                json += ", \"upperdir\": " + json_str(upper + op.target);
+                json += ", \"workdir\": " + json_str(in.writable + "/worker" + op.target);
+                break;
+            }
+            case PLAN_MIRROR:
+                json += ", \"mirror\": " + json_str(in.mirrors + op.target);
+                break;
+            default:
+                break;
+        }
+        json += (i + 1 < plan.ops.size())? "},\n" : "}\n";
+    }
+    json += "  ]\n}\n";
+    return json;
+}
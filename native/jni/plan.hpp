@@ -0,0 +1,56 @@
+#pragma once
+#include "base.hpp"
+#include "mountinfo.hpp"
+#include "layers.hpp"
+
+// Mount plan
+// The planner turns mountinfo, OVERLAYLIST and OVERLAY_MODE into an ordered list of
+// operations without touching the system, the executor in main.cpp applies it.
+// Plans are cached in <writable>/.plan and reused while their inputs stay the same
+
+enum plan_op_type {
+    PLAN_MASTER,     // mount modules and upperdir at masterdir
+    PLAN_OVERLAY,    // stage overlayfs for target
+    PLAN_BIND,       // stage bind mount of the stock mount at target
+    PLAN_ATTACH,     // attach staged mount to target
+    PLAN_PROPAGATE,  // make attached mounts shared
+    PLAN_MIRROR,     // attach copy of staged mount to magisk mirror
+};
+
+// what to do if overlayfs cannot be mounted
+enum plan_fallback {
+    PLAN_FALLBACK_NONE,
+    PLAN_FALLBACK_SKIP,  // leave target alone
+    PLAN_FALLBACK_BIND,  // bind mount the stock mount back
+};
+
+struct plan_op {
+    plan_op_type type;
+    plan_fallback fallback;
+    std::string target;
+};
+
+struct plan_input {
+    std::string writable;
+    std::string overlaylist;
+    std::string mirrors;
+    int overlay_mode;
+    // only plan the overlay of this directory and the stock mounts under it, no master
+    std::string subtree;
+};
+
+struct mount_plan {
+    uint64_t key;
+    // layout of mounted directories, see skeleton
+    uint64_t topology;
+    std::vector<plan_op> ops;
+};
+
+// hash of everything the plan is built from
+uint64_t plan_key(const plan_input &in, const mount_info_table &mounts);
+void build_plan(const plan_input &in, const mount_info_table &mounts, mount_plan &plan);
+bool load_plan(const char *path, uint64_t key, mount_plan &plan);
+bool save_plan(const char *path, const mount_plan &plan);
+// generations and layers as given to overlay_lowers(), layers is nullptr without pruning
+std::string plan_to_json(const plan_input &in, const mount_plan &plan, const std::vector<std::string> &generations,
+                         const layer_index *layers);
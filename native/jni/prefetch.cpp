@@ -0,0 +1,249 @@
+#include "prefetch.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include "profiler.hpp"
+#include "threadpool.hpp"
+#include "dirscan.hpp"
+
+using namespace std;
+
+// a full boot caches far more than zygote needs first, keep the largest users
+#define HOT_MAX_BYTES (256ULL << 20)
+// smallest readahead window in use, larger requests are only partly read
+#define PREFETCH_CHUNK (128 << 10)
+
+static const char *partitions[] = { "/system", "/vendor", "/system_ext", "/product" };
+
+bool cached_range(int fd, uint64_t &resident, uint64_t &extent) {
+    struct stat st;
+    resident = extent = 0;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+        return false;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (st.st_size + page - 1) / page;
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return false;
+    vector<unsigned char> vec(pages);
+    prof_syscall(3);
+    bool ok = mincore(addr, st.st_size, vec.data()) == 0;
+    munmap(addr, st.st_size);
+    if (!ok)
+        return false;
+    for (size_t i = 0; i < pages; i++) {
+        if (vec[i] & 1) {
+            resident += page;
+            extent = (i + 1) * page;
+        }
+    }
+    extent = min<uint64_t>(extent, st.st_size);
+    return resident > 0;
+}
+
+static void scan_hot(const string &dir, vector<pair<uint64_t, hot_file>> &out) {
+    dir_list list;
+    int fd = scan_dir(AT_FDCWD, dir.data(), list);
+    if (fd < 0)
+        return;
+    for (size_t i = 0; i < list.size(); i++) {
+        string path = dir + "/" + list.name(i);
+        if (list.type(i) == DT_DIR) {
+            scan_hot(path, out);
+        } else if (list.type(i) == DT_REG) {
+            prof_syscall();
+            int file = openat(fd, list.name(i), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            if (file < 0)
+                continue;
+            uint64_t resident, extent;
+            if (cached_range(file, resident, extent))
+                out.push_back({ resident, { std::move(path), extent } });
+            close(file);
+        }
+    }
+    close(fd);
+}
+
+int record_hot(const char *list) {
+    vector<pair<uint64_t, hot_file>> found;
+    for (auto part : partitions) {
+        struct stat st;
+        // /vendor -> /system/vendor is scanned as part of /system
+        if (lstat(part, &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+        scan_hot(part, found);
+    }
+    // most cached first, so the budget goes to what boot used most
+    sort(found.begin(), found.end(), [](auto &a, auto &b) { return a.first > b.first; });
+    string data;
+    uint64_t total = 0;
+    size_t count = 0;
+    char buf[32];
+    for (auto &f : found) {
+        if (total + f.second.bytes > HOT_MAX_BYTES)
+            continue;
+        total += f.second.bytes;
+        count++;
+        snprintf(buf, sizeof(buf), "%llu ", (unsigned long long) f.second.bytes);
+        data += buf;
+        data += f.second.path;
+        data += '\n';
+    }
+    string tmp = string(list) + ".tmp";
+    int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        PLOGE("create %s", tmp.data());
+        return 1;
+    }
+    bool ok = write(fd, data.data(), data.size()) == (ssize_t) data.size() && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.data(), list) != 0) {
+        PLOGE("save %s", list);
+        unlink(tmp.data());
+        return 1;
+    }
+    LOGI("prefetch: recorded %zu of %zu cached files, %llu KiB\n", count, found.size(),
+         (unsigned long long) (total / 1024));
+    return 0;
+}
+
+bool load_hot(const char *list, vector<hot_file> &files) {
+    FILE *fp = fopen(list, "re");
+    if (fp == nullptr)
+        return false;
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    files.clear();
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        unsigned long long bytes;
+        int off = 0;
+        if (sscanf(line, "%llu %n", &bytes, &off) != 1 || off == 0 || line[off] != '/')
+            continue;
+        files.push_back({ line + off, bytes });
+    }
+    free(line);
+    fclose(fp);
+    return true;
+}
+
+uint64_t prefetch(const vector<hot_file> &files, int jobs) {
+    atomic<uint64_t> bytes{0};
+    parallel_for(files.size(), jobs, [&](size_t i) {
+        auto &f = files[i];
+        prof_syscall(2);
+        int fd = open(f.path.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        // the kernel cuts each request down to the readahead window of the device
+        for (uint64_t off = 0; off < f.bytes; off += PREFETCH_CHUNK) {
+            size_t len = min<uint64_t>(PREFETCH_CHUNK, f.bytes - off);
+            prof_syscall();
+            // overlayfs before 4.19 has no readahead, fadvise is passed down since then
+            if (readahead(fd, off, len) != 0)
+                posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+        }
+        close(fd);
+        bytes += f.bytes;
+    });
+    return bytes;
+}
+
+void prefetch_background(const char *list, int jobs) {
+    vector<hot_file> files;
+    if (!load_hot(list, files) || files.empty()) {
+        LOGD("prefetch: no hot list at %s\n", list);
+        return;
+    }
+    pid_t pid = fork_background();
+    if (pid < 0) {
+        PLOGE("fork");
+        return;
+    }
+    if (pid > 0) {
+        LOGI("prefetch: %zu files in background, pid %d\n", files.size(), pid);
+        return;
+    }
+    uint64_t start = prof_now();
+    uint64_t bytes = prefetch(files, jobs);
+    LOGI("prefetch: %zu files, %llu KiB in %llu ms\n", files.size(), (unsigned long long) (bytes / 1024),
+         (unsigned long long) ((prof_now() - start) / 1000000));
+    log_flush();
+    _exit(0);
+}
+
+// open and first read of every file, microseconds
+static void first_read(const vector<hot_file> &files, vector<uint64_t> &us) {
+    char buf[4096];
+    us.clear();
+    for (auto &f : files) {
+        uint64_t start = prof_now();
+        int fd = open(f.path.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        pread(fd, buf, sizeof(buf), 0);
+        close(fd);
+        us.push_back((prof_now() - start) / 1000);
+    }
+    sort(us.begin(), us.end());
+}
+
+// clean pages only, files mapped by running processes partly stay cached
+static void evict(const vector<hot_file> &files) {
+    for (auto &f : files) {
+        int fd = open(f.path.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// readahead only queues most of the I/O, wait until the listed ranges are cached
+static void wait_cached(const vector<hot_file> &files, uint64_t timeout_ms) {
+    uint64_t deadline = prof_now() + timeout_ms * 1000000;
+    for (auto &f : files) {
+        int fd = open(f.path.data(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        uint64_t resident, extent;
+        while (cached_range(fd, resident, extent) && resident < f.bytes && prof_now() < deadline)
+            usleep(1000);
+        close(fd);
+    }
+}
+
+static string latency_json(const vector<uint64_t> &us) {
+    char buf[160];
+    uint64_t total = 0;
+    for (auto v : us)
+        total += v;
+    auto pct = [&](size_t p) { return us.empty()? 0ULL : (unsigned long long) us[(us.size() - 1) * p / 100]; };
+    snprintf(buf, sizeof(buf), "{\"files\": %zu, \"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu, \"total_us\": %llu}",
+             us.size(), pct(50), pct(90), pct(99), (unsigned long long) total);
+    return buf;
+}
+
+int prefetch_bench(const char *list, int jobs) {
+    vector<hot_file> files;
+    if (!load_hot(list, files) || files.empty()) {
+        LOGE("prefetch: no hot list at %s\n", list);
+        return 1;
+    }
+    vector<uint64_t> cold, warm;
+    evict(files);
+    first_read(files, cold);
+    evict(files);
+    uint64_t start = prof_now();
+    uint64_t bytes = prefetch(files, jobs);
+    uint64_t issue_us = (prof_now() - start) / 1000;
+    wait_cached(files, 10000);
+    uint64_t done_us = (prof_now() - start) / 1000;
+    first_read(files, warm);
+    printf("{\n  \"list\": \"%s\",\n  \"prefetch_bytes\": %llu,\n  \"prefetch_issue_us\": %llu,\n"
+           "  \"prefetch_done_us\": %llu,\n  \"cold\": %s,\n  \"prefetched\": %s\n}\n", list,
+           (unsigned long long) bytes, (unsigned long long) issue_us, (unsigned long long) done_us,
+           latency_json(cold).data(), latency_json(warm).data());
+    return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "base.hpp"
+
+// Page cache prefetch of files which the previous boot read
+// --record-hot checks with mincore which files under the overlaid partitions are
+// cached once boot is complete and saves them as the hot list. After the overlays
+// are mounted on the next boot, a background child at idle I/O priority reads them
+// ahead through the merged view, before zygote asks for them
+
+struct hot_file {
+    std::string path;
+    // bytes to read ahead, up to the end of the last cached page
+    uint64_t bytes;
+};
+
+// cached bytes of fd and how far to read to get all of them back, false if none
+bool cached_range(int fd, uint64_t &resident, uint64_t &extent);
+// scan partitions and save the cached files to list, returns 0 on success
+int record_hot(const char *list);
+bool load_hot(const char *list, std::vector<hot_file> &files);
+// readahead every file on jobs threads, returns bytes requested
+uint64_t prefetch(const std::vector<hot_file> &files, int jobs);
+// fork a child at idle I/O priority which prefetches list, the caller does not wait for it
+void prefetch_background(const char *list, int jobs);
+// time to first read of every listed file cold, then after prefetch, printed as JSON
+int prefetch_bench(const char *list, int jobs);
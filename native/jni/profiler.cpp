@@ -0,0 +1,239 @@
+#include "base.hpp"
+#include "profiler.hpp"
+#include "sysops.hpp"
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+using namespace std;
+
+struct prof_phase {
+    string name;
+    int parent;
+    int depth;
+    uint64_t start;
+    uint64_t end;
+    unsigned long syscalls;
+    unsigned long mounts;
+};
+
+struct prof_mount_rec {
+    string op;
+    string src;
+    string target;
+    string type;
+    unsigned long flags;
+    int phase;
+    uint64_t start;
+    uint64_t duration;
+    int ret;
+    int err;
+};
+
+static uint64_t prof_start = 0;
+static uint64_t prof_boottime = 0;
+static vector<prof_phase> phases;
+static vector<prof_mount_rec> mounts;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+// innermost phase of the calling thread
+static __thread int cur_phase = -1;
+
+static uint64_t clock_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t prof_now() {
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+void prof_init() {
+    prof_start = prof_now();
+    prof_boottime = clock_ns(CLOCK_BOOTTIME);
+    phases.clear();
+    mounts.clear();
+    cur_phase = -1;
+    prof_begin("total");
+}
+
+int prof_current() {
+    return cur_phase;
+}
+
+void prof_set_current(int phase) {
+    cur_phase = phase;
+}
+
+void prof_begin(const char *phase) {
+    prof_phase p;
+    p.name = phase;
+    p.start = prof_now();
+    p.end = 0;
+    p.syscalls = 0;
+    p.mounts = 0;
+    pthread_mutex_lock(&prof_lock);
+    p.parent = cur_phase;
+    p.depth = (cur_phase < 0)? 0 : phases[cur_phase].depth + 1;
+    cur_phase = phases.size();
+    phases.emplace_back(p);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_end() {
+    if (cur_phase < 0)
+        return;
+    uint64_t now = prof_now();
+    pthread_mutex_lock(&prof_lock);
+    auto &p = phases[cur_phase];
+    p.end = now;
+    // account syscalls of nested phases to parents too
+    if (p.parent >= 0) {
+        phases[p.parent].syscalls += p.syscalls;
+        phases[p.parent].mounts += p.mounts;
+    }
+    cur_phase = p.parent;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_syscall(int n) {
+    if (cur_phase < 0)
+        return;
+    pthread_mutex_lock(&prof_lock);
+    phases[cur_phase].syscalls += n;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void prof_mount(const char *op, const char *src, const char *target,
+                const char *type, unsigned long flags, uint64_t start, int ret, int err) {
+    uint64_t now = prof_now();
+    prof_syscall();
+    prof_mount_rec rec;
+    rec.op = op;
+    rec.src = src? src : "";
+    rec.target = target? target : "";
+    rec.type = type? type : "";
+    rec.flags = flags;
+    rec.phase = cur_phase;
+    rec.start = start;
+    rec.duration = now - start;
+    rec.ret = ret;
+    rec.err = err;
+    pthread_mutex_lock(&prof_lock);
+    if (cur_phase >= 0)
+        phases[cur_phase].mounts++;
+    mounts.emplace_back(rec);
+    pthread_mutex_unlock(&prof_lock);
+    sys().on_mount(op, src, target, type, flags, now - start, ret, err);
+}
+
+static string json_str(const string &s) {
+    string out = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+static string csv_str(const string &s) {
+    if (s.find_first_of(",\"\n") == string::npos)
+        return s;
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    out += "\"";
+    return out;
+}
+
+static bool write_all(const char *path, const string &data) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    const char *p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    close(fd);
+    return left == 0;
+}
+
+void prof_write_report(const char *base) {
+    // close all opened phases of this thread, including "total"
+    while (cur_phase >= 0)
+        prof_end();
+
+    char buf[512];
+    string json = "{\n";
+    snprintf(buf, sizeof(buf), "  \"boottime_ns\": %llu,\n  \"total_ns\": %llu,\n",
+             (unsigned long long) prof_boottime,
+             (unsigned long long) (prof_now() - prof_start));
+    json += buf;
+    json += "  \"phases\": [\n";
+    string csv = "kind,name,depth,target,start_ns,duration_ns,syscalls,mounts,errno\n";
+    for (size_t i = 0; i < phases.size(); i++) {
+        auto &p = phases[i];
+        snprintf(buf, sizeof(buf),
+                 "    {\"name\": %s, \"depth\": %d, \"start_ns\": %llu, \"duration_ns\": %llu, "
+                 "\"syscalls\": %lu, \"mounts\": %lu}%s\n",
+                 json_str(p.name).data(), p.depth,
+                 (unsigned long long) (p.start - prof_start),
+                 (unsigned long long) (p.end - p.start),
+                 p.syscalls, p.mounts, (i + 1 < phases.size())? "," : "");
+        json += buf;
+        snprintf(buf, sizeof(buf), "phase,%s,%d,,%llu,%llu,%lu,%lu,\n",
+                 csv_str(p.name).data(), p.depth,
+                 (unsigned long long) (p.start - prof_start),
+                 (unsigned long long) (p.end - p.start),
+                 p.syscalls, p.mounts);
+        csv += buf;
+    }
+    json += "  ],\n  \"mounts\": [\n";
+    for (size_t i = 0; i < mounts.size(); i++) {
+        auto &m = mounts[i];
+        const string &phase = (m.phase < 0)? string() : phases[m.phase].name;
+        json += "    {\"op\": " + json_str(m.op) +
+                ", \"phase\": " + json_str(phase) +
+                ", \"source\": " + json_str(m.src) +
+                ", \"target\": " + json_str(m.target) +
+                ", \"type\": " + json_str(m.type);
+        snprintf(buf, sizeof(buf),
+                 ", \"flags\": %lu, \"start_ns\": %llu, \"duration_ns\": %llu, \"ret\": %d, \"errno\": %d}%s\n",
+                 m.flags, (unsigned long long) (m.start - prof_start),
+                 (unsigned long long) m.duration, m.ret, m.err,
+                 (i + 1 < mounts.size())? "," : "");
+        json += buf;
+        csv += m.op + "," + csv_str(phase) + ",," + csv_str(m.target);
+        snprintf(buf, sizeof(buf), ",%llu,%llu,1,1,%d\n",
+                 (unsigned long long) (m.start - prof_start),
+                 (unsigned long long) m.duration, m.err);
+        csv += buf;
+    }
+    json += "  ]\n}\n";
+
+    write_all((string(base) + ".prof.json").data(), json);
+    write_all((string(base) + ".prof.csv").data(), csv);
+}
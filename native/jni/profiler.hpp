@@ -0,0 +1,30 @@
+#pragma once
+#include "base.hpp"
+#include <stdint.h>
+
+// Boot-time profiler
+// Records monotonic timestamps for every phase of overlayfs_system,
+// number of syscalls issued in each phase and latency/errno of every
+// mount/umount call, then dumps a JSON and CSV report next to the log
+
+uint64_t prof_now();
+void prof_init();
+// phase context of the calling thread, used to attach worker threads to a phase
+int prof_current();
+void prof_set_current(int phase);
+void prof_begin(const char *phase);
+void prof_end();
+void prof_syscall(int n = 1);
+void prof_mount(const char *op, const char *src, const char *target,
+                const char *type, unsigned long flags, uint64_t start, int ret, int err);
+void prof_write_report(const char *base);
+
+// RAII helper for a phase which ends at the end of the scope
+struct prof_scope {
+    explicit prof_scope(const char *phase) { prof_begin(phase); }
+    ~prof_scope() { prof_end(); }
+};
+
+#define PROF_CONCAT2(a, b) a##b
+#define PROF_CONCAT(a, b) PROF_CONCAT2(a, b)
+#define PROF_PHASE(name) prof_scope PROF_CONCAT(__prof_phase_, __LINE__)(name)
@@ -0,0 +1,168 @@
+#include "skeleton.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include <sys/uio.h>
+
+using namespace std;
+
+#define SKELETON_MAGIC "OVLSKEL"
+#define SKELETON_VERSION 1
+
+skeleton::skeleton() : map(nullptr), map_size(0), fingerprint(0), topology(0),
+                       loaded_topology(0), dirty(false) {
+    pthread_mutex_init(&lock, nullptr);
+}
+
+skeleton::~skeleton() {
+    if (map)
+        munmap(map, map_size);
+    pthread_mutex_destroy(&lock);
+}
+
+bool skeleton::load(const char *path, uint64_t fp, uint64_t topo) {
+    fingerprint = fp;
+    topology = topo;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        goto stale;
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(skeleton_header)) {
+            close(fd);
+            goto stale;
+        }
+        map_size = st.st_size;
+        map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            map = nullptr;
+            goto stale;
+        }
+    }
+    {
+        auto hdr = static_cast<const skeleton_header *>(map);
+        size_t need = sizeof(*hdr) + (size_t) hdr->count * sizeof(skeleton_entry) + hdr->strings_size;
+        if (memcmp(hdr->magic, SKELETON_MAGIC, sizeof(SKELETON_MAGIC)) != 0 ||
+            hdr->version != SKELETON_VERSION || need > map_size) {
+            LOGD("skeleton: invalid manifest\n");
+            goto stale;
+        }
+        if (hdr->fingerprint != fingerprint) {
+            LOGD("skeleton: build fingerprint changed\n");
+            goto stale;
+        }
+        loaded_topology = hdr->topology;
+        auto ent = reinterpret_cast<const skeleton_entry *>(hdr + 1);
+        auto str = reinterpret_cast<const char *>(ent + hdr->count);
+        for (uint32_t i = 0; i < hdr->count; i++) {
+            if ((uint64_t) ent[i].path_off + ent[i].path_len > hdr->strings_size)
+                continue;
+            known.emplace(string_view(str + ent[i].path_off, ent[i].path_len), entries.size());
+            entries.push_back(ent[i]);
+        }
+        strings.assign(str, hdr->strings_size);
+        LOGI("skeleton: %u known directories, topology %s\n", hdr->count,
+             topology_changed()? "changed" : "unchanged");
+        dirty = topology_changed();
+        return true;
+    }
+stale:
+    if (map) {
+        munmap(map, map_size);
+        map = nullptr;
+    }
+    known.clear();
+    entries.clear();
+    strings.clear();
+    dirty = true;
+    return false;
+}
+
+bool skeleton::contains(string_view target) {
+    pthread_mutex_lock(&lock);
+    bool ret = known.count(target) > 0;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+static void set_attr(skeleton_entry &e, const file_attr *attr) {
+    e.uid = attr->uid;
+    e.gid = attr->gid;
+    e.mode = attr->mode;
+    e.con_hash = (uint32_t) hash_str(0, attr->con);
+}
+
+static bool same_attr(const skeleton_entry &e, const file_attr *attr) {
+    skeleton_entry c = e;
+    set_attr(c, attr);
+    return memcmp(&c, &e, sizeof(c)) == 0;
+}
+
+bool skeleton::matches(string_view target, const file_attr *attr) {
+    // nothing to clone from
+    if (attr == nullptr)
+        return true;
+    pthread_mutex_lock(&lock);
+    auto it = known.find(target);
+    bool ret = it != known.end() && same_attr(entries[it->second], attr);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+void skeleton::add(string_view target, const file_attr *attr) {
+    pthread_mutex_lock(&lock);
+    auto it = known.find(target);
+    if (it != known.end()) {
+        if (attr && !same_attr(entries[it->second], attr)) {
+            set_attr(entries[it->second], attr);
+            dirty = true;
+        }
+    } else {
+        skeleton_entry e{};
+        e.path_off = strings.size();
+        e.path_len = target.size();
+        if (attr)
+            set_attr(e, attr);
+        strings.append(target.data(), target.size());
+        // string_views of known must stay valid while strings grows
+        added.emplace_back(target);
+        known.emplace(added.back(), entries.size());
+        entries.push_back(e);
+        dirty = true;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+bool skeleton::save(const char *path) {
+    if (!dirty)
+        return true;
+    skeleton_header hdr{};
+    memcpy(hdr.magic, SKELETON_MAGIC, sizeof(SKELETON_MAGIC));
+    hdr.version = SKELETON_VERSION;
+    hdr.count = entries.size();
+    hdr.fingerprint = fingerprint;
+    hdr.topology = topology;
+    hdr.strings_size = strings.size();
+
+    string tmp = string(path) + ".tmp";
+    int fd = open(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+    struct iovec iov[3] = {
+        { &hdr, sizeof(hdr) },
+        { entries.data(), entries.size() * sizeof(skeleton_entry) },
+        { const_cast<char *>(strings.data()), strings.size() },
+    };
+    size_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    bool ok = writev(fd, iov, 3) == (ssize_t) total;
+    ok = fsync(fd) == 0 && ok;
+    close(fd);
+    // replace atomically, a torn manifest would only cost a full setup anyway
+    if (!ok || rename(tmp.data(), path) != 0) {
+        unlink(tmp.data());
+        return false;
+    }
+    LOGD("skeleton: saved %zu directories\n", entries.size());
+    dirty = false;
+    return true;
+}
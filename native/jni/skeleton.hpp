@@ -0,0 +1,60 @@
+#pragma once
+#include "base.hpp"
+#include "attrs.hpp"
+#include <unordered_map>
+#include <deque>
+#include <pthread.h>
+
+// Upperdir skeleton manifest
+// Binary, mmap-able record of the upper/worker directories created by previous boots,
+// keyed by build fingerprint so an OTA invalidates it. Directories found in it are
+// not walked, created or labeled again, unless the stock directory no longer has the
+// owner, mode and label they were cloned from
+
+struct skeleton_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t fingerprint;
+    uint64_t topology;
+    uint64_t strings_size;
+};
+
+struct skeleton_entry {
+    uint32_t path_off;
+    uint32_t path_len;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mode;
+    uint32_t con_hash;
+};
+
+struct skeleton {
+    skeleton();
+    ~skeleton();
+    // load manifest, returns false if it is missing or was written for another build
+    bool load(const char *path, uint64_t fingerprint, uint64_t topology);
+    // true if upper/worker dirs of target were created by previous boots
+    bool contains(std::string_view target);
+    // true if attr is what the upper dir of target was cloned from
+    bool matches(std::string_view target, const file_attr *attr);
+    // record target, or update the attributes it was cloned from
+    void add(std::string_view target, const file_attr *attr);
+    // write manifest if anything changed since load
+    bool save(const char *path);
+    bool topology_changed() const { return loaded_topology != topology; }
+
+private:
+    void *map;
+    size_t map_size;
+    uint64_t fingerprint;
+    uint64_t topology;
+    uint64_t loaded_topology;
+    bool dirty;
+    pthread_mutex_t lock;
+    // path -> index in entries
+    std::unordered_map<std::string_view, size_t> known;
+    std::vector<skeleton_entry> entries;
+    std::string strings;
+    std::deque<std::string> added;
+};
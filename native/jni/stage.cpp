@@ -0,0 +1,320 @@
+#include "stage.hpp"
+#include "logging.hpp"
+#include "profiler.hpp"
+#include "utils.hpp"
+#include "mounttable.hpp"
+#include "sysops.hpp"
+#include <sys/syscall.h>
+
+using namespace std;
+
+// new mount API, not every libc has wrappers for these yet
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_fsopen
+#define __NR_fsopen 430
+#endif
+#ifndef __NR_fsconfig
+#define __NR_fsconfig 431
+#endif
+#ifndef __NR_fsmount
+#define __NR_fsmount 432
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+
+#define OVL_FSOPEN_CLOEXEC          0x00000001
+#define OVL_FSMOUNT_CLOEXEC         0x00000001
+#define OVL_FSCONFIG_SET_FLAG       0
+#define OVL_FSCONFIG_SET_STRING     1
+#define OVL_FSCONFIG_CMD_CREATE     6
+#define OVL_MOUNT_ATTR_RDONLY       0x00000001
+#define OVL_MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#define OVL_OPEN_TREE_CLONE         1
+#define OVL_OPEN_TREE_CLOEXEC       O_CLOEXEC
+#define OVL_AT_RECURSIVE            0x8000
+
+struct ovl_mount_attr {
+    uint64_t attr_set;
+    uint64_t attr_clr;
+    uint64_t propagation;
+    uint64_t userns_fd;
+};
+
+static int sys_fsopen(const char *fs, unsigned int flags) {
+    return syscall(__NR_fsopen, fs, flags);
+}
+
+static int sys_fsconfig(int fd, unsigned int cmd, const char *key, const void *value, int aux) {
+    return syscall(__NR_fsconfig, fd, cmd, key, value, aux);
+}
+
+static int sys_fsmount(int fd, unsigned int flags, unsigned int attr) {
+    return syscall(__NR_fsmount, fd, flags, attr);
+}
+
+static int sys_move_mount(int from_dfd, const char *from, int to_dfd, const char *to, unsigned int flags) {
+    return syscall(__NR_move_mount, from_dfd, from, to_dfd, to, flags);
+}
+
+static int sys_open_tree(int dfd, const char *path, unsigned int flags) {
+    return syscall(__NR_open_tree, dfd, path, flags);
+}
+
+static int sys_mount_setattr(int dfd, const char *path, unsigned int flags, ovl_mount_attr *attr, size_t size) {
+    return syscall(__NR_mount_setattr, dfd, path, flags, attr, size);
+}
+
+bool fsmount_supported() {
+    static int supported = -1;
+    if (supported < 0) {
+        int fd = sys_fsopen("overlay", OVL_FSOPEN_CLOEXEC);
+        supported = fd >= 0;
+        if (fd >= 0)
+            close(fd);
+    }
+    return supported;
+}
+
+bool mount_setattr_supported() {
+    static int supported = -1;
+    if (supported < 0) {
+        // invalid arguments on purpose, only ENOSYS tells it is missing
+        supported = sys_mount_setattr(-1, "", AT_EMPTY_PATH, nullptr, 0) == 0 || errno != ENOSYS;
+    }
+    return supported;
+}
+
+// set propagation type of mount of fd (or path when fd < 0)
+// recursive changes the whole tree in one call
+static int set_propagation(int fd, const char *path, unsigned long type, bool recursive) {
+    uint64_t start = prof_now();
+    int ret;
+    if (sys().native() && mount_setattr_supported()) {
+        ovl_mount_attr attr{};
+        attr.propagation = type;
+        unsigned int flags = recursive? OVL_AT_RECURSIVE : 0;
+        ret = (fd >= 0)?
+            sys_mount_setattr(fd, "", flags | AT_EMPTY_PATH, &attr, sizeof(attr)) :
+            sys_mount_setattr(AT_FDCWD, path, flags, &attr, sizeof(attr));
+    } else {
+        ret = sys().mount("", path, nullptr, type | (recursive? MS_REC : 0), nullptr);
+    }
+    int err = errno;
+    prof_mount("propagation", nullptr, path, nullptr, type | (recursive? MS_REC : 0), start, ret, ret? err : 0);
+    if (ret) {
+        errno = err;
+        PLOGE("propagation %s: %s", (type == MS_SHARED)? "shared" : "private", path);
+    }
+    return ret;
+}
+
+// paths which are not under another path of the list
+static vector<string> roots_of(const vector<string> &paths) {
+    mount_table table;
+    for (auto &p : paths)
+        table.insert(p);
+    vector<string> roots;
+    for (auto &p : paths) {
+        if (!table.is_under(p))
+            roots.emplace_back(p);
+    }
+    return roots;
+}
+
+mount_stage::mount_stage() : use_fsmount(false) {
+    pthread_mutex_init(&lock, nullptr);
+}
+
+mount_stage::~mount_stage() {
+    release();
+    pthread_mutex_destroy(&lock);
+}
+
+void mount_stage::init(bool fsmount, const string &dir) {
+    use_fsmount = fsmount;
+    tmp_dir = dir;
+}
+
+int mount_stage::get_fd(const string &target) {
+    pthread_mutex_lock(&lock);
+    auto it = fds.find(target);
+    int fd = (it == fds.end())? -1 : it->second;
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+void mount_stage::set_fd(const string &target, int fd) {
+    pthread_mutex_lock(&lock);
+    auto res = fds.emplace(target, fd);
+    if (!res.second) {
+        close(res.first->second);
+        res.first->second = fd;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void mount_stage::release() {
+    pthread_mutex_lock(&lock);
+    for (auto &it : fds)
+        close(it.second);
+    fds.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+int mount_stage::overlay(const string &target, const string &opts, bool rdonly) {
+    if (!use_fsmount)
+        return verbose_mount("overlay", (tmp_dir + target).data(), "overlay", rdonly? MS_RDONLY : 0, opts.data());
+
+    uint64_t start = prof_now();
+    int fs = sys_fsopen("overlay", OVL_FSOPEN_CLOEXEC);
+    int mnt = -1;
+    int err = 0;
+    if (fs < 0)
+        goto done;
+    // split "key=value,key=value" as mount(2) would do
+    for (size_t pos = 0; pos < opts.size();) {
+        size_t end = opts.find(',', pos);
+        if (end == string::npos)
+            end = opts.size();
+        string opt = opts.substr(pos, end - pos);
+        pos = end + 1;
+        size_t eq = opt.find('=');
+        string key = opt.substr(0, eq);
+        int ret = (eq == string::npos)?
+            sys_fsconfig(fs, OVL_FSCONFIG_SET_FLAG, key.data(), nullptr, 0) :
+            sys_fsconfig(fs, OVL_FSCONFIG_SET_STRING, key.data(), opt.data() + eq + 1, 0);
+        if (ret < 0)
+            goto done;
+    }
+    if (sys_fsconfig(fs, OVL_FSCONFIG_CMD_CREATE, nullptr, nullptr, 0) < 0)
+        goto done;
+    mnt = sys_fsmount(fs, OVL_FSMOUNT_CLOEXEC, rdonly? OVL_MOUNT_ATTR_RDONLY : 0);
+
+    done:
+    err = errno;
+    if (fs >= 0)
+        close(fs);
+    prof_mount("fsmount", "overlay", target.data(), "overlay", rdonly? MS_RDONLY : 0,
+               start, mnt < 0? -1 : 0, mnt < 0? err : 0);
+    if (mnt < 0) {
+        errno = err;
+        PLOGE("fsmount: overlay -> %s", target.data());
+        return -1;
+    }
+    LOGD("fsmount: %s <- overlay [%s]\n", target.data(), opts.data());
+    set_fd(target, mnt);
+    return 0;
+}
+
+int mount_stage::bind(const string &target) {
+    if (!use_fsmount)
+        return verbose_mount(target.data(), (tmp_dir + target).data(), nullptr, MS_BIND, nullptr);
+
+    uint64_t start = prof_now();
+    int mnt = sys_open_tree(AT_FDCWD, target.data(), OVL_OPEN_TREE_CLONE | OVL_OPEN_TREE_CLOEXEC);
+    int err = errno;
+    prof_mount("open_tree", target.data(), target.data(), nullptr, MS_BIND, start, mnt < 0? -1 : 0, mnt < 0? err : 0);
+    if (mnt < 0) {
+        errno = err;
+        PLOGE("open_tree: %s", target.data());
+        return -1;
+    }
+    LOGD("open_tree: %s\n", target.data());
+    set_fd(target, mnt);
+    return 0;
+}
+
+int mount_stage::attach(const string &target) {
+    if (!use_fsmount) {
+        std::string tmp_mount = tmp_dir + target;
+        if (verbose_mount(tmp_mount.data(), target.data(), nullptr, MS_BIND, nullptr))
+            return -1;
+        attached.emplace_back(target);
+        pending.emplace_back(target);
+        return 0;
+    }
+
+    int mnt = get_fd(target);
+    if (mnt < 0)
+        return -1;
+    uint64_t start = prof_now();
+    int ret = sys_move_mount(mnt, "", AT_FDCWD, target.data(), OVL_MOVE_MOUNT_F_EMPTY_PATH);
+    int err = errno;
+    prof_mount("move_mount", nullptr, target.data(), nullptr, 0, start, ret, ret? err : 0);
+    if (ret) {
+        errno = err;
+        PLOGE("move_mount: %s", target.data());
+        return -1;
+    }
+    LOGD("move_mount: %s\n", target.data());
+    attached.emplace_back(target);
+    pending.emplace_back(target);
+    return 0;
+}
+
+int mount_stage::mirror(const string &target, const string &mirror_dir) {
+    if (!use_fsmount) {
+        std::string tmp_mount = tmp_dir + target;
+        if (verbose_mount(tmp_mount.data(), mirror_dir.data(), nullptr, MS_BIND, nullptr))
+            return -1;
+        pending.emplace_back(mirror_dir);
+        return 0;
+    }
+
+    int mnt = get_fd(target);
+    if (mnt < 0)
+        return -1;
+    uint64_t start = prof_now();
+    int clone = sys_open_tree(mnt, "", OVL_OPEN_TREE_CLONE | OVL_OPEN_TREE_CLOEXEC | AT_EMPTY_PATH);
+    // the clone is a peer of the (already shared) target, it must leave the peer group
+    // before anything is mounted under it, or mounts would propagate back to the target
+    bool early = mount_setattr_supported();
+    if (clone >= 0 && early && set_propagation(clone, mirror_dir.data(), MS_PRIVATE, false)) {
+        close(clone);
+        clone = -1;
+    }
+    int ret = (clone < 0)? -1 :
+        sys_move_mount(clone, "", AT_FDCWD, mirror_dir.data(), OVL_MOVE_MOUNT_F_EMPTY_PATH);
+    int err = errno;
+    prof_mount("move_mount", nullptr, mirror_dir.data(), nullptr, MS_BIND, start, ret, ret? err : 0);
+    if (ret == 0 && !early)
+        ret = set_propagation(-1, mirror_dir.data(), MS_PRIVATE, false);
+    if (ret == 0)
+        pending.emplace_back(mirror_dir);
+    if (clone >= 0)
+        close(clone);
+    return ret;
+}
+
+int mount_stage::private_staging() {
+    return set_propagation(-1, tmp_dir.data(), MS_PRIVATE, true);
+}
+
+int mount_stage::propagate() {
+    // mounts under another pending mount are part of its tree,
+    // so one private -> shared pass per tree covers all of them
+    // private first so every mount gets a new peer group
+    int ret = 0;
+    for (auto &root : roots_of(pending)) {
+        if (set_propagation(-1, root.data(), MS_PRIVATE, true) ||
+            set_propagation(-1, root.data(), MS_SHARED, true))
+            ret = -1;
+    }
+    pending.clear();
+    return ret;
+}
+
+void mount_stage::rollback() {
+    auto roots = roots_of(attached);
+    std::reverse(roots.begin(), roots.end());
+    for (auto &root : roots)
+        verbose_umount(root.data(), MNT_DETACH);
+    attached.clear();
+    pending.clear();
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "base.hpp"
+#include <unordered_map>
+#include <pthread.h>
+
+// Overlay staging backends
+// legacy  - overlays are mounted into the tmpfs staging dir (tmp_dir), then bind mounted
+//           to their targets and remounted as private and shared
+// fsmount - overlays are built as detached mounts with fsopen/fsconfig/fsmount and
+//           attached to their targets with move_mount, no staging dir is needed
+// Attached mounts stay private until propagate(), which turns every attached tree
+// into shared mounts in one recursive pass
+
+bool fsmount_supported();
+bool mount_setattr_supported();
+
+struct mount_stage {
+    mount_stage();
+    ~mount_stage();
+    void init(bool use_fsmount, const std::string &tmp_dir);
+    bool detached() const { return use_fsmount; }
+    // stage overlayfs for target with the legacy option string
+    int overlay(const std::string &target, const std::string &opts, bool rdonly);
+    // stage a bind mount of the stock mount at target
+    int bind(const std::string &target);
+    // make the legacy staging dir a private tree so staged mounts do not propagate
+    int private_staging();
+    // attach staged mount of target to target
+    int attach(const std::string &target);
+    // attach a copy of the staged mount of target to mirror_dir
+    int mirror(const std::string &target, const std::string &mirror_dir);
+    // make all mounts attached since last call shared, each in its own peer group
+    int propagate();
+    // detach everything attached by attach(), one recursive detach per tree
+    void rollback();
+    // drop all detached mounts which are not attached
+    void release();
+
+private:
+    bool use_fsmount;
+    std::string tmp_dir;
+    std::unordered_map<std::string, int> fds;
+    // attached targets, and mounts not yet made shared
+    std::vector<std::string> attached;
+    std::vector<std::string> pending;
+    pthread_mutex_t lock;
+    int get_fd(const std::string &target);
+    void set_fd(const std::string &target, int fd);
+};
@@ -0,0 +1,110 @@
+#include "supervise.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include "mountinfo.hpp"
+#include <sys/inotify.h>
+#include <time.h>
+
+using namespace std;
+
+static uint64_t realtime_ns(const timespec &ts) {
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// block until path exists, false if inotify cannot watch its directory
+static bool wait_created(const char *path) {
+    string dir = path;
+    size_t slash = dir.rfind('/');
+    if (slash == string::npos)
+        return false;
+    string name = dir.substr(slash + 1);
+    dir.resize(slash? slash : 1);
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (inotify_add_watch(fd, dir.data(), IN_CREATE | IN_MOVED_TO) < 0) {
+        close(fd);
+        return false;
+    }
+    // it may have been created before the watch was added
+    bool found = access(path, F_OK) == 0;
+    alignas(inotify_event) char buf[4096];
+    while (!found) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        for (char *p = buf; p < buf + n; ) {
+            auto ev = (const inotify_event *) p;
+            if (ev->len > 0 && strcmp(ev->name, name.data()) == 0)
+                found = true;
+            p += sizeof(inotify_event) + ev->len;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+// mountinfo entry as a line of /proc/mounts
+static void append_mount(string &out, const mount_info_view &m) {
+    out += m.source;
+    out += ' ';
+    out += m.target;
+    out += ' ';
+    out += m.type;
+    out += ' ';
+    out += m.vfs_option;
+    // superblock options repeat rw/ro, /proc/mounts only has the one of the mount
+    string_view fs = m.fs_option;
+    if (fs == "rw" || fs == "ro")
+        fs = "";
+    else if (fs.substr(0, 3) == "rw," || fs.substr(0, 3) == "ro,")
+        fs.remove_prefix(3);
+    if (!fs.empty()) {
+        out += ',';
+        out += fs;
+    }
+    out += " 0 0\n";
+}
+
+int supervise(const char *unblock, const vector<string> &mounts) {
+    if (!wait_created(unblock)) {
+        PLOGE("inotify %s", unblock);
+        while (access(unblock, F_OK) != 0)
+            sleep(1);
+    }
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t woke = realtime_ns(ts);
+    // creating the file sets its ctime, that is when service.sh asked for teardown
+    struct stat st;
+    uint64_t signaled = (stat(unblock, &st) == 0)? min(realtime_ns(st.st_ctim), woke) : woke;
+    unlink(unblock);
+
+    int ret = 0;
+    for (auto &dir : mounts) {
+        if (verbose_umount(dir.data(), MNT_DETACH) != 0)
+            ret = 1;
+    }
+    for (auto &dir : mounts)
+        rmdir(dir.data());
+
+    mount_info_table table;
+    string snapshot = "--- Mountinfo ---\n";
+    if (parse_mount_info_view("self", table)) {
+        for (auto &m : table.entries)
+            append_mount(snapshot, m);
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t done = realtime_ns(ts);
+    LOGI("supervise: woke up %llu us after unblock, teardown took %llu us, %llu us in total\n",
+         (unsigned long long) ((woke - signaled) / 1000), (unsigned long long) ((done - woke) / 1000),
+         (unsigned long long) ((done - signaled) / 1000));
+    log_flush();
+    if (log_fd >= 0)
+        write(log_fd, snapshot.data(), snapshot.size());
+    return ret;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "base.hpp"
+
+// Post-boot supervisor
+// mount.sh leaves it in background once everything is mounted. It sleeps in inotify
+// until service.sh creates the unblock file at late_start, then detaches the staging
+// mounts of the writable image and the module images, appends the final mount table
+// to the log and exits
+
+// wait for unblock, then detach and remove every dir of mounts, returns 0 on success
+int supervise(const char *unblock, const std::vector<std::string> &mounts);
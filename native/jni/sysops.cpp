@@ -0,0 +1,1275 @@
+#include "sysops.hpp"
+#include "logging.hpp"
+#include "profiler.hpp"
+#include <sys/system_properties.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
+#include <pthread.h>
+
+using namespace std;
+
+// Trace format, one record per line, tokens separated by spaces:
+//   OVLTRACE 1 <writable>
+//   env <name> <value>
+//   prop <name> <value>
+//   file <path> <length>, followed by length raw bytes and a newline
+//   <call> <ns> <ret> <errno> <path> <args...>
+// calls are stat, lstat (mode dev uid gid size), con (label), setcon (label),
+// mkdir (mode), rmdir, list (count, then type/name per entry) and op for every
+// mount operation (name src type flags). Bytes <= ' ', '%' and >= 0x7f are
+// written as %XX, a lone % is a null string
+#define TRACE_MAGIC "OVLTRACE 1"
+#define STAGING_PREFIX "/mnt/overlayfs_"
+
+static sys_ops kernel_ops;
+static sys_ops *current_ops = &kernel_ops;
+
+sys_ops &sys() {
+    return *current_ops;
+}
+
+void sys_use(sys_ops *ops) {
+    current_ops = ops? ops : &kernel_ops;
+}
+
+int sys_ops::mount(const char *src, const char *target, const char *type,
+                   unsigned long flags, const void *data) {
+    return ::mount(src, target, type, flags, data);
+}
+
+int sys_ops::umount2(const char *target, int flags) {
+    return ::umount2(target, flags);
+}
+
+int sys_ops::mkdir(const char *path, mode_t mode) {
+    return ::mkdir(path, mode);
+}
+
+int sys_ops::rmdir(const char *path) {
+    return ::rmdir(path);
+}
+
+int sys_ops::stat(const char *path, struct stat *st) {
+    return ::stat(path, st);
+}
+
+int sys_ops::lstat(const char *path, struct stat *st) {
+    return ::lstat(path, st);
+}
+
+int sys_ops::getfilecon(const char *path, string &con) {
+    char *c;
+    con.clear();
+    int ret = ::getfilecon(path, &c);
+    if (ret >= 0) {
+        con = c;
+        freecon(c);
+    }
+    return ret;
+}
+
+int sys_ops::lsetfilecon(const char *path, const char *con) {
+    return ::lsetfilecon(path, con);
+}
+
+int sys_ops::list_dir(const char *path, dir_list &out) {
+    int fd = scan_dir(AT_FDCWD, path, out);
+    if (fd < 0)
+        return -1;
+    close(fd);
+    return 0;
+}
+
+// /proc files report st_size = 0, so the buffer is grown until read() returns 0
+bool sys_ops::read_file(const char *path, vector<char> &buf) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    size_t len = 0;
+    if (buf.size() < 64 * 1024)
+        buf.resize(64 * 1024);
+    for (;;) {
+        if (len == buf.size())
+            buf.resize(buf.size() * 2);
+        ssize_t n = read(fd, buf.data() + len, buf.size() - len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return false;
+        }
+        if (n == 0) break;
+        len += n;
+    }
+    close(fd);
+    buf.resize(len);
+    return true;
+}
+
+const char *sys_ops::getenv(const char *name) {
+    return ::getenv(name);
+}
+
+string sys_ops::getprop(const char *name) {
+    char buf[PROP_VALUE_MAX];
+    buf[0] = '\0';
+    __system_property_get(name, buf);
+    return buf;
+}
+
+static void escape(string &out, const char *s) {
+    static const char hex[] = "0123456789ABCDEF";
+    if (s == nullptr) {
+        out += '%';
+        return;
+    }
+    if (s[0] == '\0')
+        out += "%00";
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c <= ' ' || c == '%' || c >= 0x7f) {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        } else {
+            out += c;
+        }
+    }
+}
+
+// returns false for the null token
+static bool unescape(string_view s, string &out) {
+    out.clear();
+    if (s == "%")
+        return false;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) && isxdigit(s[i + 2])) {
+            char hex[3] = { s[i + 1], s[i + 2], 0 };
+            char c = strtol(hex, nullptr, 16);
+            if (c)
+                out += c;
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return true;
+}
+
+static bool under(const string &path, const string &dir) {
+    return !dir.empty() && path.compare(0, dir.size(), dir) == 0 &&
+           (path.size() == dir.size() || path[dir.size()] == '/');
+}
+
+// ---------------- recorder ----------------
+
+struct trace_recorder : sys_ops {
+    FILE *fp;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    unordered_set<string> envs, props;
+
+    explicit trace_recorder(FILE *f) : fp(f) {}
+
+    void put(const string &line) {
+        pthread_mutex_lock(&lock);
+        fwrite(line.data(), 1, line.size(), fp);
+        pthread_mutex_unlock(&lock);
+    }
+
+    // "<call> <ns> <ret> <errno> <path>"
+    string begin(const char *call, uint64_t start, int ret, int err, const char *path) {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "%s %llu %d %d ", call,
+                 (unsigned long long) (prof_now() - start), ret, ret < 0? err : 0);
+        string line = buf;
+        escape(line, path);
+        return line;
+    }
+
+    int record_stat(const char *call, const char *path, struct stat *st, bool follow) {
+        uint64_t start = prof_now();
+        int ret = follow? sys_ops::stat(path, st) : sys_ops::lstat(path, st);
+        int err = errno;
+        string line = begin(call, start, ret, err, path);
+        if (ret == 0) {
+            char buf[128];
+            snprintf(buf, sizeof(buf), " %o %llu %u %u %lld", st->st_mode, (unsigned long long) st->st_dev,
+                     st->st_uid, st->st_gid, (long long) st->st_size);
+            line += buf;
+        }
+        line += '\n';
+        put(line);
+        errno = err;
+        return ret;
+    }
+
+    int stat(const char *path, struct stat *st) override {
+        return record_stat("stat", path, st, true);
+    }
+
+    int lstat(const char *path, struct stat *st) override {
+        return record_stat("lstat", path, st, false);
+    }
+
+    int mkdir(const char *path, mode_t mode) override {
+        uint64_t start = prof_now();
+        int ret = sys_ops::mkdir(path, mode);
+        int err = errno;
+        char buf[16];
+        snprintf(buf, sizeof(buf), " %o\n", mode);
+        put(begin("mkdir", start, ret, err, path) + buf);
+        errno = err;
+        return ret;
+    }
+
+    int rmdir(const char *path) override {
+        uint64_t start = prof_now();
+        int ret = sys_ops::rmdir(path);
+        int err = errno;
+        put(begin("rmdir", start, ret, err, path) + "\n");
+        errno = err;
+        return ret;
+    }
+
+    int getfilecon(const char *path, string &con) override {
+        uint64_t start = prof_now();
+        int ret = sys_ops::getfilecon(path, con);
+        int err = errno;
+        string line = begin("con", start, ret, err, path);
+        line += ' ';
+        escape(line, con.data());
+        put(line + "\n");
+        errno = err;
+        return ret;
+    }
+
+    int lsetfilecon(const char *path, const char *con) override {
+        uint64_t start = prof_now();
+        int ret = sys_ops::lsetfilecon(path, con);
+        int err = errno;
+        string line = begin("setcon", start, ret, err, path);
+        line += ' ';
+        escape(line, con);
+        put(line + "\n");
+        errno = err;
+        return ret;
+    }
+
+    int list_dir(const char *path, dir_list &out) override {
+        uint64_t start = prof_now();
+        int ret = sys_ops::list_dir(path, out);
+        int err = errno;
+        string line = begin("list", start, ret, err, path);
+        if (ret == 0) {
+            line += ' ';
+            line += to_string(out.size());
+            for (size_t i = 0; i < out.size(); i++) {
+                line += ' ';
+                line += to_string(out.type(i));
+                line += '/';
+                escape(line, out.name(i));
+            }
+        }
+        put(line + "\n");
+        errno = err;
+        return ret;
+    }
+
+    bool read_file(const char *path, vector<char> &out) override {
+        bool ok = sys_ops::read_file(path, out);
+        if (ok) {
+            string line = "file ";
+            escape(line, path);
+            line += ' ';
+            line += to_string(out.size());
+            line += '\n';
+            pthread_mutex_lock(&lock);
+            fwrite(line.data(), 1, line.size(), fp);
+            fwrite(out.data(), 1, out.size(), fp);
+            fputc('\n', fp);
+            pthread_mutex_unlock(&lock);
+        }
+        return ok;
+    }
+
+    const char *getenv(const char *name) override {
+        const char *val = sys_ops::getenv(name);
+        pthread_mutex_lock(&lock);
+        bool first = envs.insert(name).second;
+        pthread_mutex_unlock(&lock);
+        if (first) {
+            string line = "env ";
+            escape(line, name);
+            line += ' ';
+            escape(line, val);
+            put(line + "\n");
+        }
+        return val;
+    }
+
+    string getprop(const char *name) override {
+        string val = sys_ops::getprop(name);
+        pthread_mutex_lock(&lock);
+        bool first = props.insert(name).second;
+        pthread_mutex_unlock(&lock);
+        if (first) {
+            string line = "prop ";
+            escape(line, name);
+            line += ' ';
+            escape(line, val.data());
+            put(line + "\n");
+        }
+        return val;
+    }
+
+    void on_mount(const char *op, const char *src, const char *target, const char *type,
+                  unsigned long flags, uint64_t ns, int ret, int err) override {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "op %llu %d %d ", (unsigned long long) ns, ret, ret < 0? err : 0);
+        string line = buf;
+        escape(line, target);
+        line += ' ';
+        escape(line, op);
+        line += ' ';
+        escape(line, src);
+        line += ' ';
+        escape(line, type);
+        snprintf(buf, sizeof(buf), " %lx\n", flags);
+        put(line + buf);
+    }
+
+    void finish() override {
+        pthread_mutex_lock(&lock);
+        fflush(fp);
+        pthread_mutex_unlock(&lock);
+    }
+};
+
+sys_ops *sys_recorder(const char *trace, const char *writable) {
+    FILE *fp = fopen(trace, "we");
+    if (fp == nullptr) {
+        PLOGE("create trace %s", trace);
+        return nullptr;
+    }
+    string header = TRACE_MAGIC " ";
+    escape(header, writable);
+    header += '\n';
+    fwrite(header.data(), 1, header.size(), fp);
+    LOGI("trace: recording to %s\n", trace);
+    return new trace_recorder(fp);
+}
+
+// ---------------- model ----------------
+
+// Directory and attribute model of the traced tree
+// Seeded with the first answer the trace has for each path, which is the tree before
+// the boot changed it, then kept up to date by the mkdir, rmdir, label and mount calls
+// of the replay. Calls which the trace has no answer for are answered from it, so a
+// changed boot can look up paths the recorded one never did. Keys are normalized paths
+// of the simulator, subtrees taken out of it are keyed relative to their root ("", "/a")
+struct sim_node {
+    // 1 exists, -1 missing, 0 unknown
+    int state = 0;
+    // st_mode is 0 while unknown
+    struct stat st{}, lst{};
+    unsigned char type = DT_UNKNOWN;
+    // children holds every entry once the directory was listed
+    bool listed = false;
+    set<string> children;
+    bool has_con = false;
+    string con;
+};
+
+typedef map<string, sim_node> sim_tree;
+
+static string parent_of(const string &path) {
+    size_t slash = path.rfind('/');
+    if (slash == string::npos || path == "/")
+        return "";
+    return (slash == 0)? "/" : path.substr(0, slash);
+}
+
+static string name_of(const string &path) {
+    return path.substr(path.rfind('/') + 1);
+}
+
+// "/" + "/a" is "/a"
+static string join(const string &root, const string &rel) {
+    return (root == "/" && !rel.empty())? rel : root + rel;
+}
+
+static void parse_stat(const vector<string_view> &args, struct stat *st) {
+    if (args.size() < 5)
+        return;
+    st->st_mode = strtoul(string(args[0]).data(), nullptr, 8);
+    st->st_dev = strtoull(string(args[1]).data(), nullptr, 10);
+    st->st_uid = strtoul(string(args[2]).data(), nullptr, 10);
+    st->st_gid = strtoul(string(args[3]).data(), nullptr, 10);
+    st->st_size = strtoll(string(args[4]).data(), nullptr, 10);
+}
+
+static void add_entry(dir_list &out, const string &name, unsigned char type) {
+    dir_list::entry e;
+    e.name = out.names.size();
+    e.type = type;
+    out.names.insert(out.names.end(), name.begin(), name.end());
+    out.names.push_back('\0');
+    out.entries.push_back(e);
+}
+
+static bool is_dir(const sim_node &n) {
+    return n.type == DT_DIR || S_ISDIR(n.lst.st_mode) || S_ISDIR(n.st.st_mode);
+}
+
+// overlayfs whiteouts are character devices 0/0, the trace has no rdev
+static bool is_whiteout(const sim_node &n) {
+    return n.type == DT_CHR || S_ISCHR(n.lst.st_mode);
+}
+
+// true if layer tells whether rel exists and, for a directory, what is in it
+static bool layer_knows(const sim_tree &layer, const string &rel) {
+    auto it = layer.find(rel);
+    if (it != layer.end() && it->second.state != 0)
+        return it->second.state < 0 || !is_dir(it->second) || it->second.listed;
+    if (rel.empty())
+        return false;
+    string parent = rel.substr(0, rel.rfind('/'));
+    auto p = layer.find(parent);
+    // not in a listed parent, or below a file
+    if (p != layer.end() && p->second.state == 1 && (p->second.listed || !is_dir(p->second)))
+        return true;
+    return layer_knows(layer, parent) && (p == layer.end() || p->second.state != 0);
+}
+
+// layers top first, like lowerdir
+static sim_tree merge_layers(const vector<sim_tree> &layers, dev_t dev) {
+    sim_tree out;
+    for (auto l = layers.rbegin(); l != layers.rend(); ++l) {
+        for (auto &[rel, n] : *l) {
+            if (n.state != 1)
+                continue;
+            string parent = rel.empty()? "" : rel.substr(0, rel.rfind('/'));
+            auto it = out.find(rel);
+            if (!rel.empty() && is_whiteout(n)) {
+                if (it != out.end()) {
+                    for (auto sub = out.lower_bound(rel + "/"); sub != out.end() &&
+                         sub->first.compare(0, rel.size() + 1, rel + "/") == 0; )
+                        sub = out.erase(sub);
+                    out.erase(rel);
+                }
+                auto p = out.find(parent);
+                if (p != out.end())
+                    p->second.children.erase(name_of(rel));
+                continue;
+            }
+            if (it != out.end() && is_dir(it->second) && is_dir(n)) {
+                // attributes of the upper directory if known, entries of both
+                sim_node lower = std::move(it->second);
+                it->second = n;
+                it->second.children.insert(lower.children.begin(), lower.children.end());
+                if (it->second.lst.st_mode == 0)
+                    it->second.lst = lower.lst;
+                if (it->second.st.st_mode == 0)
+                    it->second.st = lower.st;
+            } else {
+                if (it != out.end()) {
+                    for (auto sub = out.lower_bound(rel + "/"); sub != out.end() &&
+                         sub->first.compare(0, rel.size() + 1, rel + "/") == 0; )
+                        sub = out.erase(sub);
+                }
+                out[rel] = n;
+                if (!rel.empty()) {
+                    auto p = out.find(parent);
+                    if (p != out.end())
+                        p->second.children.insert(name_of(rel));
+                }
+            }
+            // overlayfs reports its own device, a type from a listing gets a default mode
+            sim_node &m = out[rel];
+            if (m.lst.st_mode == 0 && m.type != DT_UNKNOWN)
+                m.lst.st_mode = DTTOIF(m.type) | ((m.type == DT_DIR)? 0755 : 0644);
+            if (m.st.st_mode == 0 && m.type != DT_LNK)
+                m.st.st_mode = m.lst.st_mode;
+            m.st.st_dev = m.lst.st_dev = dev;
+        }
+    }
+    // a merged listing is only complete if every layer is known there
+    for (auto &[rel, n] : out) {
+        if (!is_dir(n))
+            continue;
+        n.listed = true;
+        for (auto &l : layers)
+            n.listed = n.listed && layer_knows(l, rel);
+        if (!n.listed)
+            n.children.clear();
+    }
+    return out;
+}
+
+struct sim_vfs {
+    sim_tree nodes;
+    // subtrees hidden by a mount, put back when it is unmounted
+    vector<pair<string, sim_tree>> covered;
+    dev_t next_dev = 0x7f000000;
+
+    // path and everything below it, taken out of the model
+    sim_tree take(const string &path) {
+        sim_tree out;
+        auto it = nodes.find(path);
+        if (it != nodes.end()) {
+            out[""] = std::move(it->second);
+            nodes.erase(it);
+        }
+        string prefix = (path == "/")? "/" : path + "/";
+        for (it = nodes.lower_bound(prefix); it != nodes.end() &&
+             it->first.compare(0, prefix.size(), prefix) == 0; ) {
+            out[it->first.substr(prefix.size() - 1)] = std::move(it->second);
+            it = nodes.erase(it);
+        }
+        return out;
+    }
+
+    sim_tree copy(const string &path) const {
+        sim_tree out;
+        auto it = nodes.find(path);
+        if (it != nodes.end())
+            out[""] = it->second;
+        string prefix = (path == "/")? "/" : path + "/";
+        for (it = nodes.lower_bound(prefix); it != nodes.end() &&
+             it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+            out[it->first.substr(prefix.size() - 1)] = it->second;
+        return out;
+    }
+
+    void put(const string &path, sim_tree &&tree) {
+        for (auto &[rel, n] : tree)
+            nodes[join(path, rel)] = std::move(n);
+    }
+
+    void seed_stat(const string &path, bool follow, int ret, int err, const vector<string_view> &args) {
+        sim_node &n = nodes[path];
+        if (ret != 0) {
+            if (n.state == 0 && err == ENOENT)
+                n.state = -1;
+            return;
+        }
+        // the first answer is the tree before the boot
+        if (n.state < 0)
+            return;
+        n.state = 1;
+        struct stat &st = follow? n.st : n.lst;
+        if (st.st_mode != 0)
+            return;
+        parse_stat(args, &st);
+        if (!follow)
+            n.type = IFTODT(st.st_mode);
+    }
+
+    void seed_list(const string &path, int ret, int err, const vector<pair<string, unsigned char>> &entries) {
+        sim_node &n = nodes[path];
+        if (ret != 0) {
+            if (n.state == 0 && err == ENOENT)
+                n.state = -1;
+            return;
+        }
+        if (n.state < 0 || n.listed)
+            return;
+        n.state = 1;
+        n.type = DT_DIR;
+        n.listed = true;
+        for (auto &[name, type] : entries) {
+            n.children.insert(name);
+            sim_node &c = nodes[join(path, "/" + name)];
+            if (c.state == 0)
+                c.state = 1;
+            if (c.type == DT_UNKNOWN)
+                c.type = type;
+        }
+    }
+
+    void seed_con(const string &path, int ret, const string &con) {
+        sim_node &n = nodes[path];
+        if (ret >= 0 && !n.has_con) {
+            n.has_con = true;
+            n.con = con;
+        }
+    }
+
+    // false if the model does not know, else ret and errno are the answer
+    bool stat(const string &path, bool follow, struct stat *st, int &ret) {
+        auto it = nodes.find(path);
+        if (it == nodes.end() || it->second.state == 0) {
+            // a listing of the parent has every entry
+            auto p = nodes.find(parent_of(path));
+            if (p == nodes.end() || !(p->second.state < 0 || p->second.listed))
+                return false;
+            errno = ENOENT;
+            ret = -1;
+            return true;
+        }
+        const sim_node &n = it->second;
+        if (n.state < 0) {
+            errno = ENOENT;
+            ret = -1;
+            return true;
+        }
+        bool link = n.type == DT_LNK || S_ISLNK(n.lst.st_mode);
+        const struct stat *known;
+        if (follow)
+            known = n.st.st_mode? &n.st : (n.lst.st_mode && !link)? &n.lst : nullptr;
+        else
+            known = n.lst.st_mode? &n.lst : (n.st.st_mode && n.type != DT_UNKNOWN && !link)? &n.st : nullptr;
+        if (known) {
+            *st = *known;
+            ret = 0;
+            return true;
+        }
+        if (n.type == DT_UNKNOWN || (follow && link))
+            return false;
+        // only the type is known from a listing, owner and device are the parent's
+        *st = {};
+        auto p = nodes.find(parent_of(path));
+        if (p != nodes.end()) {
+            const struct stat &ps = p->second.lst.st_mode? p->second.lst : p->second.st;
+            st->st_dev = ps.st_dev;
+            st->st_uid = ps.st_uid;
+            st->st_gid = ps.st_gid;
+        }
+        st->st_mode = DTTOIF(n.type) | ((n.type == DT_DIR)? 0755 : 0644);
+        ret = 0;
+        return true;
+    }
+
+    bool list(const string &path, dir_list &out, int &ret) {
+        auto it = nodes.find(path);
+        if (it != nodes.end() && it->second.state < 0) {
+            errno = ENOENT;
+            ret = -1;
+            return true;
+        }
+        if (it == nodes.end() || !it->second.listed)
+            return false;
+        out.clear();
+        for (auto &name : it->second.children) {
+            auto c = nodes.find(join(path, "/" + name));
+            add_entry(out, name, (c == nodes.end())? DT_UNKNOWN : c->second.type);
+        }
+        ret = 0;
+        return true;
+    }
+
+    // new files get the label of their directory
+    bool con(const string &path, string &out, int &ret) {
+        struct stat st;
+        if (!stat(path, false, &st, ret))
+            return false;
+        if (ret < 0)
+            return true;
+        for (string p = path; !p.empty(); p = parent_of(p)) {
+            auto it = nodes.find(p);
+            if (it != nodes.end() && it->second.has_con) {
+                out = it->second.con;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void made_dir(const string &path, mode_t mode) {
+        sim_node n;
+        n.state = 1;
+        n.type = DT_DIR;
+        n.listed = true;
+        n.st.st_mode = S_IFDIR | (mode & 07777);
+        auto p = nodes.find(parent_of(path));
+        if (p != nodes.end()) {
+            n.st.st_dev = p->second.lst.st_mode? p->second.lst.st_dev : p->second.st.st_dev;
+            if (p->second.listed)
+                p->second.children.insert(name_of(path));
+        }
+        n.lst = n.st;
+        nodes[path] = std::move(n);
+    }
+
+    void removed(const string &path) {
+        take(path);
+        nodes[path].state = -1;
+        auto p = nodes.find(parent_of(path));
+        if (p != nodes.end())
+            p->second.children.erase(name_of(path));
+    }
+
+    void labeled(const string &path, const char *con) {
+        sim_node &n = nodes[path];
+        n.has_con = true;
+        n.con = con? con : "";
+    }
+
+    void mounted(const string &target, sim_tree &&tree) {
+        covered.emplace_back(target, take(target));
+        sim_node &root = tree[""];
+        root.state = 1;
+        if (root.type == DT_UNKNOWN)
+            root.type = DT_DIR;
+        put(target, std::move(tree));
+    }
+
+    void unmounted(const string &target, bool detach) {
+        for (size_t i = covered.size(); i-- > 0; ) {
+            if (covered[i].first != target)
+                continue;
+            take(target);
+            put(target, std::move(covered[i].second));
+            // mounts made on top of it went with it
+            for (size_t j = covered.size(); detach && j-- > i + 1; ) {
+                if (under(covered[j].first, target))
+                    covered.erase(covered.begin() + j);
+            }
+            covered.erase(covered.begin() + i);
+            return;
+        }
+    }
+
+    sim_tree fresh_dir() {
+        sim_tree tree;
+        sim_node &n = tree[""];
+        n.state = 1;
+        n.type = DT_DIR;
+        n.listed = true;
+        n.st.st_mode = S_IFDIR | 0755;
+        n.st.st_dev = next_dev++;
+        n.lst = n.st;
+        return tree;
+    }
+};
+
+// ---------------- simulator ----------------
+
+struct sim_call {
+    uint64_t ns;
+    int ret;
+    int err;
+    // "<call> <normalized path>"
+    string key;
+    // fields after the path, escaped
+    vector<string_view> args;
+    bool used;
+};
+
+struct sim_mount {
+    string target;
+    string type;
+};
+
+struct trace_simulator : sys_ops {
+    string trace, writable, scratch;
+    // owns the trace, string_views point into it
+    vector<char> data;
+    vector<sim_call> calls;
+    // "<call> <normalized path>" -> calls in recorded order, next one to replay
+    unordered_map<string, pair<vector<size_t>, size_t>> index;
+    unordered_map<string, vector<string_view>> files;
+    unordered_map<string, size_t> file_next;
+    unordered_map<string, pair<bool, string>> envs;
+    unordered_map<string, string> props;
+    // tree the calls are answered from when the trace has nothing, mounts made
+    sim_vfs vfs;
+    vector<sim_mount> mounts;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t start = prof_now();
+    uint64_t kernel_ns = 0;
+    size_t unrecorded = 0;
+    // unrecorded calls answered by the model
+    size_t modeled = 0;
+    // calls and matched calls per kind
+    unordered_map<string, pair<size_t, size_t>> counts;
+
+    // writable (recorded) or scratch (replayed) become @W, the random staging dir @STAGE
+    // and stays apart from the real path it mirrors
+    static string normalize(const string &path, const string &dir) {
+        string p = under(path, dir)? "@W" + path.substr(dir.size()) : path;
+        size_t len = strlen(STAGING_PREFIX);
+        if (p.compare(0, len, STAGING_PREFIX) == 0) {
+            size_t end = p.find('/', len);
+            p = (end == string::npos)? "@STAGE" : "@STAGE" + p.substr(end);
+        }
+        return p;
+    }
+
+    // scratch is real, except where a simulated mount (the master) covers it
+    // dirfd relative paths of dir_builder are always under scratch
+    bool local_locked(const char *path) {
+        if (path == nullptr)
+            return false;
+        if (strncmp(path, "/proc/self/fd/", 14) == 0)
+            return true;
+        if (!under(path, scratch))
+            return false;
+        for (auto &m : mounts) {
+            if (under(path, m.target))
+                return false;
+        }
+        return true;
+    }
+
+    bool local(const char *path) {
+        pthread_mutex_lock(&lock);
+        bool ret = local_locked(path);
+        pthread_mutex_unlock(&lock);
+        return ret;
+    }
+
+    string key_path(const char *path) {
+        return normalize(path? path : "", scratch);
+    }
+
+    // the first answers of stat, list and label calls are the tree before the boot
+    void seed(const sim_call &c, const string &path, const char *call) {
+        if (strcmp(call, "stat") == 0 || strcmp(call, "lstat") == 0) {
+            vfs.seed_stat(path, call[0] == 's', c.ret, c.err, c.args);
+        } else if (strcmp(call, "list") == 0) {
+            vector<pair<string, unsigned char>> entries;
+            string name;
+            for (size_t i = 1; c.ret == 0 && i < c.args.size(); i++) {
+                size_t slash = c.args[i].find('/');
+                if (slash == string_view::npos)
+                    continue;
+                unescape(c.args[i].substr(slash + 1), name);
+                entries.emplace_back(name, atoi(string(c.args[i].substr(0, slash)).data()));
+            }
+            vfs.seed_list(path, c.ret, c.err, entries);
+        } else if (strcmp(call, "con") == 0 && !c.args.empty()) {
+            string con;
+            unescape(c.args[0], con);
+            vfs.seed_con(path, c.ret, con);
+        }
+    }
+
+    // a layer or bind source as a tree, the scratch dir is read from the host
+    sim_tree layer_tree(const string &path) {
+        if (!local_locked(path.data()))
+            return vfs.copy(key_path(path.data()));
+        sim_tree tree;
+        size_t budget = 100000;
+        import(path, "", tree, budget);
+        return tree;
+    }
+
+    void import(const string &path, const string &rel, sim_tree &tree, size_t &budget) {
+        struct stat st;
+        if (sys_ops::lstat(path.data(), &st) != 0)
+            return;
+        sim_node &n = tree[rel];
+        n.state = 1;
+        n.type = IFTODT(st.st_mode);
+        n.lst = st;
+        if (!S_ISLNK(st.st_mode))
+            n.st = st;
+        dir_list list;
+        if (!S_ISDIR(st.st_mode) || sys_ops::list_dir(path.data(), list) != 0 || list.size() > budget)
+            return;
+        budget -= list.size();
+        n.listed = true;
+        for (size_t i = 0; i < list.size(); i++) {
+            n.children.insert(list.name(i));
+            import(path + "/" + list.name(i), rel + "/" + list.name(i), tree, budget);
+        }
+    }
+
+    // what target shows after a successful mount, caller holds lock
+    void model_mount(const char *src, const char *target, const char *type,
+                     unsigned long flags, const char *data) {
+        string fs = type? type : "";
+        sim_tree tree;
+        if (flags & MS_MOVE) {
+            tree = vfs.copy(key_path(src));
+            vfs.unmounted(key_path(src), true);
+        } else if (flags & MS_BIND) {
+            tree = layer_tree(src? src : "");
+        } else if (fs == "tmpfs") {
+            tree = vfs.fresh_dir();
+        } else if (fs == "overlay" && data) {
+            // upperdir first, then lowerdir top first
+            string upper, lower;
+            string_view opts = data;
+            while (!opts.empty()) {
+                size_t comma = opts.find(',');
+                string_view opt = opts.substr(0, comma);
+                if (opt.substr(0, 9) == "upperdir=")
+                    upper = opt.substr(9);
+                else if (opt.substr(0, 9) == "lowerdir=")
+                    lower = opt.substr(9);
+                opts.remove_prefix((comma == string_view::npos)? opts.size() : comma + 1);
+            }
+            vector<sim_tree> layers;
+            if (!upper.empty())
+                layers.push_back(layer_tree(upper));
+            for (size_t pos = 0; pos <= lower.size() && !lower.empty(); ) {
+                size_t colon = lower.find(':', pos);
+                if (colon == string::npos)
+                    colon = lower.size();
+                layers.push_back(layer_tree(lower.substr(pos, colon - pos)));
+                pos = colon + 1;
+            }
+            bool known = !layers.empty();
+            for (auto &l : layers) {
+                auto root = l.find("");
+                known = known && root != l.end() && root->second.state == 1;
+            }
+            if (known)
+                tree = merge_layers(layers, vfs.next_dev++);
+        }
+        // anything else, like an ext4 image, is an unknown directory
+        vfs.mounted(key_path(target), std::move(tree));
+    }
+
+    bool parse() {
+        const char *p = data.data(), *end = p + data.size();
+        bool header = false;
+        string a, b;
+        while (p < end) {
+            const char *eol = (const char *) memchr(p, '\n', end - p);
+            if (eol == nullptr)
+                eol = end;
+            vector<string_view> tok;
+            for (const char *t = p; t < eol; ) {
+                const char *sp = (const char *) memchr(t, ' ', eol - t);
+                if (sp == nullptr)
+                    sp = eol;
+                tok.emplace_back(t, sp - t);
+                t = sp + 1;
+            }
+            p = eol + 1;
+            if (!header) {
+                if (tok.size() != 3 || tok[0] != "OVLTRACE" || tok[1] != "1")
+                    return false;
+                unescape(tok[2], writable);
+                header = true;
+                continue;
+            }
+            if (tok.empty())
+                continue;
+            if (tok[0] == "file" && tok.size() == 3) {
+                size_t len = strtoull(string(tok[2]).data(), nullptr, 10);
+                if (len > (size_t) (end - p))
+                    return false;
+                unescape(tok[1], a);
+                files[a].emplace_back(p, len);
+                p += len + 1;
+            } else if (tok[0] == "env" && tok.size() == 3) {
+                unescape(tok[1], a);
+                bool set = unescape(tok[2], b);
+                envs[a] = { set, b };
+            } else if (tok[0] == "prop" && tok.size() == 3) {
+                unescape(tok[1], a);
+                unescape(tok[2], b);
+                props[a] = b;
+            } else if (tok.size() >= 5) {
+                sim_call c;
+                c.ns = strtoull(string(tok[1]).data(), nullptr, 10);
+                c.ret = atoi(string(tok[2]).data());
+                c.err = atoi(string(tok[3]).data());
+                c.args.assign(tok.begin() + 5, tok.end());
+                c.used = false;
+                unescape(tok[4], a);
+                string path = normalize(a, writable);
+                c.key = string(tok[0]) + " " + path;
+                seed(c, path, string(tok[0]).data());
+                index[c.key].first.push_back(calls.size());
+                calls.emplace_back(std::move(c));
+            }
+        }
+        return header;
+    }
+
+    // next recorded result of call on path, the last one again once all were replayed
+    // nullptr if the call was never recorded, caller holds lock
+    const sim_call *next(const char *call, const char *path) {
+        auto &cnt = counts[call];
+        cnt.first++;
+        string key = string(call) + " " + normalize(path? path : "", scratch);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            LOGD("trace: not recorded: %s\n", key.data());
+            unrecorded++;
+            return nullptr;
+        }
+        auto &q = it->second;
+        sim_call &c = calls[q.first[min(q.second, q.first.size() - 1)]];
+        if (q.second < q.first.size())
+            q.second++;
+        c.used = true;
+        cnt.second++;
+        kernel_ns += c.ns;
+        return &c;
+    }
+
+    // recorded result, errno set on failure
+    static int result(const sim_call *c) {
+        if (c->ret < 0)
+            errno = c->err;
+        return c->ret;
+    }
+
+    int mount(const char *src, const char *target, const char *type,
+              unsigned long flags, const void *data) override {
+        pthread_mutex_lock(&lock);
+        const sim_call *c = next("op", target);
+        int ret = c? result(c) : 0;
+        int err = errno;
+        // remount and propagation changes do not add a mount
+        if (ret == 0 && !(flags & (MS_REMOUNT | MS_SHARED | MS_PRIVATE | MS_SLAVE | MS_UNBINDABLE))) {
+            model_mount(src, target, type, flags, (const char *) data);
+            mounts.push_back({ target, type? type : "" });
+        }
+        pthread_mutex_unlock(&lock);
+        errno = err;
+        return ret;
+    }
+
+    int umount2(const char *target, int flags) override {
+        pthread_mutex_lock(&lock);
+        const sim_call *c = next("op", target);
+        int ret = c? result(c) : 0;
+        int err = errno;
+        if (ret == 0) {
+            // a detached mount takes everything under it along
+            for (auto it = mounts.rbegin(); it != mounts.rend(); ++it) {
+                if (it->target == target) {
+                    mounts.erase(std::next(it).base());
+                    break;
+                }
+            }
+            if (flags & MNT_DETACH) {
+                mounts.erase(remove_if(mounts.begin(), mounts.end(),
+                    [&](auto &m) { return under(m.target, target); }), mounts.end());
+            }
+            vfs.unmounted(key_path(target), flags & MNT_DETACH);
+        }
+        pthread_mutex_unlock(&lock);
+        errno = err;
+        return ret;
+    }
+
+    int mkdir(const char *path, mode_t mode) override {
+        if (local(path))
+            return sys_ops::mkdir(path, mode);
+        pthread_mutex_lock(&lock);
+        const sim_call *c = next("mkdir", path);
+        int ret;
+        struct stat st;
+        if (c) {
+            ret = result(c);
+        } else if (vfs.stat(key_path(path), false, &st, ret) && (modeled++, ret == 0)) {
+            errno = EEXIST;
+            ret = -1;
+        } else {
+            ret = 0;
+        }
+        int err = errno;
+        if (ret == 0)
+            vfs.made_dir(key_path(path), mode);
+        pthread_mutex_unlock(&lock);
+        errno = err;
+        return ret;
+    }
+
+    int rmdir(const char *path) override {
+        if (local(path))
+            return sys_ops::rmdir(path);
+        pthread_mutex_lock(&lock);
+        const sim_call *c = next("rmdir", path);
+        int ret;
+        struct stat st;
+        if (c) {
+            ret = result(c);
+        } else if (!vfs.stat(key_path(path), false, &st, ret)) {
+            errno = ENOENT;
+            ret = -1;
+        } else {
+            modeled++;
+            if (ret == 0 && !S_ISDIR(st.st_mode)) {
+                errno = ENOTDIR;
+                ret = -1;
+            }
+        }
+        int err = errno;
+        if (ret == 0)
+            vfs.removed(key_path(path));
+        pthread_mutex_unlock(&lock);
+        errno = err;
+        return ret;
+    }
+
+    int replay_stat(const char *call, const char *path, struct stat *st) {
+        pthread_mutex_lock(&lock);
+        const sim_call *c = next(call, path);
+        int ret;
+        memset(st, 0, sizeof(*st));
+        if (c) {
+            ret = result(c);
+            if (ret == 0)
+                parse_stat(c->args, st);
+        } else if (vfs.stat(key_path(path), call[0] == 's', st, ret)) {
+            modeled++;
+        } else {
+            errno = ENOENT;
+            ret = -1;
+        }
+        int err = errno;
+        pthread_mutex_unlock(&lock);
+        errno = err;
+        return ret;
+    }
+
+    int stat(const char *path, struct stat *st) override {
+        return local(path)? sys_ops::stat(path, st) : replay_stat("stat", path, st);
+    }
+
+    int lstat(const char *path, struct stat *st) override {
+        return local(path)? sys_ops::lstat(path, st) : replay_stat("lstat", path, st);
+    }
+
+    int getfilecon(const char *path, string &con) override {
+        if (local(path))
+            return sys_ops::getfilecon(path, con);
+        pthread_mutex_lock(&lock);
+        const sim_call *c = next("con", path);
+        int ret = 0;
+        con.clear();
+        if (c) {
+            ret = result(c);
+            if (ret >= 0 && !c->args.empty())
+                unescape(c->args[0], con);
+        } else if (vfs.con(key_path(path), con, ret)) {
+            modeled++;
+        } else {
+            errno = ENODATA;
+            ret = -1;
+        }
+        int err = errno;
+        pthread_mutex_unlock(&lock);
+        errno = err;
+        return ret;
+    }
+
+    // the scratch dir may be on a filesystem without labels, nothing to check there
+    int lsetfilecon(const char *path, const char *con) override {
+        if (local(path))
+            return 0;
+        pthread_mutex_lock(&lock);
+        const sim_call *c = next("setcon", path);
+        int ret = c? result(c) : 0;
+        int err = errno;
+        if (ret == 0)
+            vfs.labeled(key_path(path), con);
+        pthread_mutex_unlock(&lock);
+        errno = err;
+        return ret;
+    }
+
+    int list_dir(const char *path, dir_list &out) override {
+        if (local(path))
+            return sys_ops::list_dir(path, out);
+        pthread_mutex_lock(&lock);
+        const sim_call *c = next("list", path);
+        int ret;
+        out.clear();
+        if (c) {
+            ret = result(c);
+            string name;
+            for (size_t i = 1; ret == 0 && i < c->args.size(); i++) {
+                auto arg = c->args[i];
+                size_t slash = arg.find('/');
+                if (slash == string_view::npos)
+                    continue;
+                unescape(arg.substr(slash + 1), name);
+                add_entry(out, name, atoi(string(arg.substr(0, slash)).data()));
+            }
+        } else if (vfs.list(key_path(path), out, ret)) {
+            modeled++;
+        } else {
+            errno = ENOENT;
+            ret = -1;
+        }
+        int err = errno;
+        pthread_mutex_unlock(&lock);
+        errno = err;
+        return ret;
+    }
+
+    bool read_file(const char *path, vector<char> &out) override {
+        pthread_mutex_lock(&lock);
+        auto &cnt = counts["file"];
+        cnt.first++;
+        auto it = files.find(path);
+        bool ok = it != files.end();
+        if (ok) {
+            size_t &i = file_next[path];
+            auto &content = it->second[min(i, it->second.size() - 1)];
+            if (i < it->second.size())
+                i++;
+            out.assign(content.begin(), content.end());
+            cnt.second++;
+        } else {
+            unrecorded++;
+        }
+        pthread_mutex_unlock(&lock);
+        if (!ok)
+            errno = ENOENT;
+        return ok;
+    }
+
+    const char *getenv(const char *name) override {
+        auto it = envs.find(name);
+        if (it == envs.end() || !it->second.first)
+            return nullptr;
+        return it->second.second.data();
+    }
+
+    string getprop(const char *name) override {
+        auto it = props.find(name);
+        return (it == props.end())? "" : it->second;
+    }
+
+    bool native() const override { return false; }
+
+    void finish() override {
+        size_t unconsumed = 0;
+        for (auto &c : calls) {
+            if (!c.used) {
+                LOGD("trace: not replayed: %s\n", c.key.data());
+                unconsumed++;
+            }
+        }
+        string kinds;
+        for (auto &it : counts) {
+            char buf[128];
+            snprintf(buf, sizeof(buf), "%s\n    \"%s\": {\"calls\": %zu, \"recorded\": %zu}",
+                     kinds.empty()? "" : ",", it.first.data(), it.second.first, it.second.second);
+            kinds += buf;
+        }
+        printf("{\n  \"trace\": \"%s\",\n  \"writable\": \"%s\",\n  \"scratch\": \"%s\",\n"
+               "  \"records\": %zu,\n  \"calls\": {%s\n  },\n  \"unrecorded\": %zu,\n  \"modeled\": %zu,\n"
+               "  \"unconsumed\": %zu,\n"
+               "  \"recorded_kernel_us\": %llu,\n  \"replay_us\": %llu,\n  \"mounts\": %zu\n}\n",
+               trace.data(), writable.data(), scratch.data(), calls.size(), kinds.data(), unrecorded,
+               modeled, unconsumed, (unsigned long long) (kernel_ns / 1000),
+               (unsigned long long) ((prof_now() - start) / 1000), mounts.size());
+        fflush(stdout);
+    }
+};
+
+sys_ops *sys_simulator(const char *trace, const char *scratch) {
+    auto sim = new trace_simulator();
+    sim->trace = trace;
+    sim->scratch = scratch;
+    if (!kernel_ops.read_file(trace, sim->data) || !sim->parse()) {
+        LOGE("trace: cannot read %s\n", trace);
+        delete sim;
+        return nullptr;
+    }
+    LOGI("trace: %zu calls recorded on %s\n", sim->calls.size(), sim->writable.data());
+    return sim;
+}
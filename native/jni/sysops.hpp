@@ -0,0 +1,51 @@
+#pragma once
+#include "base.hpp"
+#include "dirscan.hpp"
+
+// Syscall backends
+// Path based calls of the mount logic (mount, umount2, mkdir, stat, SELinux labels,
+// directory listings, /proc files, environment) go through sys(), so the same code
+// can run against the kernel, record what it does on a device, or replay that
+// recording as an unprivileged user on any Linux box:
+// kernel    - plain syscalls, the default
+// recorder  - kernel, and every call with its result and latency, the mountinfo
+//             snapshot and the environment are appended to a trace (OVERLAY_TRACE)
+// simulator - answers from a trace (--replay), calls the trace has no answer for
+//             from a directory and attribute model seeded by it, which mounts,
+//             mkdir and rmdir change. Paths under the scratch dir which stands in
+//             for the writable dir of the device still go to the host kernel
+struct sys_ops {
+    virtual ~sys_ops() {}
+    virtual int mount(const char *src, const char *target, const char *type,
+                      unsigned long flags, const void *data);
+    virtual int umount2(const char *target, int flags);
+    virtual int mkdir(const char *path, mode_t mode);
+    virtual int rmdir(const char *path);
+    virtual int stat(const char *path, struct stat *st);
+    virtual int lstat(const char *path, struct stat *st);
+    // con is empty if path has no label
+    virtual int getfilecon(const char *path, std::string &con);
+    virtual int lsetfilecon(const char *path, const char *con);
+    // like scan_dir, but the directory is not kept open
+    virtual int list_dir(const char *path, dir_list &out);
+    // whole file, /proc files included
+    virtual bool read_file(const char *path, std::vector<char> &out);
+    virtual const char *getenv(const char *name);
+    virtual std::string getprop(const char *name);
+    // false if calls do not reach the kernel, fd based mount APIs cannot be used then
+    virtual bool native() const { return true; }
+    // every mount operation reported to the profiler, fsmount and move_mount included
+    virtual void on_mount(const char *op, const char *src, const char *target, const char *type,
+                          unsigned long flags, uint64_t ns, int ret, int err) {}
+    // flush trace or print the replay summary
+    virtual void finish() {}
+};
+
+// backend in use
+sys_ops &sys();
+void sys_use(sys_ops *ops);
+// record calls of writable into trace, nullptr if trace cannot be created
+sys_ops *sys_recorder(const char *trace, const char *writable);
+// replay trace, scratch stands in for the writable dir it was recorded with
+// nullptr if trace cannot be read
+sys_ops *sys_simulator(const char *trace, const char *scratch);
@@ -0,0 +1,35 @@
+#include "threadpool.hpp"
+#include <pthread.h>
+
+struct pool_ctx {
+    size_t n;
+    std::atomic<size_t> next;
+    const std::function<void(size_t)> *fn;
+};
+
+static void *pool_worker(void *arg) {
+    auto ctx = static_cast<pool_ctx *>(arg);
+    size_t i;
+    while ((i = ctx->next.fetch_add(1)) < ctx->n)
+        (*ctx->fn)(i);
+    return nullptr;
+}
+
+void parallel_for(size_t n, int jobs, const std::function<void(size_t)> &fn) {
+    pool_ctx ctx;
+    ctx.n = n;
+    ctx.next = 0;
+    ctx.fn = &fn;
+    if (jobs > (int) n)
+        jobs = n;
+    std::vector<pthread_t> threads;
+    for (int i = 1; i < jobs; i++) {
+        pthread_t t;
+        if (pthread_create(&t, nullptr, pool_worker, &ctx) == 0)
+            threads.push_back(t);
+    }
+    // calling thread works too, so everything is still done if no thread can be spawned
+    pool_worker(&ctx);
+    for (auto t : threads)
+        pthread_join(t, nullptr);
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "base.hpp"
+#include <functional>
+#include <atomic>
+
+// run fn(0) ... fn(n - 1) on at most jobs threads, calling thread included
+// returns when all items are done, order of execution is not specified
+void parallel_for(size_t n, int jobs, const std::function<void(size_t)> &fn);
@@ -1,5 +1,28 @@
 #include "logging.hpp"
 #include "base.hpp"
+#include "profiler.hpp"
+#include "sysops.hpp"
+#include "dirscan.hpp"
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <atomic>
+
+#define OVL_IOPRIO_WHO_PROCESS 1
+#define OVL_IOPRIO_CLASS_IDLE 3
+#define OVL_IOPRIO_CLASS_SHIFT 13
+
+// not in older bionic headers
+#ifndef __NR_copy_file_range
+#if defined(__aarch64__)
+#define __NR_copy_file_range 285
+#elif defined(__x86_64__)
+#define __NR_copy_file_range 326
+#elif defined(__arm__)
+#define __NR_copy_file_range 391
+#elif defined(__i386__)
+#define __NR_copy_file_range 377
+#endif
+#endif
 
 std::string random_strc(int n){
     std::string result = "";
@@ -28,12 +51,14 @@ bool starts_with(const char *s, const char *ss) {
 
 bool is_dir(const char *path) {
     struct stat st;
-    return stat(path, &st) == 0 &&
+    prof_syscall();
+    return sys().stat(path, &st) == 0 &&
            S_ISDIR(st.st_mode);
 }
 
 bool mkdir_ensure(const char *path, int mode) {
-    mkdir(path, mode);
+    prof_syscall();
+    sys().mkdir(path, mode);
     return is_dir(path);
 }
 
@@ -55,11 +80,13 @@ int mkdirs(const char *path, int mode) {
         return 0;
     while ((ss = strchr(ss, '/')) != nullptr) {
         ss[0] = '\0';
-        mkdir(s, mode);
+        prof_syscall();
+        sys().mkdir(s, mode);
         ss[0] = '/';
         ss++;
     }
-    int ret = mkdir(s, mode);
+    prof_syscall();
+    int ret = sys().mkdir(s, mode);
     return ret;
 }
 
@@ -92,21 +119,24 @@ char *dirname2(const char *path) {
 int getmod(const char *file) {
     int mode = 0;
     struct stat st;
-    if (stat(file, &st))
+    prof_syscall();
+    if (sys().stat(file, &st))
         return -1;
     return st.st_mode & 0777;
 }
 
 int getuidof(const char *file) {
     struct stat st;
-    if (stat(file, &st))
+    prof_syscall();
+    if (sys().stat(file, &st))
         return -1;
     return st.st_uid;
 }
 
 int getgidof(const char *file) {
     struct stat st;
-    if (stat(file, &st))
+    prof_syscall();
+    if (sys().stat(file, &st))
         return -1;
     return st.st_gid;
 }
@@ -129,20 +159,109 @@ int dump_file(const char *src, const char *dest) {
 }
 
 
+static std::atomic<bool> no_copy_range{false};
+
+int copy_fd(int src, int dst, off_t size) {
+    off_t done = 0;
+#ifdef __NR_copy_file_range
+    while (!no_copy_range && done < size) {
+        prof_syscall();
+        ssize_t n = syscall(__NR_copy_file_range, src, nullptr, dst, nullptr, (size_t) (size - done), 0);
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+            // not across filesystems on this kernel, the offsets are untouched
+            no_copy_range = true;
+            break;
+        }
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+#endif
+    char buf[65536];
+    ssize_t n = 0;
+    while (done < size && (n = read(src, buf, sizeof(buf))) > 0) {
+        prof_syscall(2);
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(dst, buf + off, n - off);
+            if (w < 0)
+                return -1;
+            off += w;
+        }
+        done += n;
+    }
+    if (n < 0)
+        return -1;
+    // the file shrank while it was copied, a short copy is not a copy
+    if (done < size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+void rm_rf(int dirfd, const char *name) {
+    dir_list list;
+    int fd = scan_dir(dirfd, name, list);
+    if (fd >= 0) {
+        for (size_t i = 0; i < list.size(); i++) {
+            if (list.type(i) == DT_DIR)
+                rm_rf(fd, list.name(i));
+            else
+                unlinkat(fd, list.name(i), 0);
+        }
+        close(fd);
+    }
+    unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+pid_t fork_background() {
+    // lines still buffered would be written by both processes
+    log_flush();
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    // mount.sh reads stdout of the parent until every copy of it is closed
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (null >= 0) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+    syscall(__NR_ioprio_set, OVL_IOPRIO_WHO_PROCESS, 0, OVL_IOPRIO_CLASS_IDLE << OVL_IOPRIO_CLASS_SHIFT);
+    setpriority(PRIO_PROCESS, 0, 19);
+    return 0;
+}
+
 int verbose_mount(const char *a, const char *b, const char *c, int d, const char *e) {
-    int ret = mount(a,b,c,d,e);
+    uint64_t start = prof_now();
+    int ret = sys().mount(a,b,c,d,e);
+    int err = errno;
+    prof_mount("mount", a, b, c, d, start, ret, (ret == 0)? 0 : err);
+    errno = err;
     if (ret == 0) {
-        LOGD("mount: %s%s%s%s\n", b, (a != nullptr && a[0] != '\0')? std::string(std::string(" <- ") + a).data() : "",
-            c? std::string(std::string(" (") + c + ")").data() : "", e? std::string(std::string(" [") + e + "]").data() : "");
+        bool src = a != nullptr && a[0] != '\0';
+        LOGD("mount: %s%s%s%s%s%s%s%s%s\n", b,
+            src? " <- " : "", src? a : "",
+            c? " (" : "", c? c : "", c? ")" : "",
+            e? " [" : "", e? e : "", e? "]" : "");
     } else {
-        PLOGE("mount: %s%s", (a != nullptr && a[0] != '\0')? std::string(std::string(a) + " -> ").data() : "", b);
+        bool src = a != nullptr && a[0] != '\0';
+        PLOGE("mount: %s%s%s", src? a : "", src? " -> " : "", b);
     }
     return ret;
 }
 
 int verbose_umount(const char *a, int b) {
     LOGD("umount: %s\n", a);
-    return umount2(a,b);
+    uint64_t start = prof_now();
+    int ret = sys().umount2(a,b);
+    int err = errno;
+    prof_mount("umount", nullptr, a, nullptr, b, start, ret, (ret == 0)? 0 : err);
+    errno = err;
+    return ret;
 }
 
 bool str_empty(const char *str) {
@@ -150,8 +269,47 @@ bool str_empty(const char *str) {
 }
 
 const char *xgetenv(const char *name) {
-    const char *val = getenv(name);
+    const char *val = sys().getenv(name);
     LOGD("getenv: [%s]=[%s]\n", name? name : "", val? val : "");
     return val;
 }
 
+
+// FNV-1a, start with h = 0
+uint64_t hash_str(uint64_t h, std::string_view s) {
+    if (h == 0)
+        h = 14695981039346656037ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    // separator, so "ab" + "c" and "a" + "bc" are different
+    h ^= 0xff;
+    h *= 1099511628211ULL;
+    return h;
+}
+
+bool hash_file(const char *path, uint64_t &h) {
+    prof_syscall();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char buf[65536];
+    ssize_t n;
+    h = 0xcbf29ce484222325ULL;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        prof_syscall();
+        h = hash_str(h, std::string_view(buf, n));
+    }
+    close(fd);
+    return n == 0;
+}
+
+std::string get_build_fingerprint() {
+    std::string result;
+    for (auto prop : { "ro.build.fingerprint", "ro.vendor.build.fingerprint", "ro.system.build.fingerprint" }) {
+        result += sys().getprop(prop);
+        result += ';';
+    }
+    return result;
+}
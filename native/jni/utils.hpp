@@ -10,8 +10,19 @@ int getmod(const char *file);
 int getuidof(const char *file);
 int getgidof(const char *file);
 int dump_file(const char *src, const char *dest);
+// copy size bytes from the current offset of src, copy_file_range when the kernel allows it
+int copy_fd(int src, int dst, off_t size);
+// remove dirfd/name and everything under it
+void rm_rf(int dirfd, const char *name);
+// fork a child with stdio on /dev/null at idle I/O and lowest CPU priority
+// the output of the caller is flushed first, returns like fork()
+pid_t fork_background();
 int verbose_mount(const char *a, const char *b, const char *c, int d, const char *e);
 int verbose_umount(const char *a, int b);
 const char *xgetenv(const char *name);
 bool str_empty(const char *str);
+uint64_t hash_str(uint64_t h, std::string_view s);
+// hash_str of the whole content of path
+bool hash_file(const char *path, uint64_t &h);
+std::string get_build_fingerprint();
 